@@ -41,8 +41,15 @@ private:
   patching_error Err;
 };
 
+/// Builds the target tree with TargetTool and applies the script to it.
 llvm::Error patch(tooling::RefactoringTool &TargetTool, SyntaxTree &Src,
-                  SyntaxTree &Dst, std::string ScriptFilePath, const ComparisonOptions &Options,
+                  std::string MapFilePath, std::string ScriptFilePath, const ComparisonOptions &Options,
+                  bool Debug = false);
+
+/// Applies the script to an already built target tree, TargetTool is only
+/// used to collect replacements.
+llvm::Error patch(tooling::RefactoringTool &TargetTool, SyntaxTree &Src, SyntaxTree &Target,
+                  std::string MapFilePath, std::string ScriptFilePath, const ComparisonOptions &Options,
                   bool Debug = false);
 
 } // end namespace diff
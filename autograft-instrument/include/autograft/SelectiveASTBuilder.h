@@ -0,0 +1,61 @@
+//===- SelectiveASTBuilder.h - Parse only some function bodies -*- C++ -*- -===//
+//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares a tool action that builds ASTs with the bodies of
+// uninteresting functions skipped by the parser. Skipped functions are plain
+// declarations in the AST, so no syntax tree nodes are created for them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_ASTDIFF_SELECTIVEASTBUILDER_H
+#define LLVM_CLANG_TOOLING_ASTDIFF_SELECTIVEASTBUILDER_H
+
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Tooling/Tooling.h"
+#include <functional>
+
+namespace clang {
+namespace diff {
+
+/// Returns true if the body of the function D should be parsed. The body
+/// itself has not been seen by the parser yet.
+using BodyFilter =
+    std::function<bool(const Decl &D, const SourceManager &SM,
+                       const LangOptions &LangOpts)>;
+
+/// Keeps the bodies of functions that are defined in the main file.
+BodyFilter keepMainFileBodies();
+
+/// Keeps the bodies in the main file that span the given line.
+BodyFilter keepBodiesContainingLine(unsigned Line);
+
+/// Builds ASTs into ASTs like ClangTool::buildASTs() does, but skips the
+/// bodies that KeepBody rejects. Clang still parses bodies it needs for
+/// semantic analysis, such as those of constexpr functions.
+class SelectiveASTBuilder : public tooling::ToolAction {
+public:
+  SelectiveASTBuilder(std::vector<std::unique_ptr<ASTUnit>> &ASTs,
+                      BodyFilter KeepBody)
+      : ASTs(ASTs), KeepBody(std::move(KeepBody)) {}
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override;
+
+private:
+  std::vector<std::unique_ptr<ASTUnit>> &ASTs;
+  BodyFilter KeepBody;
+};
+
+} // end namespace diff
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_ASTDIFF_SELECTIVEASTBUILDER_H
@@ -16,8 +16,10 @@
 #include <iostream>
 #include <list>
 #include <vector>
+#include "autograft/ASTCache.h"
 #include "autograft/ASTDiff.h"
 #include "autograft/ASTPatch.h"
+#include "autograft/SelectiveASTBuilder.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Rewrite/Core/Rewriter.h"
 #include "clang/Tooling/Tooling.h"
@@ -32,6 +34,8 @@ using namespace clang::tooling;
 static cl::OptionCategory GizmoCategory("gizmo-instrument options");
 static cl::opt<std::string> Transformation("transformation", cl::desc("<transformation type>"), cl::Optional, cl::cat(GizmoCategory));
 static cl::opt<std::string> SourcePath("source", cl::desc("<source>"), cl::Required, cl::cat(GizmoCategory));
+static cl::opt<std::string> ASTCacheDir("ast-cache-dir", cl::desc("Directory for caching serialized ASTs across invocations"), cl::init(""), cl::Optional, cl::cat(GizmoCategory));
+static cl::opt<bool> SkipBodies("skip-function-bodies", cl::desc("Skip the bodies of functions outside the main file"), cl::init(false), cl::Optional, cl::cat(GizmoCategory));
 
 
 std::list<std::string>::iterator it;
@@ -56,14 +60,14 @@ getCompilationDatabase(StringRef Filename) {
 
 int instrumentCode(clang::diff::NodeRef node, Rewriter &rewriter){
   auto ChildBegin = node.begin(), ChildEnd = node.end();
-  std::string nodeType = node.getTypeLabel();
+  diff::NodeKind nodeKind = node.getKind();
 //  llvm::outs() << nodeType << "\n";
   int nodeId = node.getId();
   auto startLoc = node.getSourceBeginLocation();
 
 
-  if (nodeType == "IfStmt"){
-    auto ifNode = node.ASTNode.get<IfStmt>();
+  if (nodeKind == diff::NodeKind::IfStmt){
+    auto ifNode = node.getASTNode().get<IfStmt>();
     auto condNode = ifNode->getCond();
     auto thenNode = ifNode->getThen();
     SourceLocation condLocStart = condNode->getLocStart();
@@ -163,9 +167,24 @@ int main(int argc, const char **argv) {
     FileCompilations = getCompilationDatabase(SourcePath);
 
   std::array<std::string, 1> Files = {{SourcePath}};
-  RefactoringTool RefactorTool(CommonCompilations ? *CommonCompilations : *FileCompilations, Files);
+  const CompilationDatabase &Compilations = CommonCompilations ? *CommonCompilations : *FileCompilations;
+  RefactoringTool RefactorTool(Compilations, Files);
   std::vector<std::unique_ptr<ASTUnit>> SrcASTs;
-  RefactorTool.buildASTs(SrcASTs);
+  clang::diff::ASTCache Cache(ASTCacheDir);
+  // Units with skipped bodies are incomplete, they are kept out of the cache.
+  bool UseCache = !ASTCacheDir.empty() && !SkipBodies;
+  if (UseCache)
+    if (std::unique_ptr<ASTUnit> CachedAST = Cache.load(Compilations, SourcePath))
+      SrcASTs.push_back(std::move(CachedAST));
+  if (SrcASTs.empty()) {
+    if (SkipBodies) {
+      clang::diff::SelectiveASTBuilder Builder(SrcASTs, clang::diff::keepMainFileBodies());
+      RefactorTool.run(&Builder);
+    } else
+      RefactorTool.buildASTs(SrcASTs);
+    if (!SrcASTs.empty() && UseCache)
+      Cache.store(Compilations, SourcePath, *SrcASTs[0]);
+  }
 
   if (SrcASTs.size() == 0){
     llvm::errs() << "Error: Could not build AST for target\n";
@@ -185,8 +204,8 @@ int main(int argc, const char **argv) {
 //  llvm::outs() << sourceFileName << "\n";
 
   for (diff::NodeRef node : SrcTree) {
-    std::string nodeType = node.getTypeLabel();
-      if (nodeType == "FunctionDecl"){
+    diff::NodeKind nodeKind = node.getKind();
+      if (nodeKind == diff::NodeKind::FunctionDecl){
 //        llvm::outs() << node.getValue() << "\n";
         std::string fileName = node.getFileName();
 //        llvm::outs() << fileName << "\n";
@@ -0,0 +1,54 @@
+//===- CompilationDatabaseCache.h - Reusing loaded databases --*- C++ -*- -===//
+//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares a cache for the compilation databases found next to the
+// input files. The inputs of one run usually live in the same project, so its
+// compile_commands.json only needs to be loaded once.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_ASTDIFF_COMPILATIONDATABASECACHE_H
+#define LLVM_CLANG_TOOLING_ASTDIFF_COMPILATIONDATABASECACHE_H
+
+#include "clang/Tooling/CompilationDatabase.h"
+#include "llvm/ADT/StringMap.h"
+#include <mutex>
+
+namespace clang {
+namespace diff {
+
+/// Remembers which compilation database, if any, was found for each directory
+/// that has been searched. Databases stay loaded for the lifetime of the
+/// cache and are shared by all files that find them.
+///
+/// The cache is safe to use from several threads.
+class CompilationDatabaseCache {
+public:
+  /// Does what CompilationDatabase::autoDetectFromSource() does, but searches
+  /// every directory at most once. The returned database refers to the shared
+  /// one and may outlive the cache.
+  std::unique_ptr<tooling::CompilationDatabase>
+  autoDetectFromSource(StringRef SourceFile, std::string &ErrorMessage);
+
+private:
+  /// Returns the database in Directory or the closest of its parents, or null
+  /// if there is none.
+  std::shared_ptr<tooling::CompilationDatabase>
+  findFromDirectory(StringRef Directory, std::string &ErrorMessage);
+
+  std::mutex Mutex;
+  /// Null for directories without a database in them or their parents.
+  llvm::StringMap<std::shared_ptr<tooling::CompilationDatabase>> Databases;
+};
+
+} // end namespace diff
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_ASTDIFF_COMPILATIONDATABASECACHE_H
@@ -0,0 +1,86 @@
+//===- PreambleCache.h - Preambles shared between versions ----*- C++ -*- -===//
+//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares a cache of precompiled preambles. Different versions of
+// a file usually start with the same block of includes, the headers behind it
+// are compiled once and every version is parsed on top of the result.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_ASTDIFF_PREAMBLECACHE_H
+#define LLVM_CLANG_TOOLING_ASTDIFF_PREAMBLECACHE_H
+
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Frontend/PrecompiledPreamble.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+#include <future>
+#include <list>
+#include <mutex>
+
+namespace clang {
+namespace diff {
+
+/// Keeps the preambles built during one run. A preamble is reused by another
+/// file if the preamble text, the compile command and, for quoted includes, the
+/// directory of the file are the same. Source locations inside the preamble
+/// refer to the file it was built from, which has the same text up to the end
+/// of the preamble. Syntax trees move them to the same offset in their own
+/// main file, so that patches and file names refer to the right file.
+///
+/// A preamble that can no longer be reused, because a header it includes has
+/// changed, is built again. The cache holds the Capacity most recently used
+/// preambles, an evicted one deletes its file when the last build using it is
+/// done. Units built on it keep working, the reader has mapped the file by
+/// then.
+///
+/// The cache is safe to use from several threads. Concurrent builds that need
+/// the same preamble wait for the first one to compile it.
+class PreambleCache {
+public:
+  explicit PreambleCache(unsigned Capacity = 16) : Capacity(Capacity) {}
+
+  /// Returns an action that builds ASTs into ASTs like
+  /// ClangTool::buildASTs() does, but parses Filename on top of a preamble
+  /// from this cache.
+  std::unique_ptr<tooling::ToolAction>
+  newASTBuilder(const tooling::CompilationDatabase &Compilations,
+                StringRef Filename, std::vector<std::unique_ptr<ASTUnit>> &ASTs);
+
+  /// Returns the preamble for Key, building it with Build on the first call.
+  /// Returns null if the preamble cannot be built.
+  std::shared_ptr<PrecompiledPreamble>
+  getPreamble(const std::string &Key,
+              llvm::function_ref<std::shared_ptr<PrecompiledPreamble>()> Build);
+
+  /// Drops the entry for Key if it still holds Stale, so that the next
+  /// getPreamble() builds it again.
+  void remove(const std::string &Key,
+              const std::shared_ptr<PrecompiledPreamble> &Stale);
+
+private:
+  using PendingPreamble =
+      std::shared_future<std::shared_ptr<PrecompiledPreamble>>;
+
+  struct Entry {
+    std::string Key;
+    PendingPreamble Value;
+  };
+
+  unsigned Capacity;
+  std::mutex Mutex;
+  /// Most recently used first.
+  std::list<Entry> Entries;
+};
+
+} // end namespace diff
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_ASTDIFF_PREAMBLECACHE_H
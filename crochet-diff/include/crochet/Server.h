@@ -0,0 +1,110 @@
+//===- Server.h - Serving requests from a long-lived process --*- C++ -*- -===//
+//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the pieces a tool needs to run as a daemon: a cache of
+// recently used syntax trees and a Unix domain socket transport for JSON
+// requests and responses.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_ASTDIFF_SERVER_H
+#define LLVM_CLANG_TOOLING_ASTDIFF_SERVER_H
+
+#include "crochet/ASTDiff.h"
+#include "clang/Frontend/ASTUnit.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/JSON.h"
+#include <list>
+
+namespace clang {
+namespace diff {
+
+/// An AST together with the syntax tree built from it. AST is null once the
+/// tree has been detached, and for trees loaded from a file.
+struct CachedTree {
+  std::unique_ptr<ASTUnit> AST;
+  std::unique_ptr<SyntaxTree> Tree;
+};
+
+/// Builds the syntax tree for AST.
+std::shared_ptr<CachedTree>
+makeCachedTree(std::unique_ptr<ASTUnit> AST,
+               const TreeFilter &Filter = TreeFilter());
+
+/// Keeps the syntax trees of the most recently used files. An entry goes stale
+/// when the size or modification time of its main file, or of any other file
+/// that the SourceManager of its AST had loaded when it was cached, changes.
+/// Every lookup checks all of them. All trees are built with the same filter.
+class TreeCache {
+public:
+  TreeCache(unsigned Capacity, TreeFilter Filter = TreeFilter())
+      : Capacity(Capacity), Filter(std::move(Filter)) {}
+
+  /// Returns the tree for Filename, or null if there is no current entry.
+  std::shared_ptr<CachedTree> lookup(StringRef Filename);
+
+  /// Builds the tree for AST and caches it under Filename. The least recently
+  /// used entry is evicted if the cache is full. Evicted trees stay alive for
+  /// as long as a caller holds on to them, then the strings that only they
+  /// used are removed from the StringTable.
+  std::shared_ptr<CachedTree> insert(StringRef Filename,
+                                     std::unique_ptr<ASTUnit> AST);
+
+private:
+  /// A file that a cached AST was built from, by absolute path, as it was when
+  /// it was parsed.
+  struct InputFile {
+    std::string Filename;
+    time_t ModificationTime;
+    uint64_t Size;
+  };
+
+  struct Entry {
+    std::string Filename;
+    llvm::sys::TimePoint<> ModificationTime;
+    uint64_t Size;
+    std::shared_ptr<CachedTree> Value;
+    std::vector<InputFile> Inputs;
+  };
+
+  unsigned Capacity;
+  TreeFilter Filter;
+  /// Most recently used first.
+  std::list<Entry> Entries;
+};
+
+/// Returns a response for a request. Output and Errors are what the tool would
+/// print to stdout and stderr, Status is its exit code. JSON strings are UTF-8,
+/// Output is not changed to fit: if it is not valid UTF-8, the response is an
+/// error instead. Errors are repaired.
+llvm::json::Value makeResponse(int Status, std::string Output,
+                               std::string Errors);
+
+/// Prints the output and errors of Response and returns its status.
+int printResponse(const llvm::json::Value &Response);
+
+/// Listens on the Unix domain socket at SocketPath and answers each
+/// connection with Handle. A connection carries one request and one response,
+/// each a JSON object on a single line. A request with the command "shutdown"
+/// stops the server. Requests are handled one at a time. Returns true on
+/// error.
+bool serve(StringRef SocketPath,
+           llvm::function_ref<llvm::json::Value(const llvm::json::Object &)>
+               Handle);
+
+/// Sends Request to the server listening at SocketPath and returns its
+/// response.
+llvm::Expected<llvm::json::Value> sendRequest(StringRef SocketPath,
+                                              const llvm::json::Value &Request);
+
+} // end namespace diff
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_ASTDIFF_SERVER_H
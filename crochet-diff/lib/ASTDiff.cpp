@@ -15,9 +15,16 @@
 
 #include "clang/AST/LexicallyOrderedRecursiveASTVisitor.h"
 #include "clang/Lex/Lexer.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/PriorityQueue.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/xxhash.h"
 
+#include <climits>
+#include <cstring>
 #include <limits>
 #include <memory>
 #include <unordered_set>
@@ -71,7 +78,8 @@ namespace clang {
 
         public:
             SyntaxTree::Impl &T1, &T2;
-            std::map <NodeId, NodeChange> ChangesT1, ChangesT2;
+            /// Indexed by NodeId.
+            std::vector <NodeChange> ChangesT1, ChangesT2;
 
             Impl(SyntaxTree::Impl &T1, SyntaxTree::Impl &T2,
                  const ComparisonOptions &Options);
@@ -86,6 +94,8 @@ namespace clang {
 
             ChangeKind getNodeChange(NodeRef N) const;
 
+            size_t getMemoryUsage() const;
+
             void dumpChanges(raw_ostream &OS, bool DumpMatches) const;
 
         private:
@@ -100,6 +110,13 @@ namespace clang {
             // Returns true if the two subtrees are identical.
             bool identical(NodeRef N1, NodeRef N2) const;
 
+            // Compares two subtrees node by node, for when their hashes are equal.
+            bool verifyIdentical(NodeRef N1, NodeRef N2) const;
+
+            // Returns true if the two subtrees have the same structural hash and
+            // the names in one can be renamed one to one into those of the other.
+            bool isRenaming(NodeRef N1, NodeRef N2) const;
+
             // Returns false if the nodes must not be mached.
             bool isMatchingPossible(NodeRef N1, NodeRef N2) const;
 
@@ -110,9 +127,14 @@ namespace clang {
             // subtrees, but only if both have fewer nodes than MaxSize.
             void addOptimalMapping(NodeRef N1, NodeRef N2);
 
+            // Returns the NodeIds that the descendants of N1 are mapped to, sorted.
+            std::vector <NodeId> getMappedDescendants(NodeRef N1) const;
+
             // Computes the ratio of common descendants between the two nodes.
             // Descendants are only considered to be equal when they are mapped.
-            double getJaccardSimilarity(NodeRef N1, NodeRef N2) const;
+            // MappedDescendants1 is what getMappedDescendants() returns for N1.
+            double getJaccardSimilarity(NodeRef N1, NodeRef N2,
+                                        ArrayRef <NodeId> MappedDescendants1) const;
 
             double getNodeSimilarity(NodeRef N1, NodeRef N2) const;
 
@@ -121,8 +143,13 @@ namespace clang {
 
             const Node *findCandidateFromChildren(NodeRef N1, NodeRef P2) const;
 
-            // Returns a mapping of identical subtrees.
-            void matchTopDown();
+            // Returns a mapping of identical subtrees. With IgnoreNames, unmatched
+            // subtrees that are identical up to renaming are matched instead.
+            void matchTopDown(bool IgnoreNames = false);
+
+            // Matches the pairs of subtrees of the same height that are renamings
+            // of each other, if neither has another renaming among them.
+            void matchRenamedSubtrees(ArrayRef <NodeId> H1, ArrayRef <NodeId> H2);
 
             // Tries to match any yet unmapped nodes, in a bottom-up fashion.
             void matchBottomUp();
@@ -165,11 +192,16 @@ namespace clang {
         public:
             Impl(SyntaxTree *Parent, ASTUnit &AST);
 
-            /// Constructs a tree from an AST node.
-            Impl(SyntaxTree *Parent, Decl *N, ASTUnit &AST);
+            /// Constructs a tree from an AST node. Filter, if given, applies to the
+            /// declarations in it.
+            Impl(SyntaxTree *Parent, Decl *N, ASTUnit &AST,
+                 const TreeFilter *Filter = nullptr);
 
             Impl(SyntaxTree *Parent, Stmt *N, ASTUnit &AST);
 
+            /// Constructs an empty tree without an AST, for load().
+            Impl(SyntaxTree *Parent);
+
             template<class T>
             Impl(SyntaxTree *Parent,
                  typename std::enable_if<std::is_base_of<Stmt, T>::value, T>::type *Node,
@@ -183,15 +215,148 @@ namespace clang {
                     : Impl(Parent, dyn_cast<Decl>(Node), AST) {}
 
             SyntaxTree *Parent;
-            ASTUnit &AST;
+            /// Null for trees that were loaded from a file.
+            ASTUnit *AST;
             PrintingPolicy TypePP;
-            /// Nodes in preorder.
+            /// Nodes in preorder. The attributes of the node with id I are stored
+            /// at index I of the arrays that follow.
             std::vector <Node> Nodes;
+            std::vector <NodeId> Parents, LeftMostDescendants, RightMostDescendants;
+            std::vector<int> Depths, Heights;
+            std::vector <ast_type_traits::ASTNodeKind> Kinds;
+            std::vector <NodeKind> NodeKinds;
+            std::vector <DynTypedNode> ASTNodes;
+            /// The Decl that each node's parent is, or that the chain of Stmts above
+            /// it ends at, if any.
+            std::vector <NodeId> EnclosingDecls;
+            /// The children of node I are ChildIds[ChildOffsets[I]] up to, but not
+            /// including, ChildIds[ChildOffsets[I + 1]].
+            std::vector <NodeId> ChildIds;
+            std::vector<unsigned> ChildOffsets;
             NodeList Leaves;
             std::vector<int> PreorderToPostorderId;
             NodeList NodesBfs;
             NodeList NodesPostorder;
-            std::map <NodeId, SourceRange> TemplateArgumentLocations;
+            /// The source ranges of template arguments, sorted by NodeId
+            /// because nodes are added in preorder.
+            std::vector <std::pair<NodeId, SourceRange>> TemplateArgumentLocations;
+
+            /// Where a node is in its file, as offsets and as presumed line and
+            /// column of both ends of its source range.
+            struct NodeLocations {
+                std::pair<unsigned, unsigned> Offsets, Begin, End;
+            };
+            /// Indexed by NodeId. These take a while to compute, so they are filled
+            /// in on first use, or for all nodes by detach().
+            std::vector <CharSourceRange> SourceRanges;
+            std::vector <NodeLocations> Locations;
+            std::vector<bool> HasSourceRange, HasLocations;
+
+            CharSourceRange getSourceRange(NodeId Id);
+
+            const NodeLocations &getLocations(NodeId Id);
+
+            /// The offsets at which the lines of a file start.
+            struct LineIndex {
+                std::vector <unsigned> LineOffsets;
+                /// Set for files with #line directives or lone carriage
+                /// returns, their locations are left to the SourceManager.
+                bool UsePresumedLocs = false;
+            };
+            /// Built on first use, one for each file that nodes are in.
+            llvm::DenseMap <FileID, LineIndex> LineIndices;
+
+            const LineIndex &getLineIndex(FileID FID);
+            std::pair<unsigned, unsigned> getLineAndColumn(SourceLocation Loc);
+
+            /// A token as the raw lexer sees it.
+            struct FileToken {
+                unsigned Offset, Length;
+                tok::TokenKind Kind;
+                /// Comments and semicolons are left out of node hashes.
+                bool IsCommentOrSemi;
+            };
+            /// The tokens of a file in order, comments included.
+            struct TokenTable {
+                SourceLocation Start;
+                StringRef Buffer;
+                std::vector <FileToken> Tokens;
+            };
+            /// The tokens that start in a range, as a slice of a TokenTable.
+            struct TokenSpan {
+                SourceLocation Start;
+                StringRef Buffer;
+                ArrayRef<FileToken> Tokens;
+
+                SourceLocation getLocation(const FileToken &Tok) const {
+                    return Start.getLocWithOffset(Tok.Offset);
+                }
+                StringRef getText(const FileToken &Tok) const {
+                    return Buffer.substr(Tok.Offset, Tok.Length);
+                }
+                Token getToken(const FileToken &Tok) const;
+            };
+            /// Built on first use, one for each file that nodes are in. Every
+            /// file is lexed once, ranges are mapped to slices of its table by
+            /// binary search.
+            llvm::DenseMap <FileID, TokenTable> TokenTables;
+
+            const TokenTable &getTokenTable(FileID FID);
+            TokenSpan getTokenSpan(CharSourceRange Range);
+            SourceLocation getNextTokenLocation(SourceLocation Loc);
+
+            /// The strings that the ids of this tree refer to.
+            TreeStrings InternedStrings;
+            /// Interned node attributes by NodeId, filled in on first use.
+            std::vector <StringId> LabelIds, ValueIds, IdentifierIds,
+                    QualifiedIdentifierIds;
+
+            /// Hashes of the tokens that each node owns, and of whole subtrees,
+            /// indexed by NodeId. The hash of a subtree covers the kind, node hash
+            /// and number of children of its root, followed by the subtree hashes
+            /// of the children.
+            std::vector <HashType> NodeHashes, SubtreeHashes;
+            HashKind HashedWith = HashKind::XXHash;
+
+            /// Fills NodeHashes and SubtreeHashes in postorder, unless that has
+            /// been done before with the same kind of hash. Detached trees keep
+            /// the hashes they have.
+            void computeHashes(HashKind Kind);
+
+            /// Subtree hashes that leave out names, indexed by NodeId. Identifiers
+            /// are replaced by a placeholder and literals by their kind, so only
+            /// the node kinds, keywords and operators are left. Filled on first
+            /// use, detached trees keep the ones they have.
+            std::vector <HashType> StructuralHashes;
+
+            void computeStructuralHashes();
+
+            /// What detach() keeps of a node, besides its locations, hashes and
+            /// the interned value and identifiers.
+            struct NodeSnapshot {
+                StringId FileName, RefType, DataType;
+                bool InMainFile, Arrow;
+            };
+            /// Indexed by NodeId, filled by detach().
+            std::vector <NodeSnapshot> Snapshots;
+            std::string MainFileText;
+            bool Detached = false;
+
+            void detach(HashKind Hash);
+
+            /// Writes the tree in the format described at TreeFileHeader.
+            void save(raw_ostream &OS) const;
+
+            /// Reads a tree written by save() into this empty tree. Returns true
+            /// on error.
+            bool load(StringRef Data, std::string &ErrorMessage);
+
+            const NodeSnapshot &getSnapshot(NodeRef N) const {
+                assert(Detached && "The tree is still attached to its AST.");
+                return Snapshots[N.getId()];
+            }
+
+            size_t getMemoryUsage() const;
 
             int getSize() const { return Nodes.size(); }
 
@@ -213,14 +378,13 @@ namespace clang {
 
             NodeRef getNode(NodeId Id) const { return Nodes[Id]; }
 
-            Node &getMutableNode(NodeRef N) { return Nodes[N.getId()]; }
-
-            Node &getMutableNode(NodeId Id) { return getMutableNode(getNode(Id)); }
+            /// Appends a node to the arrays, its descendants follow later.
+            NodeId addNode(const DynTypedNode &ASTNode, NodeId Parent, int Depth);
 
         private:
             void initTree();
 
-            void setLeftMostDescendants();
+            void setChildIds();
         };
 
         NodeRef NodeRefIterator::operator*() const { return Tree->getNode(*IdPointer); }
@@ -282,37 +446,160 @@ namespace clang {
             return isSpecializedNodeExcluded(N);
         }
 
+        Error TreeFilter::addFileGlob(StringRef Pattern) {
+            Expected<GlobPattern> Glob = GlobPattern::create(Pattern);
+            if (!Glob)
+                return Glob.takeError();
+            FileGlobs.push_back(std::move(*Glob));
+            return Error::success();
+        }
+
+// Returns true if D is written at the top level of its file.
+        static bool isTopLevelDecl(const Decl *D) {
+            const DeclContext *DC = D->getLexicalDeclContext();
+            while (isa<LinkageSpecDecl>(DC))
+                DC = DC->getLexicalParent();
+            return DC->isTranslationUnit();
+        }
+
+        bool TreeFilter::excludes(const Decl *D, const SourceManager &SM) const {
+            if (isa<TranslationUnitDecl>(D))
+                return false;
+            if (!DeclNames.empty() && isTopLevelDecl(D)) {
+                auto *ND = dyn_cast<NamedDecl>(D);
+                // The declarations in an extern "C" block are checked one by one.
+                if (!ND)
+                    return !isa<LinkageSpecDecl>(D);
+                if (!llvm::is_contained(DeclNames, ND->getNameAsString()) &&
+                    !llvm::is_contained(DeclNames, ND->getQualifiedNameAsString()))
+                    return true;
+            }
+            if (!MainFileOnly && FileGlobs.empty())
+                return false;
+            SourceLocation Loc = SM.getExpansionLoc(D->getLocation());
+            if (Loc.isInvalid() || (MainFileOnly && SM.isInMainFile(Loc)))
+                return false;
+            StringRef Filename = SM.getFilename(Loc);
+            return llvm::none_of(FileGlobs, [&](const GlobPattern &Glob) {
+                return Glob.match(Filename);
+            });
+        }
+
+        static NodeKind classifyNode(const DynTypedNode &ASTNode) {
+            if (ASTNode.getSourceRange().getBegin().isMacroID())
+                return NodeKind::Macro;
+            if (auto *D = ASTNode.get<Decl>()) {
+                switch (D->getKind()) {
+                    case Decl::EnumConstant:
+                        return NodeKind::EnumConstantDecl;
+                    case Decl::Enum:
+                        return NodeKind::EnumDecl;
+                    case Decl::Field:
+                        return NodeKind::FieldDecl;
+                    case Decl::FileScopeAsm:
+                        return NodeKind::FileScopeAsmDecl;
+                    case Decl::Function:
+                        return NodeKind::FunctionDecl;
+                    case Decl::ParmVar:
+                        return NodeKind::ParmVarDecl;
+                    case Decl::Record:
+                        return NodeKind::RecordDecl;
+                    case Decl::Typedef:
+                        return NodeKind::TypedefDecl;
+                    case Decl::Var:
+                        return NodeKind::VarDecl;
+                    default:
+                        return NodeKind::Other;
+                }
+            }
+            if (auto *S = ASTNode.get<Stmt>()) {
+                switch (S->getStmtClass()) {
+                    case Stmt::ArraySubscriptExprClass:
+                        return NodeKind::ArraySubscriptExpr;
+                    case Stmt::BinaryOperatorClass:
+                        return NodeKind::BinaryOperator;
+                    case Stmt::CallExprClass:
+                        return NodeKind::CallExpr;
+                    case Stmt::CaseStmtClass:
+                        return NodeKind::CaseStmt;
+                    case Stmt::CompoundStmtClass:
+                        return NodeKind::CompoundStmt;
+                    case Stmt::CStyleCastExprClass:
+                        return NodeKind::CStyleCastExpr;
+                    case Stmt::DeclRefExprClass:
+                        return NodeKind::DeclRefExpr;
+                    case Stmt::DeclStmtClass:
+                        return NodeKind::DeclStmt;
+                    case Stmt::IfStmtClass:
+                        return NodeKind::IfStmt;
+                    case Stmt::InitListExprClass:
+                        return NodeKind::InitListExpr;
+                    case Stmt::IntegerLiteralClass:
+                        return NodeKind::IntegerLiteral;
+                    case Stmt::MemberExprClass:
+                        return NodeKind::MemberExpr;
+                    default:
+                        return NodeKind::Other;
+                }
+            }
+            return NodeKind::Other;
+        }
+
+        NodeId SyntaxTree::Impl::addNode(const DynTypedNode &ASTNode, NodeId Parent,
+                                         int Depth) {
+            NodeId Id = getSize();
+            Nodes.emplace_back(*this);
+            Parents.push_back(Parent);
+            LeftMostDescendants.emplace_back();
+            RightMostDescendants.emplace_back();
+            PreorderToPostorderId.emplace_back();
+            Depths.push_back(Depth);
+            Heights.push_back(1);
+            Kinds.push_back(ASTNode.getNodeKind());
+            NodeKinds.push_back(classifyNode(ASTNode));
+            ASTNodes.push_back(ASTNode);
+            NodeId EnclosingDecl;
+            // Like the walk over the parent map that this replaces, only statements
+            // lead up to a declaration. Below a constructor initializer or a type
+            // location there is none, so names there keep their qualifiers.
+            if (Parent.isValid()) {
+                if (ASTNodes[Parent].get<Decl>())
+                    EnclosingDecl = Parent;
+                else if (ASTNodes[Parent].get<Stmt>())
+                    EnclosingDecl = EnclosingDecls[Parent];
+            }
+            EnclosingDecls.push_back(EnclosingDecl);
+            return Id;
+        }
+
         namespace {
-// Sets Height, Parent and Children for each node.
+// Sets Height, Parent, the descendant bounds and the postorder id of each node,
+// and collects the leaves and the postorder list.
             struct PreorderVisitor
                     : public LexicallyOrderedRecursiveASTVisitor<PreorderVisitor> {
                 using BaseType = LexicallyOrderedRecursiveASTVisitor<PreorderVisitor>;
 
-                int Id = 0, Depth = 0;
+                int Id = 0, Depth = 0, PostorderId = 0;
                 NodeId Parent;
                 SyntaxTree::Impl &Tree;
+                const TreeFilter *Filter;
 
-                PreorderVisitor(SyntaxTree::Impl &Tree)
-                        : BaseType(Tree.AST.getSourceManager()), Tree(Tree) {}
+                PreorderVisitor(SyntaxTree::Impl &Tree, const TreeFilter *Filter = nullptr)
+                        : BaseType(Tree.AST->getSourceManager()), Tree(Tree),
+                          Filter(Filter) {}
 
                 template<class T>
                 std::tuple <NodeId, NodeId> PreTraverse(const T &ASTNode) {
-                    NodeId MyId = Id;
-                    Tree.Nodes.emplace_back(Tree);
-                    Node &N = Tree.getMutableNode(MyId);
-                    N.Parent = Parent;
-                    N.Depth = Depth;
-                    N.ASTNode = DynTypedNode::create(ASTNode);
-                    assert(!N.ASTNode.getNodeKind().isNone() &&
+                    NodeId MyId =
+                            Tree.addNode(DynTypedNode::create(ASTNode), Parent, Depth);
+                    assert(MyId == Id && "Nodes must be added in preorder.");
+                    assert(!Tree.Kinds[MyId].isNone() &&
                            "Expected nodes to have a valid kind.");
-                    if (Parent.isValid()) {
-                        Node &P = Tree.getMutableNode(Parent);
-                        P.Children.push_back(MyId);
-                    }
+                    NodeId PreviousParent = Parent;
                     Parent = MyId;
                     ++Id;
                     ++Depth;
-                    return std::make_tuple(MyId, Tree.getNode(MyId).Parent);
+                    return std::make_tuple(MyId, PreviousParent);
                 }
 
                 void PostTraverse(std::tuple <NodeId, NodeId> State) {
@@ -321,20 +608,28 @@ namespace clang {
                     assert(MyId.isValid() && "Expecting to only traverse valid nodes.");
                     Parent = PreviousParent;
                     --Depth;
-                    Node &N = Tree.getMutableNode(MyId);
-                    N.RightMostDescendant = Id - 1;
-                    assert(N.RightMostDescendant >= Tree.getRootId() &&
-                           N.RightMostDescendant < Tree.getSize() &&
+                    NodeId RightMostDescendant = Id - 1;
+                    assert(RightMostDescendant >= Tree.getRootId() &&
+                           RightMostDescendant < Tree.getSize() &&
                            "Rightmost descendant must be a valid tree node.");
-                    if (N.isLeaf())
+                    Tree.RightMostDescendants[MyId] = RightMostDescendant;
+                    // The first child, if any, directly follows its parent in preorder.
+                    bool IsLeaf = RightMostDescendant == MyId;
+                    Tree.LeftMostDescendants[MyId] =
+                            IsLeaf ? MyId : Tree.LeftMostDescendants[MyId + 1];
+                    if (IsLeaf)
                         Tree.Leaves.push_back(MyId);
-                    N.Height = 1;
-                    for (NodeId Child : N.Children)
-                        N.Height = std::max(N.Height, 1 + Tree.getNode(Child).Height);
+                    Tree.PreorderToPostorderId[MyId] = PostorderId++;
+                    Tree.NodesPostorder.push_back(MyId);
+                    // The children are done by now, so the height of this node is final.
+                    if (Parent.isValid())
+                        Tree.Heights[Parent] =
+                                std::max(Tree.Heights[Parent], 1 + Tree.Heights[MyId]);
                 }
 
                 bool TraverseDecl(Decl *D) {
-                    if (isNodeExcluded(Tree.AST, D))
+                    if (isNodeExcluded(*Tree.AST, D) ||
+                        (Filter && Filter->excludes(D, Tree.AST->getSourceManager())))
                         return true;
                     auto SavedState = PreTraverse(*D);
                     BaseType::TraverseDecl(D);
@@ -345,7 +640,7 @@ namespace clang {
                 bool TraverseStmt(Stmt *S) {
                     if (S)
                         S = S->IgnoreImplicit();
-                    if (isNodeExcluded(Tree.AST, S))
+                    if (isNodeExcluded(*Tree.AST, S))
                         return true;
                     auto SavedState = PreTraverse(*S);
                     BaseType::TraverseStmt(S);
@@ -361,7 +656,7 @@ namespace clang {
                 }
 
                 bool TraverseType(QualType QT) {
-                    if (isNodeExcluded(Tree.AST, QT))
+                    if (isNodeExcluded(*Tree.AST, QT))
                         return true;
                     auto SavedState = PreTraverse(QT);
                     BaseType::TraverseType(QT);
@@ -370,7 +665,7 @@ namespace clang {
                 }
 
                 bool TraverseConstructorInitializer(CXXCtorInitializer *Init) {
-                    if (isNodeExcluded(Tree.AST, Init))
+                    if (isNodeExcluded(*Tree.AST, Init))
                         return true;
                     auto SavedState = PreTraverse(*Init);
                     BaseType::TraverseConstructorInitializer(Init);
@@ -379,9 +674,9 @@ namespace clang {
                 }
 
                 bool TraverseTemplateArgumentLoc(const TemplateArgumentLoc &ArgLoc) {
-                    if (isNodeExcluded(Tree.AST, &ArgLoc))
+                    if (isNodeExcluded(*Tree.AST, &ArgLoc))
                         return true;
-                    Tree.TemplateArgumentLocations.emplace(Id, ArgLoc.getSourceRange());
+                    Tree.TemplateArgumentLocations.emplace_back(Id, ArgLoc.getSourceRange());
                     auto SavedState = PreTraverse(ArgLoc.getArgument());
                     BaseType::TraverseTemplateArgumentLoc(ArgLoc);
                     PostTraverse(SavedState);
@@ -389,7 +684,7 @@ namespace clang {
                 }
 
                 bool TraverseTemplateName(TemplateName Template) {
-                    if (isNodeExcluded(Tree.AST, &Template))
+                    if (isNodeExcluded(*Tree.AST, &Template))
                         return true;
                     auto SavedState = PreTraverse(Template);
                     BaseType::TraverseTemplateName(Template);
@@ -400,14 +695,19 @@ namespace clang {
         } // end anonymous namespace
 
         SyntaxTree::Impl::Impl(SyntaxTree *Parent, ASTUnit &AST)
-                : Parent(Parent), AST(AST), TypePP(AST.getLangOpts()), Leaves(*this),
+                : Parent(Parent), AST(&AST), TypePP(AST.getLangOpts()), Leaves(*this),
                   NodesBfs(*this), NodesPostorder(*this) {
             TypePP.AnonymousTagLocations = false;
         }
 
-        SyntaxTree::Impl::Impl(SyntaxTree *Parent, Decl *N, ASTUnit &AST)
+        SyntaxTree::Impl::Impl(SyntaxTree *Parent)
+                : Parent(Parent), AST(nullptr), TypePP(LangOptions()), Leaves(*this),
+                  NodesBfs(*this), NodesPostorder(*this) {}
+
+        SyntaxTree::Impl::Impl(SyntaxTree *Parent, Decl *N, ASTUnit &AST,
+                               const TreeFilter *Filter)
                 : Impl(Parent, AST) {
-            PreorderVisitor PreorderWalker(*this);
+            PreorderVisitor PreorderWalker(*this, Filter);
             PreorderWalker.TraverseDecl(N);
             initTree();
         }
@@ -419,14 +719,8 @@ namespace clang {
             initTree();
         }
 
-        static void getSubtreePostorder(NodeList &Ids, NodeRef Root) {
-            std::function<void(NodeRef)> Traverse = [&](NodeRef N) {
-                for (NodeRef Child : N)
-                    Traverse(Child);
-                Ids.push_back(N.getId());
-            };
-            Traverse(Root);
-        }
+// Marks the attributes that have not been interned yet.
+        static const StringId NotInterned = std::numeric_limits<StringId>::max();
 
         static void getSubtreeBfs(NodeList &Ids, NodeRef Root) {
             size_t Expanded = 0;
@@ -436,62 +730,538 @@ namespace clang {
                     Ids.push_back(Child.getId());
         }
 
+// Everything that can be computed during the traversal already is, what is
+// left needs the finished child lists.
         void SyntaxTree::Impl::initTree() {
-            setLeftMostDescendants();
-            int PostorderId = 0;
-            PreorderToPostorderId.resize(getSize());
-            std::function<void(NodeRef)> PostorderTraverse = [&](NodeRef N) {
-                for (NodeRef Child : N)
-                    PostorderTraverse(Child);
-                PreorderToPostorderId[N.getId()] = PostorderId;
-                ++PostorderId;
-            };
-            PostorderTraverse(getRoot());
+            setChildIds();
             getSubtreeBfs(NodesBfs, getRoot());
-            getSubtreePostorder(NodesPostorder, getRoot());
+            SourceRanges.resize(getSize());
+            Locations.resize(getSize());
+            HasSourceRange.resize(getSize());
+            HasLocations.resize(getSize());
+            LabelIds.assign(getSize(), NotInterned);
+            ValueIds.assign(getSize(), NotInterned);
+            IdentifierIds.assign(getSize(), NotInterned);
+            QualifiedIdentifierIds.assign(getSize(), NotInterned);
+        }
+
+// Groups the children by parent. Children are visited in preorder, so each
+// group ends up sorted.
+        void SyntaxTree::Impl::setChildIds() {
+            ChildOffsets.assign(getSize() + 1, 0);
+            for (NodeId Parent : Parents)
+                if (Parent.isValid())
+                    ++ChildOffsets[Parent + 1];
+            for (int I = 0, E = getSize(); I < E; ++I)
+                ChildOffsets[I + 1] += ChildOffsets[I];
+            ChildIds.resize(ChildOffsets.back());
+            std::vector<unsigned> Next(ChildOffsets.begin(), ChildOffsets.end() - 1);
+            for (int I = 0, E = getSize(); I < E; ++I)
+                if (Parents[I].isValid())
+                    ChildIds[Next[Parents[I]]++] = I;
+        }
+
+        static int getNumberOfDescendants(NodeRef N) {
+            return N.getRightMostDescendant() - N.getId() + 1;
         }
 
-        void SyntaxTree::Impl::setLeftMostDescendants() {
-            for (NodeRef Leaf : Leaves) {
-                getMutableNode(Leaf).LeftMostDescendant = Leaf.getId();
-                const Node *Parent, *Cur = &Leaf;
-                while ((Parent = Cur->getParent()) && &Parent->getChild(0) == Cur) {
-                    Cur = Parent;
-                    getMutableNode(*Cur).LeftMostDescendant = Leaf.getId();
+// Hashes Data in one go. XXHash fills the first eight bytes of the result.
+        static HashType hashBytes(HashKind Kind, StringRef Data) {
+            HashType Result{};
+            switch (Kind) {
+                case HashKind::XXHash: {
+                    uint64_t Hash = llvm::xxHash64(Data);
+                    std::memcpy(Result.data(), &Hash, sizeof(Hash));
+                    break;
+                }
+                case HashKind::MD5: {
+                    llvm::MD5 Hash;
+                    Hash.update(Data);
+                    llvm::MD5::MD5Result HashResult;
+                    Hash.final(HashResult);
+                    Result = HashResult;
+                    break;
+                }
+            }
+            return Result;
+        }
+
+        static HashType hashNode(NodeRef N, HashKind Kind) {
+            assert(!N.Tree.Detached && "The tokens of a detached tree are gone.");
+            // The text of the tokens is collected first, hashing many small pieces
+            // is slow.
+            SmallString<128> Text;
+            for (CharSourceRange Range : N.getOwnedSourceRanges()) {
+                SyntaxTree::Impl::TokenSpan Span = N.Tree.getTokenSpan(Range);
+                for (const SyntaxTree::Impl::FileToken &Tok : Span.Tokens) {
+                    // Commas are list separators, which getOwnedTokens() leaves out
+                    // too. Comments and semicolons are left out to make CompoundStmt
+                    // nodes compare equal, to make the tests pass. It should be
+                    // changed to include changes to comments.
+                    if (Tok.Kind != tok::comma && !Tok.IsCommentOrSemi)
+                        Text += Span.getText(Tok);
+                }
+            }
+            return hashBytes(Kind, Text);
+        }
+
+// Returns true if Name is spelled like a keyword of any language mode. The raw
+// lexer does not tell keywords from identifiers.
+        static bool isKeyword(StringRef Name) {
+            static const llvm::StringSet<> Keywords = [] {
+                llvm::StringSet<> Keywords;
+#define KEYWORD(NAME, FLAGS) Keywords.insert(#NAME);
+#define ALIAS(NAME, KIND, FLAGS) Keywords.insert(NAME);
+#define CXX_KEYWORD_OPERATOR(NAME, KIND) Keywords.insert(#NAME);
+#include "clang/Basic/TokenKinds.def"
+                return Keywords;
+            }();
+            return Keywords.count(Name);
+        }
+
+// Like hashNode(), but names do not count.
+        static HashType hashNodeStructure(NodeRef N, HashKind Kind) {
+            assert(!N.Tree.Detached && "The tokens of a detached tree are gone.");
+            SmallString<128> Text;
+            for (CharSourceRange Range : N.getOwnedSourceRanges()) {
+                SyntaxTree::Impl::TokenSpan Span = N.Tree.getTokenSpan(Range);
+                for (const SyntaxTree::Impl::FileToken &Tok : Span.Tokens) {
+                    if (Tok.Kind == tok::comma || Tok.IsCommentOrSemi)
+                        continue;
+                    StringRef TokText = Span.getText(Tok);
+                    if (Tok.Kind == tok::raw_identifier && !isKeyword(TokText))
+                        Text += "$";
+                    else if (tok::isLiteral(Tok.Kind))
+                        Text += tok::getTokenName(Tok.Kind);
+                    else
+                        Text += TokText;
+                    // Placeholders must not run into their neighbours.
+                    Text += ' ';
                 }
             }
+            return hashBytes(Kind, Text);
         }
 
-        static int getNumberOfDescendants(NodeRef N) {
-            return N.RightMostDescendant - N.getId() + 1;
+// Hashes the kind, node hash and number of children of N, followed by the
+// subtree hashes of its children.
+        static HashType hashSubtree(NodeRef N, const HashType &NodeHash,
+                                    const std::vector <HashType> &SubtreeHashes,
+                                    HashKind Kind) {
+            auto Append = [](SmallString<128> &Data, const void *Bytes, size_t Size) {
+                Data.append(StringRef(static_cast<const char *>(Bytes), Size));
+            };
+            // Macro nodes are matched whatever their kind, see
+            // ComparisonOptions::isMatchingAllowed().
+            SmallString<128> Data(N.isMacro() ? StringRef("Macro")
+                                              : N.Tree.Kinds[N.getId()].asStringRef());
+            Append(Data, NodeHash.data(), sizeof(HashType));
+            uint32_t NumChildren = N.getNumChildren();
+            Append(Data, &NumChildren, sizeof(NumChildren));
+            for (NodeRef Child : N)
+                Append(Data, SubtreeHashes[Child.getId()].data(), sizeof(HashType));
+            return hashBytes(Kind, Data);
+        }
+
+        void SyntaxTree::Impl::computeHashes(HashKind Kind) {
+            if (!SubtreeHashes.empty() && (HashedWith == Kind || Detached))
+                return;
+            HashedWith = Kind;
+            NodeHashes.resize(getSize());
+            SubtreeHashes.resize(getSize());
+            StructuralHashes.clear();
+            // Children come before their parents in postorder.
+            for (NodeRef N : postorder()) {
+                NodeId Id = N.getId();
+                NodeHashes[Id] = hashNode(N, Kind);
+                SubtreeHashes[Id] = hashSubtree(N, NodeHashes[Id], SubtreeHashes, Kind);
+            }
+        }
+
+        void SyntaxTree::Impl::computeStructuralHashes() {
+            if (!StructuralHashes.empty() || Detached)
+                return;
+            StructuralHashes.resize(getSize());
+            for (NodeRef N : postorder())
+                StructuralHashes[N.getId()] =
+                        hashSubtree(N, hashNodeStructure(N, HashedWith),
+                                    StructuralHashes, HashedWith);
         }
 
-        static bool isInSubtree(NodeRef N, NodeRef SubtreeRoot) {
-            return N.getId() >= SubtreeRoot.getId() &&
-                   N.getId() <= SubtreeRoot.RightMostDescendant;
+        static bool areNodesDifferent(NodeRef N1, NodeRef N2) {
+            return N1.Tree.NodeHashes[N1.getId()] != N2.Tree.NodeHashes[N2.getId()];
         }
 
-        static HashType hashNode(NodeRef N) {
-            llvm::MD5 Hash;
-            SourceManager &SM = N.getTree().getSourceManager();
-            const LangOptions &LangOpts = N.getTree().getLangOpts();
-            Token Tok;
-            for (auto TokenLocation : N.getOwnedTokens()) {
-                bool Failure = Lexer::getRawToken(TokenLocation, Tok, SM, LangOpts, /*IgnoreWhiteSpace=*/true);
-                assert(!Failure);
-                auto Range = CharSourceRange::getCharRange(TokenLocation, Tok.getEndLoc());
-                // This is here to make CompoundStmt nodes compare equal, to make the tests
-                // pass. It should be changed to include changes to comments.
-                if (!Tok.isOneOf(tok::comment, tok::semi))
-                    Hash.update(Lexer::getSourceText(Range, SM, LangOpts));
+        void SyntaxTree::Impl::detach(HashKind Hash) {
+            if (Detached)
+                return;
+            const SourceManager &SM = AST->getSourceManager();
+            MainFileText = SM.getBufferData(SM.getMainFileID());
+            computeHashes(Hash);
+            computeStructuralHashes();
+            Snapshots.reserve(getSize());
+            for (NodeRef N : *this) {
+                NodeSnapshot S;
+                // A detached tree reads its value and identifiers from the ids.
+                N.getValueId();
+                N.getIdentifierId();
+                N.getQualifiedIdentifierId();
+                S.FileName = InternedStrings.intern(N.getFileName());
+                S.RefType = InternedStrings.intern(N.getRefType());
+                S.DataType = InternedStrings.intern(N.getDataType());
+                getLocations(N.getId());
+                S.InMainFile = N.isInMainFile();
+                S.Arrow = N.isArrow();
+                Snapshots.push_back(std::move(S));
             }
-            llvm::MD5::MD5Result HashResult;
-            Hash.final(HashResult);
-            return HashResult;
+            // The token tables point into the source buffers.
+            TokenTables.clear();
+            // From here on the accessors read the snapshots, ASTNode dangles
+            // once the AST is destroyed.
+            Detached = true;
         }
 
-        static bool areNodesDifferent(NodeRef N1, NodeRef N2) {
-            return hashNode(N1) != hashNode(N2);
+        namespace {
+/// A file written by SyntaxTree::save() starts with this header. The sections
+/// that follow are listed in SyntaxTree::Impl::save(), each is an array that
+/// is padded to a multiple of eight bytes. Everything is stored in the byte
+/// order of the machine that wrote the file.
+///
+/// Strings are referred to by their index in the string section of the file.
+/// Index 0 stands for StringTable::NoString.
+            struct TreeFileHeader {
+                char Magic[8];
+                uint32_t Version;
+                uint32_t NumNodes;
+                uint32_t NumChildIds;
+                uint32_t NumLeaves;
+                uint32_t NumStrings;
+                uint32_t StringDataSize;
+                uint32_t MainFileTextSize;
+                /// The HashKind of the node, subtree and structural hashes.
+                uint32_t Hash;
+            };
+
+            const char TreeFileMagic[8] = {'C', 'R', 'O', 'C', 'T', 'R', 'E', 'E'};
+            /// Must be increased whenever the layout changes.
+            const uint32_t TreeFileVersion = 4;
+            const size_t TreeFileAlignment = 8;
+            /// The offsets, begin and end of NodeLocations, in this order.
+            const int NumLocationFields = 6;
+            const uint8_t InMainFileFlag = 1, ArrowFlag = 2;
+
+            static_assert(sizeof(NodeId) == sizeof(int32_t) &&
+                          std::is_trivially_copyable<NodeId>::value,
+                          "Node ids are written to tree files as they are.");
+
+            class TreeFileWriter {
+                raw_ostream &OS;
+                uint64_t Offset = 0;
+
+            public:
+                TreeFileWriter(raw_ostream &OS) : OS(OS) {}
+
+                template<class T>
+                void write(ArrayRef <T> Array) {
+                    writeBytes(StringRef(reinterpret_cast<const char *>(Array.data()),
+                                         Array.size() * sizeof(T)));
+                }
+
+                void writeBytes(StringRef Bytes) {
+                    OS << Bytes;
+                    Offset += Bytes.size();
+                    for (; Offset % TreeFileAlignment; ++Offset)
+                        OS << '\0';
+                }
+            };
+
+            class TreeFileReader {
+                StringRef Data;
+                size_t Offset = 0;
+
+            public:
+                TreeFileReader(StringRef Data) : Data(Data) {}
+
+                /// Copies the next Count elements into Array. Returns true if the file
+                /// ends before that.
+                template<class T>
+                bool read(T *Array, size_t Count) {
+                    StringRef Bytes;
+                    if (isTooShort<T>(Count) || readBytes(Count * sizeof(T), Bytes))
+                        return true;
+                    std::memcpy(Array, Bytes.data(), Bytes.size());
+                    return false;
+                }
+
+                /// Counts come from the file, Array is only resized once the file is
+                /// known to hold that many elements.
+                template<class T>
+                bool read(std::vector <T> &Array, size_t Count) {
+                    if (isTooShort<T>(Count))
+                        return true;
+                    Array.resize(Count);
+                    return read(Array.data(), Count);
+                }
+
+                /// Returns true if fewer than Count elements of T are left. Does not
+                /// multiply, so that a corrupt Count cannot overflow.
+                template<class T>
+                bool isTooShort(size_t Count) const {
+                    return Count > (Data.size() - Offset) / sizeof(T);
+                }
+
+                bool readBytes(size_t Size, StringRef &Bytes) {
+                    if (Size > Data.size() - Offset)
+                        return true;
+                    Bytes = Data.substr(Offset, Size);
+                    Offset = std::min<size_t>(alignTo(Offset + Size, TreeFileAlignment),
+                                               Data.size());
+                    return false;
+                }
+            };
+        } // end anonymous namespace
+
+// Tree files name the kind of each node, the numbering of the kinds may differ
+// between versions of clang.
+        static ast_type_traits::ASTNodeKind getNodeKindFromName(StringRef Name) {
+            using ast_type_traits::ASTNodeKind;
+            static const llvm::StringMap <ASTNodeKind> KindsByName = [] {
+                llvm::StringMap <ASTNodeKind> Kinds;
+                auto Add = [&](ASTNodeKind Kind) { Kinds[Kind.asStringRef()] = Kind; };
+                Add(ASTNodeKind::getFromNodeKind<TemplateArgument>());
+                Add(ASTNodeKind::getFromNodeKind<TemplateName>());
+                Add(ASTNodeKind::getFromNodeKind<NestedNameSpecifierLoc>());
+                Add(ASTNodeKind::getFromNodeKind<QualType>());
+                Add(ASTNodeKind::getFromNodeKind<TypeLoc>());
+                Add(ASTNodeKind::getFromNodeKind<CXXCtorInitializer>());
+                Add(ASTNodeKind::getFromNodeKind<NestedNameSpecifier>());
+                Add(ASTNodeKind::getFromNodeKind<Decl>());
+                Add(ASTNodeKind::getFromNodeKind<Stmt>());
+                Add(ASTNodeKind::getFromNodeKind<clang::Type>());
+#define DECL(DERIVED, BASE) Add(ASTNodeKind::getFromNodeKind<DERIVED##Decl>());
+#include "clang/AST/DeclNodes.inc"
+#define STMT(CLASS, PARENT) Add(ASTNodeKind::getFromNodeKind<CLASS>());
+#include "clang/AST/StmtNodes.inc"
+#define TYPE(DERIVED, BASE) Add(ASTNodeKind::getFromNodeKind<DERIVED##Type>());
+#include "clang/AST/TypeNodes.def"
+                return Kinds;
+            }();
+            auto It = KindsByName.find(Name);
+            if (It == KindsByName.end())
+                return ASTNodeKind();
+            return It->second;
+        }
+
+        void SyntaxTree::Impl::save(raw_ostream &OS) const {
+            assert(Detached && "Only detached trees can be saved.");
+            std::vector <StringRef> Strings(1);
+            llvm::StringMap <uint32_t> StringIndices;
+            auto GetStringIndex = [&](StringRef Str) -> uint32_t {
+                auto Inserted = StringIndices.try_emplace(Str, Strings.size());
+                if (Inserted.second)
+                    Strings.push_back(Str);
+                return Inserted.first->second;
+            };
+            auto GetIndex = [&](StringId Id) -> uint32_t {
+                if (Id == StringTable::NoString)
+                    return 0;
+                return GetStringIndex(InternedStrings.getString(Id));
+            };
+
+            size_t Size = getSize();
+            std::vector <uint32_t> KindNames(Size), Values(Size), Identifiers(Size),
+                    QualifiedIdentifiers(Size), FileNames(Size), RefTypes(Size),
+                    DataTypes(Size);
+            std::vector <uint32_t> NodeLocationFields;
+            NodeLocationFields.reserve(Size * NumLocationFields);
+            std::vector <uint8_t> Flags(Size);
+            for (size_t I = 0; I < Size; ++I) {
+                KindNames[I] = GetStringIndex(Kinds[I].asStringRef());
+                Values[I] = GetIndex(ValueIds[I]);
+                Identifiers[I] = GetIndex(IdentifierIds[I]);
+                QualifiedIdentifiers[I] = GetIndex(QualifiedIdentifierIds[I]);
+                const NodeSnapshot &S = Snapshots[I];
+                FileNames[I] = GetIndex(S.FileName);
+                RefTypes[I] = GetIndex(S.RefType);
+                DataTypes[I] = GetIndex(S.DataType);
+                const NodeLocations &L = Locations[I];
+                NodeLocationFields.insert(NodeLocationFields.end(),
+                                          {L.Offsets.first, L.Offsets.second, L.Begin.first,
+                                           L.Begin.second, L.End.first, L.End.second});
+                Flags[I] = (S.InMainFile ? InMainFileFlag : 0) | (S.Arrow ? ArrowFlag : 0);
+            }
+            // String I is StringData[StringOffsets[I]] up to, but not including,
+            // StringData[StringOffsets[I + 1]].
+            std::vector <uint32_t> StringOffsets(1, 0);
+            std::string StringData;
+            for (StringRef Str : Strings) {
+                StringData += Str;
+                StringOffsets.push_back(StringData.size());
+            }
+
+            TreeFileHeader Header;
+            std::memcpy(Header.Magic, TreeFileMagic, sizeof(Header.Magic));
+            Header.Version = TreeFileVersion;
+            Header.NumNodes = Size;
+            Header.NumChildIds = ChildIds.size();
+            Header.NumLeaves = Leaves.Ids.size();
+            Header.NumStrings = Strings.size();
+            Header.StringDataSize = StringData.size();
+            Header.MainFileTextSize = MainFileText.size();
+            Header.Hash = uint32_t(HashedWith);
+
+            // load() reads the sections in the same order.
+            TreeFileWriter Writer(OS);
+            Writer.write(makeArrayRef(Header));
+            Writer.write(makeArrayRef(StringOffsets));
+            Writer.writeBytes(StringData);
+            Writer.writeBytes(MainFileText);
+            Writer.write(makeArrayRef(Parents));
+            Writer.write(makeArrayRef(LeftMostDescendants));
+            Writer.write(makeArrayRef(RightMostDescendants));
+            Writer.write(makeArrayRef(Depths));
+            Writer.write(makeArrayRef(Heights));
+            Writer.write(makeArrayRef(PreorderToPostorderId));
+            Writer.write(makeArrayRef(ChildOffsets));
+            Writer.write(makeArrayRef(ChildIds));
+            Writer.write(makeArrayRef(NodesPostorder.Ids));
+            Writer.write(makeArrayRef(NodesBfs.Ids));
+            Writer.write(makeArrayRef(Leaves.Ids));
+            Writer.write(makeArrayRef(KindNames));
+            Writer.write(makeArrayRef(NodeKinds));
+            Writer.write(makeArrayRef(Values));
+            Writer.write(makeArrayRef(Identifiers));
+            Writer.write(makeArrayRef(QualifiedIdentifiers));
+            Writer.write(makeArrayRef(FileNames));
+            Writer.write(makeArrayRef(RefTypes));
+            Writer.write(makeArrayRef(DataTypes));
+            Writer.write(makeArrayRef(NodeHashes));
+            Writer.write(makeArrayRef(SubtreeHashes));
+            Writer.write(makeArrayRef(StructuralHashes));
+            Writer.write(makeArrayRef(NodeLocationFields));
+            Writer.write(makeArrayRef(Flags));
+        }
+
+        bool SyntaxTree::Impl::load(StringRef Data, std::string &ErrorMessage) {
+            TreeFileReader Reader(Data);
+            TreeFileHeader Header;
+            if (Reader.read(&Header, 1) ||
+                std::memcmp(Header.Magic, TreeFileMagic, sizeof(Header.Magic))) {
+                ErrorMessage = "Not a syntax tree file";
+                return true;
+            }
+            if (Header.Version != TreeFileVersion) {
+                ErrorMessage = "Unsupported syntax tree file version " +
+                               std::to_string(Header.Version);
+                return true;
+            }
+            size_t Size = Header.NumNodes;
+            std::vector <uint32_t> StringOffsets, KindNames, Values, Identifiers,
+                    QualifiedIdentifiers, FileNames, RefTypes, DataTypes,
+                    NodeLocationFields;
+            std::vector <uint8_t> Flags;
+            StringRef StringData, Text;
+            bool Truncated =
+                    Reader.read(StringOffsets, Header.NumStrings + size_t(1)) ||
+                    Reader.readBytes(Header.StringDataSize, StringData) ||
+                    Reader.readBytes(Header.MainFileTextSize, Text) ||
+                    Reader.read(Parents, Size) ||
+                    Reader.read(LeftMostDescendants, Size) ||
+                    Reader.read(RightMostDescendants, Size) ||
+                    Reader.read(Depths, Size) || Reader.read(Heights, Size) ||
+                    Reader.read(PreorderToPostorderId, Size) ||
+                    Reader.read(ChildOffsets, Size + 1) ||
+                    Reader.read(ChildIds, Header.NumChildIds) ||
+                    Reader.read(NodesPostorder.Ids, Size) ||
+                    Reader.read(NodesBfs.Ids, Size) ||
+                    Reader.read(Leaves.Ids, Header.NumLeaves) ||
+                    Reader.read(KindNames, Size) || Reader.read(NodeKinds, Size) ||
+                    Reader.read(Values, Size) || Reader.read(Identifiers, Size) ||
+                    Reader.read(QualifiedIdentifiers, Size) ||
+                    Reader.read(FileNames, Size) || Reader.read(RefTypes, Size) ||
+                    Reader.read(DataTypes, Size) || Reader.read(NodeHashes, Size) ||
+                    Reader.read(SubtreeHashes, Size) ||
+                    Reader.read(StructuralHashes, Size) ||
+                    Reader.read(NodeLocationFields, Size * NumLocationFields) ||
+                    Reader.read(Flags, Size);
+            if (Truncated || Size == 0) {
+                ErrorMessage = "Truncated syntax tree file";
+                return true;
+            }
+
+            // Only what could make the accessors read out of bounds is checked,
+            // a file that passes may still describe a tree that makes no sense.
+            auto IsNode = [&](NodeId Id) { return Id >= 0 && size_t(Id) < Size; };
+            auto AreNodes = [&](ArrayRef <NodeId> Ids) {
+                return std::all_of(Ids.begin(), Ids.end(), IsNode);
+            };
+            auto AreStrings = [&](ArrayRef <uint32_t> Indices) {
+                return std::all_of(Indices.begin(), Indices.end(),
+                                   [&](uint32_t I) { return I < Header.NumStrings; });
+            };
+            bool Valid =
+                    Header.Hash <= uint32_t(HashKind::MD5) &&
+                    Header.NumStrings > 0 && StringOffsets[0] == 0 &&
+                    std::is_sorted(StringOffsets.begin(), StringOffsets.end()) &&
+                    StringOffsets.back() <= StringData.size() &&
+                    Parents[getRootId()].isInvalid() &&
+                    std::all_of(Parents.begin() + 1, Parents.end(), IsNode) &&
+                    AreNodes(LeftMostDescendants) && AreNodes(RightMostDescendants) &&
+                    ChildOffsets[0] == 0 &&
+                    std::is_sorted(ChildOffsets.begin(), ChildOffsets.end()) &&
+                    ChildOffsets.back() == ChildIds.size() && AreNodes(ChildIds) &&
+                    AreNodes(NodesPostorder.Ids) && AreNodes(NodesBfs.Ids) &&
+                    AreNodes(Leaves.Ids) &&
+                    std::all_of(PreorderToPostorderId.begin(),
+                                PreorderToPostorderId.end(), IsNode) &&
+                    std::all_of(NodeKinds.begin(), NodeKinds.end(),
+                                [](NodeKind K) { return K <= NodeKind::VarDecl; }) &&
+                    AreStrings(KindNames) && AreStrings(Values) &&
+                    AreStrings(Identifiers) && AreStrings(QualifiedIdentifiers) &&
+                    AreStrings(FileNames) && AreStrings(RefTypes) &&
+                    AreStrings(DataTypes);
+            if (!Valid) {
+                ErrorMessage = "Corrupt syntax tree file";
+                return true;
+            }
+
+            std::vector <StringId> StringIds(1, StringTable::NoString);
+            for (size_t I = 1; I < Header.NumStrings; ++I)
+                StringIds.push_back(InternedStrings.intern(StringData.slice(
+                        StringOffsets[I], StringOffsets[I + 1])));
+
+            Nodes.reserve(Size);
+            Kinds.reserve(Size);
+            Snapshots.reserve(Size);
+            Locations.reserve(Size);
+            for (size_t I = 0; I < Size; ++I) {
+                Nodes.emplace_back(*this);
+                StringRef KindName = InternedStrings.getString(StringIds[KindNames[I]]);
+                Kinds.push_back(getNodeKindFromName(KindName));
+                if (Kinds.back().isNone()) {
+                    ErrorMessage = ("Unknown node kind " + KindName).str();
+                    return true;
+                }
+                ValueIds.push_back(StringIds[Values[I]]);
+                IdentifierIds.push_back(StringIds[Identifiers[I]]);
+                QualifiedIdentifierIds.push_back(StringIds[QualifiedIdentifiers[I]]);
+                NodeSnapshot S;
+                S.FileName = StringIds[FileNames[I]];
+                S.RefType = StringIds[RefTypes[I]];
+                S.DataType = StringIds[DataTypes[I]];
+                S.InMainFile = Flags[I] & InMainFileFlag;
+                S.Arrow = Flags[I] & ArrowFlag;
+                Snapshots.push_back(S);
+                const uint32_t *L = &NodeLocationFields[I * NumLocationFields];
+                Locations.push_back({{L[0], L[1]}, {L[2], L[3]}, {L[4], L[5]}});
+            }
+            SourceRanges.resize(Size);
+            HasSourceRange.assign(Size, false);
+            HasLocations.assign(Size, true);
+            LabelIds.assign(Size, NotInterned);
+            MainFileText = Text;
+            HashedWith = HashKind(Header.Hash);
+            Detached = true;
+            return false;
         }
 
 /// Identifies a node in a subtree by its postorder offset, starting at 1.
@@ -542,7 +1312,7 @@ namespace clang {
 
             NodeId getPostorderIdInRoot(SNodeId Id = SNodeId(1)) const {
                 assert(Id > 0 && Id <= getSize() && "Invalid subtree node index.");
-                return Id - 1 + Tree.PreorderToPostorderId[Root.LeftMostDescendant];
+                return Id - 1 + Tree.PreorderToPostorderId[Root.getLeftMostDescendant()];
             }
 
         private:
@@ -559,7 +1329,7 @@ namespace clang {
                            "Postorder traversal in subtree should correspond to traversal in "
                            "the root tree by a constant offset.");
                     LeftMostDescendants[I] =
-                            SNodeId(Tree.PreorderToPostorderId[N.LeftMostDescendant] -
+                            SNodeId(Tree.PreorderToPostorderId[N.getLeftMostDescendant()] -
                                     getPostorderIdInRoot());
                 }
                 return NumLeaves;
@@ -716,17 +1486,47 @@ namespace clang {
         SyntaxTree &Node::getTree() const { return *Tree.Parent; }
 
         const Node *Node::getParent() const {
+            NodeId Parent = getParentId();
             if (Parent.isInvalid())
                 return nullptr;
             return &Tree.getNode(Parent);
         }
 
+        NodeId Node::getParentId() const { return Tree.Parents[getId()]; }
+
+        NodeId Node::getLeftMostDescendant() const {
+            return Tree.LeftMostDescendants[getId()];
+        }
+
+        NodeId Node::getRightMostDescendant() const {
+            return Tree.RightMostDescendants[getId()];
+        }
+
+        int Node::getDepth() const { return Tree.Depths[getId()]; }
+
+        int Node::getHeight() const { return Tree.Heights[getId()]; }
+
+        const DynTypedNode &Node::getASTNode() const {
+            assert(!Tree.Detached && "The AST of a detached tree may be gone.");
+            return Tree.ASTNodes[getId()];
+        }
+
+        ArrayRef <NodeId> Node::getChildIds() const {
+            NodeId Id = getId();
+            return makeArrayRef(Tree.ChildIds.data() + Tree.ChildOffsets[Id],
+                                Tree.ChildIds.data() + Tree.ChildOffsets[Id + 1]);
+        }
+
         NodeRef Node::getChild(size_t Index) const {
-            return Tree.getNode(Children[Index]);
+            return Tree.getNode(getChildIds()[Index]);
         }
 
+        size_t Node::getNumChildren() const { return getChildIds().size(); }
+
+        bool Node::isLeaf() const { return getRightMostDescendant() == getId(); }
+
         ast_type_traits::ASTNodeKind Node::getType() const {
-            return ASTNode.getNodeKind();
+            return Tree.Kinds[getId()];
         }
 
         StringRef Node::getTypeLabel() const {
@@ -735,14 +1535,35 @@ namespace clang {
             return getType().asStringRef();
         }
 
-        bool Node::isMacro() const {
-            return ASTNode.getSourceRange().getBegin().isMacroID();
+        NodeKind Node::getKind() const { return Tree.NodeKinds[getId()]; }
+
+        bool Node::isMacro() const { return getKind() == NodeKind::Macro; }
+
+        bool Node::isInMainFile() const {
+            if (Tree.Detached)
+                return Tree.getSnapshot(*this).InMainFile;
+            const SourceManager &SM = Tree.AST->getSourceManager();
+            SourceLocation SLoc = getSourceRange().getBegin();
+            return SLoc.isInvalid() || SM.isInMainFile(SLoc);
+        }
+
+        bool Node::isArrow() const {
+            if (Tree.Detached)
+                return Tree.getSnapshot(*this).Arrow;
+            auto *M = getASTNode().get<MemberExpr>();
+            return M && M->isArrow();
         }
 
         llvm::Optional <std::string> Node::getQualifiedIdentifier() const {
+            if (Tree.Detached) {
+                StringId Id = Tree.QualifiedIdentifierIds[getId()];
+                if (Id == StringTable::NoString)
+                    return llvm::None;
+                return Tree.InternedStrings.getString(Id).str();
+            }
             if (isMacro())
                 return llvm::None;
-            if (auto *ND = ASTNode.get<NamedDecl>()) {
+            if (auto *ND = getASTNode().get<NamedDecl>()) {
                 if (ND->getDeclName().isIdentifier())
                     return ND->getQualifiedNameAsString();
                 else
@@ -752,9 +1573,15 @@ namespace clang {
         }
 
         llvm::Optional <StringRef> Node::getIdentifier() const {
+            if (Tree.Detached) {
+                StringId Id = Tree.IdentifierIds[getId()];
+                if (Id == StringTable::NoString)
+                    return llvm::None;
+                return Tree.InternedStrings.getString(Id);
+            }
             if (isMacro())
                 return llvm::None;
-            if (auto *ND = ASTNode.get<NamedDecl>()) {
+            if (auto *ND = getASTNode().get<NamedDecl>()) {
                 if (ND->getDeclName().isIdentifier())
                     return ND->getName();
                 else
@@ -763,6 +1590,40 @@ namespace clang {
             return llvm::None;
         }
 
+        StringId Node::getLabelId() const {
+            StringId &Id = Tree.LabelIds[getId()];
+            if (Id == NotInterned)
+                Id = Tree.InternedStrings.intern(getTypeLabel());
+            return Id;
+        }
+
+        StringId Node::getValueId() const {
+            StringId &Id = Tree.ValueIds[getId()];
+            if (Id == NotInterned)
+                Id = Tree.InternedStrings.intern(getValue());
+            return Id;
+        }
+
+        StringId Node::getIdentifierId() const {
+            StringId &Id = Tree.IdentifierIds[getId()];
+            if (Id == NotInterned) {
+                auto Identifier = getIdentifier();
+                Id = Identifier ? Tree.InternedStrings.intern(*Identifier)
+                                : StringTable::NoString;
+            }
+            return Id;
+        }
+
+        StringId Node::getQualifiedIdentifierId() const {
+            StringId &Id = Tree.QualifiedIdentifierIds[getId()];
+            if (Id == NotInterned) {
+                auto Identifier = getQualifiedIdentifier();
+                Id = Identifier ? Tree.InternedStrings.intern(*Identifier)
+                                : StringTable::NoString;
+            }
+            return Id;
+        }
+
         static std::string getInitializerValue(const CXXCtorInitializer *Init, const PrintingPolicy &TypePP) {
             if (Init->isAnyMemberInitializer())
                 return Init->getAnyMember()->getName();
@@ -784,7 +1645,7 @@ namespace clang {
                 ContextPrefix = Namespace->getQualifiedNameAsString();
             else if (auto *Record = dyn_cast<RecordDecl>(Context))
                 ContextPrefix = Record->getQualifiedNameAsString();
-            else if (Tree.AST.getLangOpts().CPlusPlus11)
+            else if (Tree.AST->getLangOpts().CPlusPlus11)
                 if (auto *Tag = dyn_cast<TagDecl>(Context))
                     ContextPrefix = Tag->getQualifiedNameAsString();
             // Strip the qualifier, if Val refers to something in the current scope.
@@ -800,8 +1661,10 @@ namespace clang {
         }
 
         std::string Node::getFileName() const {
+            if (Tree.Detached)
+                return Tree.InternedStrings.getString(Tree.getSnapshot(*this).FileName);
 
-            const SourceManager &SM = Tree.AST.getSourceManager();
+            const SourceManager &SM = Tree.AST->getSourceManager();
             CharSourceRange Range = getSourceRange();
             SourceLocation EndLoc = Range.getEnd();
             if (EndLoc.isValid()) {
@@ -818,16 +1681,18 @@ namespace clang {
         }
 
         std::string Node::getValue() const {
+            if (Tree.Detached)
+                return Tree.InternedStrings.getString(Tree.ValueIds[getId()]);
 
             if (isMacro())
                 return getMacroValue();
-            if (auto *S = ASTNode.get<Stmt>())
+            if (auto *S = getASTNode().get<Stmt>())
                 return getStmtValue(S);
-            if (auto *D = ASTNode.get<Decl>())
+            if (auto *D = getASTNode().get<Decl>())
                 return getDeclValue(D);
-            if (auto *Init = ASTNode.get<CXXCtorInitializer>())
+            if (auto *Init = getASTNode().get<CXXCtorInitializer>())
                 return getInitializerValue(Init, Tree.TypePP);
-            if (auto *T = ASTNode.get<TypeLoc>())
+            if (auto *T = getASTNode().get<TypeLoc>())
                 return getTypeLocValue(T);
             return "";
 
@@ -836,10 +1701,12 @@ namespace clang {
         }
 
         std::string Node::getRefType() const {
+            if (Tree.Detached)
+                return Tree.InternedStrings.getString(Tree.getSnapshot(*this).RefType);
             std::string refType;
 
-            if (getTypeLabel() == "DeclRefExpr") {
-                auto decRefNode = ASTNode.get<DeclRefExpr>();
+            if (getKind() == NodeKind::DeclRefExpr) {
+                auto decRefNode = getASTNode().get<DeclRefExpr>();
                 auto decNode = decRefNode->getDecl();
                 if (auto *ref = dyn_cast<ParmVarDecl>(decNode))
                     refType = "ParmVarDecl";
@@ -853,10 +1720,12 @@ namespace clang {
         }
 
         std::string Node::getDataType() const {
+            if (Tree.Detached)
+                return Tree.InternedStrings.getString(Tree.getSnapshot(*this).DataType);
             std::string dataType;
 
-            if (getTypeLabel() == "DeclRefExpr") {
-                auto decRefNode = ASTNode.get<DeclRefExpr>();
+            if (getKind() == NodeKind::DeclRefExpr) {
+                auto decRefNode = getASTNode().get<DeclRefExpr>();
                 auto decNode = decRefNode->getDecl();
                 if (auto *ref = dyn_cast<VarDecl>(decNode)) {
                     auto *val = dyn_cast<ValueDecl>(decNode);
@@ -865,13 +1734,13 @@ namespace clang {
                 }
             }
 
-            else if (getTypeLabel() == "MemberExpr") {
-                auto memNode = ASTNode.get<MemberExpr>();
+            else if (getKind() == NodeKind::MemberExpr) {
+                auto memNode = getASTNode().get<MemberExpr>();
                 auto valNode = memNode->getMemberDecl();
                 return valNode->getType().getAsString();
             }
 
-            else if (auto *val = ASTNode.get<ValueDecl>()) {
+            else if (auto *val = getASTNode().get<ValueDecl>()) {
                 return val->getType().getAsString();
             }
 
@@ -881,8 +1750,8 @@ namespace clang {
 
         std::string Node::getMacroValue() const {
 
-            return Lexer::getSourceText(getSourceRange(), Tree.AST.getSourceManager(),
-                                        Tree.AST.getLangOpts());
+            return Lexer::getSourceText(getSourceRange(), Tree.AST->getSourceManager(),
+                                        Tree.AST->getLangOpts());
 
         }
 
@@ -903,8 +1772,8 @@ namespace clang {
                 return U->getNominatedNamespace()->getName();
             if (auto *A = dyn_cast<AccessSpecDecl>(D)) {
                 CharSourceRange Range(A->getSourceRange(), false);
-                return Lexer::getSourceText(Range, Tree.AST.getSourceManager(),
-                                            Tree.AST.getLangOpts());
+                return Lexer::getSourceText(Range, Tree.AST->getSourceManager(),
+                                            Tree.AST->getLangOpts());
             }
             return Value;
         }
@@ -922,17 +1791,11 @@ namespace clang {
             return Value;
         }
 
-        const DeclContext *Node::getEnclosingDeclContext(ASTContext &AST, const Stmt *S) const {
-            while (S) {
-                const auto &Parents = AST.getParents(*S);
-                if (Parents.empty())
-                    return nullptr;
-                const auto &P = Parents[0];
-                if (const auto *D = P.get<Decl>())
-                    return D->getDeclContext();
-                S = P.get<Stmt>();
-            }
-            return nullptr;
+        const DeclContext *Node::getEnclosingDeclContext() const {
+            NodeId EnclosingDecl = Tree.EnclosingDecls[getId()];
+            if (EnclosingDecl.isInvalid())
+                return nullptr;
+            return Tree.getNode(EnclosingDecl).getASTNode().get<Decl>()->getDeclContext();
         }
 
         std::string Node::getStmtValue(const Stmt *S) const {
@@ -953,7 +1816,7 @@ namespace clang {
                 return Str.str();
             }
             if (auto *D = dyn_cast<DeclRefExpr>(S))
-                return getRelativeName(D->getDecl(), getEnclosingDeclContext(Tree.AST.getASTContext(), S));
+                return getRelativeName(D->getDecl(), getEnclosingDeclContext());
             if (auto *String = dyn_cast<StringLiteral>(S))
                 return String->getString();
             if (auto *B = dyn_cast<CXXBoolLiteralExpr>(S))
@@ -963,26 +1826,26 @@ namespace clang {
 
 
         NodeRefIterator Node::begin() const {
-            return {&Tree, isLeaf() ? nullptr : &Children[0]};
+            return {&Tree, getChildIds().begin()};
         }
 
         NodeRefIterator Node::end() const {
-            return {&Tree, isLeaf() ? nullptr : &Children[0] + Children.size()};
+            return {&Tree, getChildIds().end()};
         }
 
         int Node::findPositionInParent() const {
             if (!getParent())
                 return 0;
-            const ArrayRef <NodeId> &Siblings = getParent()->Children;
+            ArrayRef <NodeId> Siblings = getParent()->getChildIds();
             return std::find(Siblings.begin(), Siblings.end(), getId()) -
                    Siblings.begin();
         }
 
         static SourceRange getSourceRangeImpl(NodeRef N) {
-            const DynTypedNode &DTN = N.ASTNode;
+            const DynTypedNode &DTN = N.getASTNode();
             SyntaxTree::Impl &Tree = N.Tree;
-            SourceManager &SM = Tree.AST.getSourceManager();
-            const LangOptions &LangOpts = Tree.AST.getLangOpts();
+            SourceManager &SM = Tree.AST->getSourceManager();
+            const LangOptions &LangOpts = Tree.AST->getLangOpts();
             auto EndOfToken = [&](SourceLocation Loc) {
                 return Lexer::getLocForEndOfToken(Loc, /*Offset=*/0, SM, LangOpts);
             };
@@ -1007,7 +1870,7 @@ namespace clang {
             } else if (DTN.get<DeclStmt>() || DTN.get<FieldDecl>() ||
                        DTN.get<VarDecl>() ||
                        (DTN.get<CallExpr>() &&
-                        N.getParent()->ASTNode.get<CompoundStmt>()) ||
+                        N.getParent()->getASTNode().get<CompoundStmt>()) ||
                        (DTN.get<FunctionDecl>() &&
                         !DTN.get<FunctionDecl>()->isThisDeclarationADefinition()) ||
                        DTN.get<TypeDecl>() || DTN.get<UsingDirectiveDecl>() ||
@@ -1024,36 +1887,254 @@ namespace clang {
             return TokenToCharRange(Range);
         }
 
+// A precompiled preamble is loaded as a file of its own, whose text is the
+// start of the main file. It may have been built from another file that starts
+// the same way. Locations in it are moved to the same offset in the main file,
+// like ASTUnit::mapLocationFromPreamble() does.
+        static SourceLocation mapLocationFromPreamble(const SourceManager &SM,
+                                                      SourceLocation Loc) {
+            FileID PreambleID = SM.getPreambleFileID();
+            unsigned Offset;
+            if (Loc.isInvalid() || PreambleID.isInvalid() ||
+                !SM.isInFileID(Loc, PreambleID, &Offset))
+                return Loc;
+            return SM.getLocForStartOfFile(SM.getMainFileID()).getLocWithOffset(Offset);
+        }
+
+        CharSourceRange SyntaxTree::Impl::getSourceRange(NodeId Id) {
+            if (!HasSourceRange[Id]) {
+                const SourceManager &SM = AST->getSourceManager();
+                SourceRange Range = getSourceRangeImpl(getNode(Id));
+                SourceRanges[Id] = CharSourceRange::getCharRange(
+                        mapLocationFromPreamble(SM, Range.getBegin()),
+                        mapLocationFromPreamble(SM, Range.getEnd()));
+                HasSourceRange[Id] = true;
+            }
+            return SourceRanges[Id];
+        }
+
+        static std::pair<unsigned, unsigned>
+        getPresumedLineAndColumn(const SourceManager &SM, SourceLocation Loc) {
+            PresumedLoc PLoc = SM.getPresumedLoc(Loc);
+            if (PLoc.isInvalid())
+                return {0, 0};
+            return {PLoc.getLine(), PLoc.getColumn()};
+        }
+
+        const SyntaxTree::Impl::LineIndex &
+        SyntaxTree::Impl::getLineIndex(FileID FID) {
+            auto Inserted = LineIndices.try_emplace(FID);
+            LineIndex &Index = Inserted.first->second;
+            if (!Inserted.second)
+                return Index;
+            const SourceManager &SM = AST->getSourceManager();
+            bool InvalidEntry = false, InvalidBuffer = false;
+            const SrcMgr::SLocEntry &Entry = SM.getSLocEntry(FID, &InvalidEntry);
+            StringRef Buffer = SM.getBufferData(FID, &InvalidBuffer);
+            if (InvalidEntry || InvalidBuffer || !Entry.isFile() ||
+                Entry.getFile().hasLineDirectives()) {
+                Index.UsePresumedLocs = true;
+                return Index;
+            }
+            // memchr() is vectorized by the C library, so this is much faster than
+            // looking at one character at a time.
+            const char *Begin = Buffer.data(), *End = Begin + Buffer.size();
+            Index.LineOffsets.push_back(0);
+            for (const char *P = Begin;
+                 (P = static_cast<const char *>(std::memchr(P, '\n', End - P)));
+                 ++P)
+                Index.LineOffsets.push_back(P - Begin + 1);
+            // The SourceManager also ends a line at a carriage return that is not
+            // followed by a newline.
+            for (const char *P = Begin;
+                 (P = static_cast<const char *>(std::memchr(P, '\r', End - P)));
+                 ++P) {
+                if (P + 1 == End || P[1] != '\n') {
+                    Index.UsePresumedLocs = true;
+                    break;
+                }
+            }
+            return Index;
+        }
+
+// Gives the same result as getPresumedLineAndColumn(), with a binary search
+// instead of a walk through the line table of the SourceManager.
+        std::pair<unsigned, unsigned>
+        SyntaxTree::Impl::getLineAndColumn(SourceLocation Loc) {
+            const SourceManager &SM = AST->getSourceManager();
+            if (Loc.isInvalid())
+                return {0, 0};
+            std::pair<FileID, unsigned> Decomposed = SM.getDecomposedExpansionLoc(Loc);
+            const LineIndex &Index = getLineIndex(Decomposed.first);
+            if (Index.UsePresumedLocs)
+                return getPresumedLineAndColumn(SM, Loc);
+            const std::vector <unsigned> &Lines = Index.LineOffsets;
+            unsigned Line = std::upper_bound(Lines.begin(), Lines.end(),
+                                             Decomposed.second) -
+                            Lines.begin();
+            return {Line, Decomposed.second - Lines[Line - 1] + 1};
+        }
+
+        const SyntaxTree::Impl::TokenTable &
+        SyntaxTree::Impl::getTokenTable(FileID FID) {
+            auto Inserted = TokenTables.try_emplace(FID);
+            TokenTable &Table = Inserted.first->second;
+            if (!Inserted.second)
+                return Table;
+            const SourceManager &SM = AST->getSourceManager();
+            bool Invalid = false;
+            StringRef Buffer = SM.getBufferData(FID, &Invalid);
+            if (Invalid)
+                return Table;
+            Table.Start = SM.getLocForStartOfFile(FID);
+            Table.Buffer = Buffer;
+            // Comments are kept, as they are by Lexer::getRawToken().
+            Lexer Lex(Table.Start, AST->getLangOpts(), Buffer.begin(),
+                      Buffer.begin(), Buffer.end());
+            Lex.SetCommentRetentionState(true);
+            Token Tok;
+            for (Lex.LexFromRawLexer(Tok); Tok.isNot(tok::eof);
+                 Lex.LexFromRawLexer(Tok))
+                Table.Tokens.push_back({SM.getFileOffset(Tok.getLocation()),
+                                        Tok.getLength(), Tok.getKind(),
+                                        Tok.isOneOf(tok::comment, tok::semi)});
+            return Table;
+        }
+
+        static bool startsBefore(const SyntaxTree::Impl::FileToken &Tok,
+                                 unsigned Offset) {
+            return Tok.Offset < Offset;
+        }
+
+        SyntaxTree::Impl::TokenSpan
+        SyntaxTree::Impl::getTokenSpan(CharSourceRange Range) {
+            TokenSpan Span;
+            SourceLocation Begin = Range.getBegin(), End = Range.getEnd();
+            if (Begin.isInvalid() || End.isInvalid())
+                return Span;
+            const SourceManager &SM = AST->getSourceManager();
+            std::pair<FileID, unsigned>
+                    BeginLoc = SM.getDecomposedExpansionLoc(Begin),
+                    EndLoc = SM.getDecomposedExpansionLoc(End);
+            const TokenTable &Table = getTokenTable(BeginLoc.first);
+            ArrayRef<FileToken> Tokens = Table.Tokens;
+            size_t First = std::lower_bound(Tokens.begin(), Tokens.end(),
+                                            BeginLoc.second, startsBefore) -
+                           Tokens.begin();
+            size_t Last = Tokens.size();
+            // A range that ends in a later file takes the rest of this one.
+            if (EndLoc.first == BeginLoc.first)
+                Last = std::lower_bound(Tokens.begin() + First, Tokens.end(),
+                                        EndLoc.second, startsBefore) -
+                       Tokens.begin();
+            else if (!SM.isBeforeInTranslationUnit(Begin, End))
+                Last = First;
+            Span.Start = Table.Start;
+            Span.Buffer = Table.Buffer;
+            Span.Tokens = Tokens.slice(First, Last - First);
+            return Span;
+        }
+
+        SourceLocation SyntaxTree::Impl::getNextTokenLocation(SourceLocation Loc) {
+            if (Loc.isInvalid())
+                return Loc;
+            std::pair<FileID, unsigned> Decomposed =
+                    AST->getSourceManager().getDecomposedExpansionLoc(Loc);
+            const TokenTable &Table = getTokenTable(Decomposed.first);
+            if (Table.Start.isInvalid())
+                return SourceLocation();
+            auto It = std::lower_bound(Table.Tokens.begin(), Table.Tokens.end(),
+                                       Decomposed.second, startsBefore);
+            return Table.Start.getLocWithOffset(
+                    It == Table.Tokens.end() ? Table.Buffer.size() : It->Offset);
+        }
+
+        Token SyntaxTree::Impl::TokenSpan::getToken(const FileToken &FileTok) const {
+            Token Tok;
+            Tok.startToken();
+            Tok.setKind(FileTok.Kind);
+            Tok.setLocation(getLocation(FileTok));
+            Tok.setLength(FileTok.Length);
+            const char *Data = Buffer.data() + FileTok.Offset;
+            if (Tok.is(tok::raw_identifier))
+                Tok.setRawIdentifierData(Data);
+            else if (Tok.isLiteral())
+                Tok.setLiteralData(Data);
+            return Tok;
+        }
+
+        template<class T>
+        static size_t getCapacityInBytes(const std::vector <T> &V) {
+            return V.capacity() * sizeof(T);
+        }
+
+        static size_t getCapacityInBytes(const std::vector<bool> &V) {
+            return V.capacity() / CHAR_BIT;
+        }
+
+        size_t SyntaxTree::Impl::getMemoryUsage() const {
+            size_t Size =
+                    getCapacityInBytes(Nodes) + getCapacityInBytes(Parents) +
+                    getCapacityInBytes(LeftMostDescendants) +
+                    getCapacityInBytes(RightMostDescendants) +
+                    getCapacityInBytes(Depths) + getCapacityInBytes(Heights) +
+                    getCapacityInBytes(Kinds) + getCapacityInBytes(NodeKinds) +
+                    getCapacityInBytes(ASTNodes) +
+                    getCapacityInBytes(EnclosingDecls) +
+                    getCapacityInBytes(ChildIds) + getCapacityInBytes(ChildOffsets) +
+                    getCapacityInBytes(Leaves.Ids) +
+                    getCapacityInBytes(PreorderToPostorderId) +
+                    getCapacityInBytes(NodesBfs.Ids) +
+                    getCapacityInBytes(NodesPostorder.Ids) +
+                    getCapacityInBytes(TemplateArgumentLocations) +
+                    getCapacityInBytes(SourceRanges) + getCapacityInBytes(Locations) +
+                    getCapacityInBytes(HasSourceRange) +
+                    getCapacityInBytes(HasLocations) + getCapacityInBytes(LabelIds) +
+                    getCapacityInBytes(ValueIds) + getCapacityInBytes(IdentifierIds) +
+                    getCapacityInBytes(QualifiedIdentifierIds) +
+                    getCapacityInBytes(NodeHashes) + getCapacityInBytes(SubtreeHashes) +
+                    getCapacityInBytes(StructuralHashes) +
+                    InternedStrings.getMemoryUsage() +
+                    getCapacityInBytes(Snapshots) + MainFileText.capacity() +
+                    LineIndices.getMemorySize() + TokenTables.getMemorySize();
+            for (const auto &Entry : LineIndices)
+                Size += getCapacityInBytes(Entry.second.LineOffsets);
+            for (const auto &Entry : TokenTables)
+                Size += getCapacityInBytes(Entry.second.Tokens);
+            return Size;
+        }
+
+        const SyntaxTree::Impl::NodeLocations &
+        SyntaxTree::Impl::getLocations(NodeId Id) {
+            NodeLocations &L = Locations[Id];
+            if (HasLocations[Id])
+                return L;
+            assert(!Detached && "The AST of a detached tree is gone.");
+            const SourceManager &SM = AST->getSourceManager();
+            CharSourceRange Range = getSourceRange(Id);
+            L.Offsets = {SM.getFileOffset(Range.getBegin()),
+                         SM.getFileOffset(Range.getEnd())};
+            L.Begin = getLineAndColumn(Range.getBegin());
+            L.End = getLineAndColumn(Range.getEnd());
+            HasLocations[Id] = true;
+            return L;
+        }
+
         CharSourceRange Node::getSourceRange() const {
-            return CharSourceRange::getCharRange(getSourceRangeImpl(*this));
+            assert(!Tree.Detached && "The AST of a detached tree is gone.");
+            return Tree.getSourceRange(getId());
         }
 
         std::pair<unsigned, unsigned> Node::getSourceRangeOffsets() const {
-            const SourceManager &SM = Tree.AST.getSourceManager();
-            CharSourceRange Range = getSourceRange();
-            unsigned Begin = SM.getFileOffset(Range.getBegin());
-            unsigned End = SM.getFileOffset(Range.getEnd());
-            return {Begin, End};
+            return Tree.getLocations(getId()).Offsets;
         }
 
         std::pair<unsigned, unsigned> Node::getSourceBeginLocation() const {
-            const SourceManager &SM = Tree.AST.getSourceManager();
-            CharSourceRange Range = getSourceRange();
-            SourceLocation BeginLoc = Range.getBegin();
-            PresumedLoc PLoc = SM.getPresumedLoc(BeginLoc);
-            if (PLoc.isInvalid())
-                return {NULL, NULL};
-            return {PLoc.getLine(), PLoc.getColumn()};
+            return Tree.getLocations(getId()).Begin;
         }
 
         std::pair<unsigned, unsigned> Node::getSourceEndLocation() const {
-            const SourceManager &SM = Tree.AST.getSourceManager();
-            CharSourceRange Range = getSourceRange();
-            SourceLocation EndLoc = Range.getEnd();
-            PresumedLoc PLoc = SM.getPresumedLoc(EndLoc);
-            if (PLoc.isInvalid())
-                return {NULL, NULL};
-            return {PLoc.getLine(), PLoc.getColumn()};
+            return Tree.getLocations(getId()).End;
         }
 
         static bool onlyWhitespace(StringRef Str) {
@@ -1081,9 +2162,9 @@ namespace clang {
             for (NodeRef Descendant : *this) {
                 CharSourceRange DescendantRange = Descendant.getSourceRange();
                 CharSourceRange LMDRange =
-                        getTree().getNode(Descendant.LeftMostDescendant).getSourceRange();
+                        getTree().getNode(Descendant.getLeftMostDescendant()).getSourceRange();
                 CharSourceRange RMDRange =
-                        getTree().getNode(Descendant.RightMostDescendant).getSourceRange();
+                        getTree().getNode(Descendant.getRightMostDescendant()).getSourceRange();
                 auto MinValidBegin = [&Less](CharSourceRange &Range1,
                                              CharSourceRange &Range2) {
                     SourceLocation Begin1 = Range1.getBegin(), Begin2 = Range2.getBegin();
@@ -1121,10 +2202,10 @@ namespace clang {
             SyntaxTree &Tree = getTree();
             SourceManager &SM = Tree.getSourceManager();
             const LangOptions &LangOpts = Tree.getLangOpts();
-            auto &DTN = ASTNode;
-            auto &ParentDTN = Parent.ASTNode;
+            auto &DTN = getASTNode();
+            auto &ParentDTN = Parent.getASTNode();
             size_t SiblingIndex = findPositionInParent();
-            const auto &Siblings = Parent.Children;
+            ArrayRef <NodeId> Siblings = Parent.getChildIds();
             // Remove the comma if the location is within a comma-separated list of
             // at least size 2 (minus the callee for CallExpr).
             if ((ParentDTN.get<CallExpr>() && Siblings.size() > 2) ||
@@ -1146,16 +2227,10 @@ namespace clang {
 
         void forEachTokenInRange(CharSourceRange Range, SyntaxTree &Tree,
                                  std::function<void(Token & )> Body) {
-            SourceLocation Begin = Range.getBegin(), End = Range.getEnd();
-            SourceManager &SM = Tree.getSourceManager();
-            BeforeThanCompare <SourceLocation> Less(SM);
-            Token Tok;
-            while (Begin.isValid() && Less(Begin, End) &&
-                   !Lexer::getRawToken(Begin, Tok, SM, Tree.getLangOpts(),
-                           /*IgnoreWhiteSpace=*/true) &&
-                   Less(Tok.getLocation(), End)) {
+            SyntaxTree::Impl::TokenSpan Span = Tree.TreeImpl->getTokenSpan(Range);
+            for (const SyntaxTree::Impl::FileToken &FileTok : Span.Tokens) {
+                Token Tok = Span.getToken(FileTok);
                 Body(Tok);
-                Begin = Tok.getEndLoc();
             }
         }
 
@@ -1180,7 +2255,7 @@ namespace clang {
                 HeightLess(SyntaxTree::Impl &Tree) : Tree(Tree) {}
 
                 bool operator()(NodeId Id1, NodeId Id2) const {
-                    return Tree.getNode(Id1).Height < Tree.getNode(Id2).Height;
+                    return Tree.Heights[Id1] < Tree.Heights[Id2];
                 }
             };
         } // end anonymous namespace
@@ -1216,7 +2291,7 @@ namespace clang {
                 int peekMax() const {
                     if (List.empty())
                         return 0;
-                    return Tree.getNode(List.top()).Height;
+                    return Tree.Heights[List.top()];
                 }
 
                 void open(NodeRef N) {
@@ -1227,15 +2302,58 @@ namespace clang {
         } // end anonymous namespace
 
         bool ASTDiff::Impl::identical(NodeRef N1, NodeRef N2) const {
+            if (N1.Tree.SubtreeHashes[N1.getId()] != N2.Tree.SubtreeHashes[N2.getId()])
+                return false;
+            return !Options.VerifySubtreeHashes || verifyIdentical(N1, N2);
+        }
+
+        bool ASTDiff::Impl::verifyIdentical(NodeRef N1, NodeRef N2) const {
             if (N1.getNumChildren() != N2.getNumChildren() ||
                 !isMatchingPossible(N1, N2) || areNodesDifferent(N1, N2))
                 return false;
             for (size_t Id = 0, E = N1.getNumChildren(); Id < E; ++Id)
-                if (!identical(N1.getChild(Id), N2.getChild(Id)))
+                if (!verifyIdentical(N1.getChild(Id), N2.getChild(Id)))
                     return false;
             return true;
         }
 
+// Returns the name that N declares or refers to, or StringTable::NoString.
+        static StringId getDeclaredOrReferencedName(NodeRef N) {
+            if (N.getKind() == NodeKind::DeclRefExpr ||
+                N.getKind() == NodeKind::MemberExpr)
+                return N.getValueId();
+            return N.getIdentifierId();
+        }
+
+        bool ASTDiff::Impl::isRenaming(NodeRef N1, NodeRef N2) const {
+            if (N1.Tree.StructuralHashes[N1.getId()] !=
+                    N2.Tree.StructuralHashes[N2.getId()] ||
+                getNumberOfDescendants(N1) != getNumberOfDescendants(N2) ||
+                !isMatchingPossible(N1, N2))
+                return false;
+            // The subtrees have the same shape, so their nodes pair up in preorder.
+            llvm::DenseMap <StringId, StringId> Renamed1, Renamed2;
+            for (int I = 0, E = getNumberOfDescendants(N1); I < E; ++I) {
+                NodeRef D1 = T1.getNode(N1.getId() + I);
+                NodeRef D2 = T2.getNode(N2.getId() + I);
+                // Descendants matched by the earlier phase must be matched to each
+                // other.
+                if (getDst(D1) != (getSrc(D2) ? &D2 : nullptr))
+                    return false;
+                StringId Ident1 = getDeclaredOrReferencedName(D1),
+                        Ident2 = getDeclaredOrReferencedName(D2);
+                if ((Ident1 == StringTable::NoString) !=
+                    (Ident2 == StringTable::NoString))
+                    return false;
+                if (Ident1 == StringTable::NoString)
+                    continue;
+                if (Renamed1.try_emplace(Ident1, Ident2).first->second != Ident2 ||
+                    Renamed2.try_emplace(Ident2, Ident1).first->second != Ident1)
+                    return false;
+            }
+            return true;
+        }
+
         bool ASTDiff::Impl::isMatchingPossible(NodeRef N1, NodeRef N2) const {
             return Options.isMatchingAllowed(N1, N2);
         }
@@ -1260,18 +2378,11 @@ namespace clang {
             }
         }
 
-        double ASTDiff::Impl::getJaccardSimilarity(NodeRef N1, NodeRef N2) const {
-            int CommonDescendants = 0;
-            // Count the common descendants, excluding the subtree root.
-            for (NodeId Src = N1.getId() + 1; Src <= N1.RightMostDescendant; ++Src) {
-                const Node *Dst = getDst(T1.getNode(Src));
-                if (Dst)
-                    CommonDescendants += isInSubtree(*Dst, N2);
-            }
-            // We need to subtract 1 to get the number of descendants excluding the
-            // root.
-            double Denominator = getNumberOfDescendants(N1) - 1 +
-                                 getNumberOfDescendants(N2) - 1 - CommonDescendants;
+// Returns the ratio of common descendants of two subtrees with Descendants1
+// and Descendants2 descendants.
+        static double getJaccardIndex(int Descendants1, int Descendants2,
+                                      int CommonDescendants) {
+            double Denominator = Descendants1 + Descendants2 - CommonDescendants;
             // CommonDescendants is less than the size of one subtree.
             assert(Denominator >= 0 && "Expected non-negative denominator.");
             if (Denominator == 0)
@@ -1279,11 +2390,37 @@ namespace clang {
             return CommonDescendants / Denominator;
         }
 
+        std::vector <NodeId> ASTDiff::Impl::getMappedDescendants(NodeRef N1) const {
+            std::vector <NodeId> MappedDescendants;
+            // The root of the subtree is left out.
+            for (NodeId Src = N1.getId() + 1; Src <= N1.getRightMostDescendant(); ++Src) {
+                if (const Node *Dst = getDst(T1.getNode(Src)))
+                    MappedDescendants.push_back(Dst->getId());
+            }
+            std::sort(MappedDescendants.begin(), MappedDescendants.end());
+            return MappedDescendants;
+        }
+
+        double ASTDiff::Impl::getJaccardSimilarity(
+                NodeRef N1, NodeRef N2, ArrayRef <NodeId> MappedDescendants1) const {
+            // The subtree of N2 is a contiguous range of NodeIds, the common
+            // descendants are found by binary search instead of a walk through the
+            // subtree of N1.
+            auto First = std::lower_bound(MappedDescendants1.begin(),
+                                          MappedDescendants1.end(), N2.getId());
+            auto Last = std::upper_bound(First, MappedDescendants1.end(),
+                                         N2.getRightMostDescendant());
+            // We need to subtract 1 to get the number of descendants excluding the
+            // root.
+            return getJaccardIndex(getNumberOfDescendants(N1) - 1,
+                                   getNumberOfDescendants(N2) - 1, Last - First);
+        }
+
         double ASTDiff::Impl::getNodeSimilarity(NodeRef N1, NodeRef N2) const {
-            auto Ident1 = N1.getIdentifier(), Ident2 = N2.getIdentifier();
+            StringId Ident1 = N1.getIdentifierId(), Ident2 = N2.getIdentifierId();
 
             bool SameValue = !areNodesDifferent(N1, N2);
-            auto SameIdent = Ident1 && Ident2 && *Ident1 == *Ident2;
+            bool SameIdent = Ident1 != StringTable::NoString && Ident1 == Ident2;
 
             double NodeSimilarity = 0;
             NodeSimilarity += SameValue;
@@ -1296,12 +2433,22 @@ namespace clang {
         const Node *ASTDiff::Impl::findCandidate(NodeRef N1) const {
             const Node *Candidate = nullptr;
             double HighestSimilarity = 0.0;
+            std::vector<NodeId> MappedDescendants = getMappedDescendants(N1);
+            int Descendants1 = getNumberOfDescendants(N1) - 1;
             for (NodeRef N2 : T2) {
                 if (!isMatchingPossible(N1, N2))
                     continue;
                 if (getSrc(N2))
                     continue;
-                double Similarity = getJaccardSimilarity(N1, N2);
+                // At most the mapped descendants of N1 that fit into the subtree of N2
+                // are in common. Most candidates are ruled out by their size alone.
+                int Descendants2 = getNumberOfDescendants(N2) - 1;
+                double Bound = getJaccardIndex(
+                        Descendants1, Descendants2,
+                        std::min<int>(MappedDescendants.size(), Descendants2));
+                if (Bound < Options.MinSimilarity || Bound <= HighestSimilarity)
+                    continue;
+                double Similarity = getJaccardSimilarity(N1, N2, MappedDescendants);
                 if (Similarity >= Options.MinSimilarity && Similarity > HighestSimilarity) {
                     HighestSimilarity = Similarity;
                     Candidate = &N2;
@@ -1314,12 +2461,13 @@ namespace clang {
                                                              NodeRef P2) const {
             const Node *Candidate = nullptr;
             double HighestSimilarity = 0.0;
+            std::vector<NodeId> MappedDescendants = getMappedDescendants(N1);
             for (NodeRef N2 : P2) {
                 if (!isMatchingPossible(N1, N2))
                     continue;
                 if (getSrc(N2))
                     continue;
-                double Similarity = getJaccardSimilarity(N1, N2);
+                double Similarity = getJaccardSimilarity(N1, N2, MappedDescendants);
                 Similarity += getNodeSimilarity(N1, N2);
                 if (Similarity >= Options.MinSimilarity && Similarity > HighestSimilarity) {
                     HighestSimilarity = Similarity;
@@ -1376,7 +2524,11 @@ namespace clang {
             }
         }
 
-        void ASTDiff::Impl::matchTopDown() {
+        void ASTDiff::Impl::matchTopDown(bool IgnoreNames) {
+            if (IgnoreNames) {
+                T1.computeStructuralHashes();
+                T2.computeStructuralHashes();
+            }
             PriorityList L1(T1);
             PriorityList L2(T2);
 
@@ -1398,11 +2550,15 @@ namespace clang {
                 }
                 NodeList H1 = L1.pop();
                 NodeList H2 = L2.pop();
-                for (NodeRef N1 : H1) {
-                    for (NodeRef N2 : H2) {
-                        if (identical(N1, N2) && !getDst(N1) && !getSrc(N2)) {
-                            for (int I = 0, E = getNumberOfDescendants(N1); I < E; ++I) {
-                                link(T1.getNode(N1.getId() + I), T2.getNode(N2.getId() + I));
+                if (IgnoreNames)
+                    matchRenamedSubtrees(H1.Ids, H2.Ids);
+                else {
+                    for (NodeRef N1 : H1) {
+                        for (NodeRef N2 : H2) {
+                            if (identical(N1, N2) && !getDst(N1) && !getSrc(N2)) {
+                                for (int I = 0, E = getNumberOfDescendants(N1); I < E; ++I) {
+                                    link(T1.getNode(N1.getId() + I), T2.getNode(N2.getId() + I));
+                                }
                             }
                         }
                     }
@@ -1418,18 +2574,65 @@ namespace clang {
             }
         }
 
+        void ASTDiff::Impl::matchRenamedSubtrees(ArrayRef <NodeId> H1,
+                                                 ArrayRef <NodeId> H2) {
+            auto HaveSameStructure = [&](NodeRef N1, NodeRef N2) {
+                return !getDst(N1) && !getSrc(N2) &&
+                       T1.StructuralHashes[N1.getId()] ==
+                       T2.StructuralHashes[N2.getId()];
+            };
+            // Names carry much of what tells subtrees apart, so ambiguous pairs
+            // are left to the later phases.
+            for (NodeId Id1 : H1) {
+                NodeRef N1 = T1.getNode(Id1);
+                const Node *Candidate = nullptr;
+                int NumCandidates = 0;
+                for (NodeId Id2 : H2) {
+                    if (HaveSameStructure(N1, T2.getNode(Id2))) {
+                        Candidate = &T2.getNode(Id2);
+                        ++NumCandidates;
+                    }
+                }
+                if (NumCandidates != 1)
+                    continue;
+                int NumRivals = 0;
+                for (NodeId Other : H1)
+                    NumRivals += HaveSameStructure(T1.getNode(Other), *Candidate);
+                if (NumRivals != 1 || !isRenaming(N1, *Candidate))
+                    continue;
+                for (int I = 0, E = getNumberOfDescendants(N1); I < E; ++I) {
+                    NodeRef D1 = T1.getNode(Id1 + I);
+                    if (!getDst(D1))
+                        link(D1, T2.getNode(Candidate->getId() + I));
+                }
+            }
+        }
+
         ASTDiff::Impl::Impl(SyntaxTree::Impl &T1, SyntaxTree::Impl &T2,
                             const ComparisonOptions &Options)
                 : T1(T1), T2(T2), Options(Options) {
             int Size = T1.getSize() + T2.getSize();
             SrcToDst = llvm::make_unique<NodeId[]>(Size);
             DstToSrc = llvm::make_unique<NodeId[]>(Size);
+            HashKind Hash = Options.Hash;
+            // Detached trees cannot be hashed again, the other tree is hashed the
+            // same way. Two detached trees must already agree.
+            assert((!T1.Detached || !T2.Detached || T1.HashedWith == T2.HashedWith) &&
+                   "Detached trees were hashed with different kinds of hash.");
+            if (T1.Detached)
+                Hash = T1.HashedWith;
+            else if (T2.Detached)
+                Hash = T2.HashedWith;
+            T1.computeHashes(Hash);
+            T2.computeHashes(Hash);
             computeMapping();
             computeChangeKinds();
         }
 
         void ASTDiff::Impl::computeMapping() {
             matchTopDown();
+            if (Options.MatchRenamedSubtrees)
+                matchTopDown(/*IgnoreNames=*/true);
             if (Options.StopAfterTopDown)
                 return;
             matchBottomUp();
@@ -1439,13 +2642,15 @@ namespace clang {
         }
 
         void ASTDiff::Impl::computeChangeKinds() {
+            ChangesT1.assign(T1.getSize(), NodeChange());
+            ChangesT2.assign(T2.getSize(), NodeChange());
             for (NodeRef N1 : T1) {
                 if (!getDst(N1))
-                    ChangesT1.emplace(N1.getId(), NodeChange(Delete, -1));
+                    ChangesT1[N1.getId()] = NodeChange(Delete, -1);
             }
             for (NodeRef N2 : T2) {
                 if (!getSrc(N2))
-                    ChangesT2.emplace(N2.getId(), NodeChange(Insert, -1));
+                    ChangesT2[N2.getId()] = NodeChange(Insert, -1);
             }
             for (NodeRef N1 : T1.NodesBfs) {
                 if (!getDst(N1))
@@ -1497,7 +2702,7 @@ namespace clang {
         }
 
         int ASTDiff::Impl::findNewPosition(NodeRef N) const {
-            const std::map <NodeId, NodeChange> *Changes;
+            const std::vector <NodeChange> *Changes;
             if (&N.Tree == &T1)
                 Changes = &ChangesT1;
             else
@@ -1507,8 +2712,7 @@ namespace clang {
                 return 0;
             int Position = N.findPositionInParent();
             for (NodeRef Sibling : *N.getParent()) {
-                if (Changes->count(Sibling.getId()))
-                    Position += Changes->at(Sibling.getId()).Shift;
+                Position += (*Changes)[Sibling.getId()].Shift;
                 if (&Sibling == &N)
                     return Position;
             }
@@ -1516,16 +2720,20 @@ namespace clang {
         }
 
         ChangeKind ASTDiff::Impl::getNodeChange(NodeRef N) const {
-            const std::map <NodeId, NodeChange> *Changes;
+            const std::vector <NodeChange> *Changes;
             if (&N.Tree == &T1) {
                 Changes = &ChangesT1;
             } else {
                 assert(&N.Tree == &T2 && "Invalid tree.");
                 Changes = &ChangesT2;
             }
-            if (Changes->count(N.getId()))
-                return Changes->at(N.getId()).Change;
-            return NoChange;
+            return (*Changes)[N.getId()].Change;
+        }
+
+        size_t ASTDiff::Impl::getMemoryUsage() const {
+// SrcToDst and DstToSrc have room for the nodes of both trees.
+            return 2 * (T1.getSize() + T2.getSize()) * sizeof(NodeId) +
+                   getCapacityInBytes(ChangesT1) + getCapacityInBytes(ChangesT2);
         }
 
         ASTDiff::ASTDiff(SyntaxTree &T1, SyntaxTree &T2,
@@ -1542,6 +2750,8 @@ namespace clang {
             return DiffImpl->getNodeChange(N);
         }
 
+        size_t ASTDiff::getMemoryUsage() const { return DiffImpl->getMemoryUsage(); }
+
         static void dumpDstChange(raw_ostream &OS, const ASTDiff::Impl &Diff,
                                   SyntaxTree::Impl &SrcTree, SyntaxTree::Impl &DstTree,
                                   NodeRef Dst) {
@@ -1658,30 +2868,118 @@ namespace clang {
             DiffImpl->dumpChanges(OS, DumpMatches);
         }
 
-        SyntaxTree::SyntaxTree(ASTUnit &AST)
+        SyntaxTree::SyntaxTree(ASTUnit &AST, const TreeFilter &Filter)
                 : TreeImpl(llvm::make_unique<SyntaxTree::Impl>(
-                this, AST.getASTContext().getTranslationUnitDecl(), AST)) {}
+                this, AST.getASTContext().getTranslationUnitDecl(), AST, &Filter)) {}
 
         SyntaxTree::~SyntaxTree() = default;
 
-        ASTUnit &SyntaxTree::getASTUnit() const { return TreeImpl->AST; }
+        void SyntaxTree::detach(HashKind Hash) { TreeImpl->detach(Hash); }
+
+        bool SyntaxTree::isDetached() const { return TreeImpl->Detached; }
+
+        HashKind SyntaxTree::getHashKind() const { return TreeImpl->HashedWith; }
+
+        bool SyntaxTree::save(StringRef Path, std::string &ErrorMessage) const {
+            // The tree is written to a temporary file first, so that a concurrent
+            // load() never sees a partially written file.
+            SmallString<256> TempPath;
+            int FD;
+            if (std::error_code EC =
+                    llvm::sys::fs::createUniqueFile(Path + "-%%%%%%%%", FD, TempPath)) {
+                ErrorMessage = ("Cannot create " + Path + ": " + EC.message()).str();
+                return true;
+            }
+            {
+                raw_fd_ostream OS(FD, /*shouldClose=*/true);
+                TreeImpl->save(OS);
+                OS.close();
+                if (OS.has_error()) {
+                    OS.clear_error();
+                    llvm::sys::fs::remove(TempPath);
+                    ErrorMessage = ("Cannot write " + Path).str();
+                    return true;
+                }
+            }
+            if (std::error_code EC = llvm::sys::fs::rename(TempPath, Path)) {
+                llvm::sys::fs::remove(TempPath);
+                ErrorMessage = ("Cannot write " + Path + ": " + EC.message()).str();
+                return true;
+            }
+            return false;
+        }
+
+        bool SyntaxTree::isSavedTree(StringRef Path) {
+            // Reading past the end of a short file yields zeros.
+            auto Buffer = llvm::MemoryBuffer::getFileSlice(Path, sizeof(TreeFileMagic),
+                                                           /*Offset=*/0);
+            return Buffer && Buffer.get()->getBuffer() ==
+                             StringRef(TreeFileMagic, sizeof(TreeFileMagic));
+        }
+
+        std::unique_ptr <SyntaxTree> SyntaxTree::load(StringRef Path,
+                                                       std::string &ErrorMessage) {
+            // Large files are mapped rather than read, the arrays are copied out
+            // of the mapping in one go each.
+            auto Buffer = llvm::MemoryBuffer::getFile(Path, /*FileSize=*/-1,
+                                                      /*RequiresNullTerminator=*/false);
+            if (!Buffer) {
+                ErrorMessage =
+                        ("Cannot read " + Path + ": " + Buffer.getError().message()).str();
+                return nullptr;
+            }
+            std::unique_ptr <SyntaxTree> Tree(new SyntaxTree());
+            Tree->TreeImpl = llvm::make_unique<Impl>(Tree.get());
+            if (Tree->TreeImpl->load(Buffer.get()->getBuffer(), ErrorMessage)) {
+                ErrorMessage = (Path + ": " + ErrorMessage).str();
+                return nullptr;
+            }
+            return Tree;
+        }
+
+        ASTUnit &SyntaxTree::getASTUnit() const {
+            assert(!TreeImpl->Detached && "The AST of a detached tree is gone.");
+            return *TreeImpl->AST;
+        }
+
+        StringRef SyntaxTree::getMainFileText() const {
+            if (TreeImpl->Detached)
+                return TreeImpl->MainFileText;
+            const SourceManager &SM = TreeImpl->AST->getSourceManager();
+            return SM.getBufferData(SM.getMainFileID());
+        }
 
         SourceManager &SyntaxTree::getSourceManager() const {
-            return TreeImpl->AST.getSourceManager();
+            return TreeImpl->AST->getSourceManager();
         }
 
         const LangOptions &SyntaxTree::getLangOpts() const {
-            return TreeImpl->AST.getLangOpts();
+            return TreeImpl->AST->getLangOpts();
+        }
+
+        std::pair<unsigned, unsigned>
+        SyntaxTree::getLineAndColumn(SourceLocation Loc) const {
+            assert(!TreeImpl->Detached && "The AST of a detached tree is gone.");
+            return TreeImpl->getLineAndColumn(Loc);
+        }
+
+        SourceLocation SyntaxTree::getNextTokenLocation(SourceLocation Loc) const {
+            assert(!TreeImpl->Detached && "The AST of a detached tree is gone.");
+            return TreeImpl->getNextTokenLocation(Loc);
         }
 
         const ASTContext &SyntaxTree::getASTContext() const {
-            return TreeImpl->AST.getASTContext();
+            return TreeImpl->AST->getASTContext();
         }
 
         NodeRef SyntaxTree::getNode(NodeId Id) const { return TreeImpl->getNode(Id); }
 
         int SyntaxTree::getSize() const { return TreeImpl->getSize(); }
 
+        size_t SyntaxTree::getMemoryUsage() const {
+            return TreeImpl->getMemoryUsage();
+        }
+
         NodeRef SyntaxTree::getRoot() const { return TreeImpl->getRoot(); }
 
         NodeId SyntaxTree::getRootId() const { return TreeImpl->getRootId(); }
@@ -0,0 +1,301 @@
+//===- Server.cpp - Serving requests from a long-lived process -*- C++ -*- -===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "crochet/Server.h"
+
+#include "llvm/Support/Errno.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <csignal>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace clang;
+
+namespace clang {
+namespace diff {
+
+std::shared_ptr<CachedTree> makeCachedTree(std::unique_ptr<ASTUnit> AST,
+                                           const TreeFilter &Filter) {
+  auto Value = std::make_shared<CachedTree>();
+  Value->Tree = llvm::make_unique<SyntaxTree>(*AST, Filter);
+  Value->AST = std::move(AST);
+  return Value;
+}
+
+std::shared_ptr<CachedTree> TreeCache::lookup(StringRef Filename) {
+  auto It = llvm::find_if(
+      Entries, [&](const Entry &E) { return E.Filename == Filename; });
+  if (It == Entries.end())
+    return nullptr;
+  auto HasChanged = [](const InputFile &Input) {
+    llvm::sys::fs::file_status Status;
+    return llvm::sys::fs::status(Input.Filename, Status) ||
+           llvm::sys::toTimeT(Status.getLastModificationTime()) !=
+               Input.ModificationTime ||
+           Status.getSize() != Input.Size;
+  };
+  llvm::sys::fs::file_status Status;
+  if (llvm::sys::fs::status(Filename, Status) ||
+      Status.getLastModificationTime() != It->ModificationTime ||
+      Status.getSize() != It->Size || llvm::any_of(It->Inputs, HasChanged)) {
+    Entries.erase(It);
+    return nullptr;
+  }
+  Entries.splice(Entries.begin(), Entries, It);
+  return It->Value;
+}
+
+std::shared_ptr<CachedTree> TreeCache::insert(StringRef Filename,
+                                              std::unique_ptr<ASTUnit> AST) {
+  std::shared_ptr<CachedTree> Value = makeCachedTree(std::move(AST), Filter);
+  llvm::sys::fs::file_status Status;
+  if (Capacity == 0 || llvm::sys::fs::status(Filename, Status))
+    return Value;
+  // The FileEntries have the size and time the files had when they were read,
+  // a file that changed during parsing makes the entry stale right away.
+  // Headers found through relative include paths have relative names, which
+  // the file system of the parse resolves against the compile directory.
+  std::vector<InputFile> Inputs;
+  const SourceManager &SM = Value->AST->getSourceManager();
+  IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS =
+      Value->AST->getFileManager().getVirtualFileSystem();
+  for (auto It = SM.fileinfo_begin(), E = SM.fileinfo_end(); It != E; ++It) {
+    const FileEntry *File = It->first;
+    SmallString<256> Name(File->getName());
+    FS->makeAbsolute(Name);
+    Inputs.push_back({Name.str(), File->getModificationTime(),
+                      uint64_t(File->getSize())});
+  }
+  Entries.remove_if([&](const Entry &E) { return E.Filename == Filename; });
+  if (Entries.size() >= Capacity)
+    Entries.pop_back();
+  Entries.push_front({Filename, Status.getLastModificationTime(),
+                      Status.getSize(), Value, std::move(Inputs)});
+  return Value;
+}
+
+static llvm::json::Value toJSONString(std::string Text) {
+  if (!llvm::json::isUTF8(Text))
+    Text = llvm::json::fixUTF8(Text);
+  return std::move(Text);
+}
+
+llvm::json::Value makeResponse(int Status, std::string Output,
+                               std::string Errors) {
+  // The output may be patched source code, a repaired copy of it would be a
+  // different file.
+  if (!llvm::json::isUTF8(Output)) {
+    Status = 1;
+    Output.clear();
+    Errors += "Error: The output is not valid UTF-8 and cannot be sent in a "
+              "response, run the tool without -connect\n";
+  }
+  return llvm::json::Object{{"status", Status},
+                            {"output", toJSONString(std::move(Output))},
+                            {"errors", toJSONString(std::move(Errors))}};
+}
+
+int printResponse(const llvm::json::Value &Response) {
+  const llvm::json::Object *Object = Response.getAsObject();
+  if (!Object) {
+    llvm::errs() << "Error: Malformed response from server\n";
+    return 1;
+  }
+  if (auto Output = Object->getString("output"))
+    llvm::outs() << *Output;
+  if (auto Errors = Object->getString("errors"))
+    llvm::errs() << *Errors;
+  return Object->getInteger("status").getValueOr(1);
+}
+
+static bool writeAll(int FD, StringRef Data) {
+  while (!Data.empty()) {
+    ssize_t Written = ::write(FD, Data.data(), Data.size());
+    if (Written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    Data = Data.drop_front(Written);
+  }
+  return true;
+}
+
+// Reads up to the first newline. Returns false if the connection was closed
+// before a complete line arrived.
+static bool readLine(int FD, std::string &Line) {
+  char Buffer[4096];
+  while (true) {
+    ssize_t Read = ::read(FD, Buffer, sizeof(Buffer));
+    if (Read < 0 && errno == EINTR)
+      continue;
+    if (Read <= 0)
+      return false;
+    StringRef Chunk(Buffer, Read);
+    size_t End = Chunk.find('\n');
+    Line += Chunk.take_front(End);
+    if (End != StringRef::npos)
+      return true;
+  }
+}
+
+// Returns true if SocketPath does not fit into a socket address.
+static bool getSocketAddress(StringRef SocketPath, sockaddr_un &Address) {
+  memset(&Address, 0, sizeof(Address));
+  Address.sun_family = AF_UNIX;
+  if (SocketPath.size() >= sizeof(Address.sun_path))
+    return true;
+  memcpy(Address.sun_path, SocketPath.data(), SocketPath.size());
+  return false;
+}
+
+// Removes the socket file of a server that did not shut down cleanly, it would
+// make bind() fail. Returns true, and leaves the path alone, if something other
+// than a socket is there or a server still accepts connections on it.
+static bool removeStaleSocket(StringRef SocketPath,
+                              const sockaddr_un &Address) {
+  struct stat Status;
+  if (::lstat(Address.sun_path, &Status)) {
+    if (errno == ENOENT)
+      return false;
+    llvm::errs() << "Error: Cannot access " << SocketPath << ": "
+                 << llvm::sys::StrError() << "\n";
+    return true;
+  }
+  if (!S_ISSOCK(Status.st_mode)) {
+    llvm::errs() << "Error: " << SocketPath
+                 << " exists and is not a socket, not replacing it\n";
+    return true;
+  }
+  int Probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Probe < 0) {
+    llvm::errs() << "Error: Cannot create socket: "
+                 << llvm::sys::StrError() << "\n";
+    return true;
+  }
+  bool InUse = !::connect(Probe, reinterpret_cast<const sockaddr *>(&Address),
+                          sizeof(Address));
+  ::close(Probe);
+  if (InUse) {
+    llvm::errs() << "Error: A server is already listening on " << SocketPath
+                 << "\n";
+    return true;
+  }
+  ::unlink(Address.sun_path);
+  return false;
+}
+
+bool serve(StringRef SocketPath,
+           llvm::function_ref<llvm::json::Value(const llvm::json::Object &)>
+               Handle) {
+  sockaddr_un Address;
+  if (getSocketAddress(SocketPath, Address)) {
+    llvm::errs() << "Error: Socket path is too long: " << SocketPath << "\n";
+    return true;
+  }
+  if (removeStaleSocket(SocketPath, Address))
+    return true;
+  int Socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Socket < 0) {
+    llvm::errs() << "Error: Cannot create socket: "
+                 << llvm::sys::StrError() << "\n";
+    return true;
+  }
+  if (::bind(Socket, reinterpret_cast<sockaddr *>(&Address),
+             sizeof(Address)) ||
+      ::listen(Socket, SOMAXCONN)) {
+    llvm::errs() << "Error: Cannot listen on " << SocketPath << ": "
+                 << llvm::sys::StrError() << "\n";
+    ::close(Socket);
+    return true;
+  }
+  // Clients that go away before reading their response must not take the
+  // server down with them.
+  ::signal(SIGPIPE, SIG_IGN);
+
+  bool Shutdown = false;
+  while (!Shutdown) {
+    int Connection = ::accept(Socket, nullptr, nullptr);
+    if (Connection < 0) {
+      if (errno == EINTR)
+        continue;
+      llvm::errs() << "Error: Cannot accept connection: "
+                   << llvm::sys::StrError() << "\n";
+      break;
+    }
+    std::string Line;
+    if (readLine(Connection, Line)) {
+      llvm::json::Value Response = nullptr;
+      llvm::Expected<llvm::json::Value> Request = llvm::json::parse(Line);
+      if (!Request) {
+        Response = makeResponse(1, "",
+                                "Error: Malformed request: " +
+                                    llvm::toString(Request.takeError()) + "\n");
+      } else if (const llvm::json::Object *Object = Request->getAsObject()) {
+        auto Command = Object->getString("command");
+        if (Command && *Command == "shutdown") {
+          Shutdown = true;
+          Response = makeResponse(0, "", "");
+        } else {
+          Response = Handle(*Object);
+        }
+      } else {
+        Response = makeResponse(1, "", "Error: Request is not an object\n");
+      }
+      std::string Text;
+      llvm::raw_string_ostream OS(Text);
+      OS << Response << "\n";
+      writeAll(Connection, OS.str());
+    }
+    ::close(Connection);
+  }
+  ::close(Socket);
+  ::unlink(Address.sun_path);
+  return false;
+}
+
+llvm::Expected<llvm::json::Value> sendRequest(StringRef SocketPath,
+                                              const llvm::json::Value &Request) {
+  auto MakeError = [&](const Twine &Message) {
+    return llvm::make_error<llvm::StringError>(
+        Message + " " + SocketPath + ": " + llvm::sys::StrError(),
+        llvm::inconvertibleErrorCode());
+  };
+  sockaddr_un Address;
+  if (getSocketAddress(SocketPath, Address))
+    return llvm::make_error<llvm::StringError>(
+        "Socket path is too long: " + SocketPath,
+        llvm::inconvertibleErrorCode());
+  int Socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Socket < 0)
+    return MakeError("Cannot create socket for");
+  if (::connect(Socket, reinterpret_cast<sockaddr *>(&Address),
+                sizeof(Address))) {
+    auto Err = MakeError("Cannot connect to");
+    ::close(Socket);
+    return std::move(Err);
+  }
+  std::string Text;
+  llvm::raw_string_ostream OS(Text);
+  OS << Request << "\n";
+  std::string Line;
+  bool Received = writeAll(Socket, OS.str()) && readLine(Socket, Line);
+  ::close(Socket);
+  if (!Received)
+    return MakeError("Lost connection to");
+  return llvm::json::parse(Line);
+}
+
+} // end namespace diff
+} // end namespace clang
@@ -0,0 +1,105 @@
+//===- StringTable.cpp - Interned node labels and values ------*- C++ -*- -===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "crochet/StringTable.h"
+
+using namespace llvm;
+
+namespace clang {
+namespace diff {
+
+StringTable::StringTable() {
+  // Taken by NoString.
+  Strings.emplace_back();
+  NumUsers.push_back(0);
+}
+
+StringTable &StringTable::get() {
+  static StringTable Table;
+  return Table;
+}
+
+std::pair<StringId, StringRef> StringTable::acquire(StringRef Str) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto Inserted = Ids.try_emplace(Str, NoString);
+  StringId &Id = Inserted.first->second;
+  if (Inserted.second) {
+    if (FreeIds.empty()) {
+      Id = Strings.size();
+      Strings.emplace_back();
+      NumUsers.push_back(0);
+    } else {
+      Id = FreeIds.back();
+      FreeIds.pop_back();
+    }
+    Strings[Id] = Inserted.first->getKey();
+  }
+  ++NumUsers[Id];
+  return {Id, Strings[Id]};
+}
+
+void StringTable::release(ArrayRef<StringId> Released) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (StringId Id : Released) {
+    assert(Id != NoString && Id < NumUsers.size() && NumUsers[Id] > 0 &&
+           "Unbalanced release.");
+    if (--NumUsers[Id] > 0)
+      continue;
+    Ids.erase(Strings[Id]);
+    Strings[Id] = StringRef();
+    FreeIds.push_back(Id);
+  }
+}
+
+size_t StringTable::getMemoryUsage() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  size_t Size = Ids.getNumBuckets() * (sizeof(StringMapEntryBase *) +
+                                       sizeof(unsigned)) +
+                Strings.capacity() * sizeof(StringRef) +
+                NumUsers.capacity() * sizeof(unsigned) +
+                FreeIds.capacity() * sizeof(StringId);
+  // Each string is stored with its entry in Ids, NoString has none.
+  for (size_t I = 1; I < Strings.size(); ++I)
+    if (NumUsers[I] > 0)
+      Size += sizeof(StringMapEntry<StringId>) + Strings[I].size() + 1;
+  return Size;
+}
+
+TreeStrings::~TreeStrings() {
+  std::vector<StringId> Released;
+  Released.reserve(Strings.size());
+  for (const auto &Entry : Strings)
+    Released.push_back(Entry.first);
+  StringTable::get().release(Released);
+}
+
+StringId TreeStrings::intern(StringRef Str) {
+  auto It = Ids.find(Str);
+  if (It != Ids.end())
+    return It->second;
+  std::pair<StringId, StringRef> Acquired = StringTable::get().acquire(Str);
+  Ids[Acquired.second] = Acquired.first;
+  Strings[Acquired.first] = Acquired.second;
+  return Acquired.first;
+}
+
+StringRef TreeStrings::getString(StringId Id) const {
+  if (Id == StringTable::NoString)
+    return StringRef();
+  auto It = Strings.find(Id);
+  assert(It != Strings.end() && "Unknown string id.");
+  return It->second;
+}
+
+size_t TreeStrings::getMemoryUsage() const {
+  return Ids.getMemorySize() + Strings.getMemorySize();
+}
+
+} // end namespace diff
+} // end namespace clang
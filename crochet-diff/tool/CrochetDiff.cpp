@@ -12,10 +12,23 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "crochet/ASTCache.h"
 #include "crochet/ASTDiff.h"
+#include "crochet/CompilationDatabaseCache.h"
+#include "crochet/PreambleCache.h"
+#include "crochet/Server.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include <map>
+#include <numeric>
 
 using namespace llvm;
 using namespace clang;
@@ -43,7 +56,7 @@ static cl::opt<bool> HtmlDiff("html",
 
 
 static cl::opt<std::string> SourcePath(cl::Positional, cl::desc("<source>"),
-                                       cl::Required,
+                                       cl::Optional,
                                        cl::cat(ClangDiffCategory));
 
 static cl::opt<std::string> DestinationPath(cl::Positional,
@@ -63,9 +76,100 @@ static cl::opt<std::string> StopAfter("stop-diff-after",
 static cl::opt<int> MaxSize("s", cl::desc("<maxsize>"), cl::Optional,
                             cl::init(-1), cl::cat(ClangDiffCategory));
 
+static cl::opt<std::string>
+    NodeHash("node-hash",
+             cl::desc("Hash function for comparing nodes, xxhash (the "
+                      "default) or md5"),
+             cl::Optional, cl::init(""), cl::cat(ClangDiffCategory));
+
+static cl::opt<bool> MatchRenamed(
+    "match-renamed",
+    cl::desc("Also match subtrees that only differ in the names in them"),
+    cl::init(false), cl::Optional, cl::cat(ClangDiffCategory));
+
 static cl::opt<std::string> BuildPath("p", cl::desc("Build path"), cl::init(""),
                                       cl::Optional, cl::cat(ClangDiffCategory));
 
+static cl::opt<std::string> ASTCacheDir(
+    "ast-cache-dir",
+    cl::desc("Directory for caching serialized ASTs across invocations"),
+    cl::init(""), cl::Optional, cl::cat(ClangDiffCategory));
+
+static cl::opt<std::string> BatchPath(
+    "batch",
+    cl::desc("Diff every pair in a manifest with lines of the form "
+             "'<source> <destination> <output>'"),
+    cl::init(""), cl::Optional, cl::cat(ClangDiffCategory));
+
+static cl::opt<unsigned>
+    Jobs("j", cl::desc("Number of threads for -batch, all cores if 0"),
+         cl::init(0), cl::Optional, cl::cat(ClangDiffCategory));
+
+static cl::opt<std::string>
+    ServePath("serve",
+              cl::desc("Serve requests on this Unix domain socket until a "
+                       "shutdown request arrives"),
+              cl::init(""), cl::Optional, cl::cat(ClangDiffCategory));
+
+static cl::opt<std::string> ConnectPath(
+    "connect",
+    cl::desc("Send the request to the server listening on this socket"),
+    cl::init(""), cl::Optional, cl::cat(ClangDiffCategory));
+
+static cl::opt<unsigned> ServeCacheSize(
+    "serve-cache-size",
+    cl::desc("Number of syntax trees a server keeps in memory"),
+    cl::init(32), cl::Optional, cl::cat(ClangDiffCategory));
+
+static cl::opt<std::string> StdinPath(
+    "stdin-file",
+    cl::desc("Read the contents of this file from standard input instead of "
+             "from disk"),
+    cl::init(""), cl::Optional, cl::cat(ClangDiffCategory));
+
+static cl::opt<bool> Snapshot(
+    "snapshot",
+    cl::desc("Free each AST as soon as its syntax tree is built, keeping only "
+             "what the diff and the dumps need"),
+    cl::init(false), cl::cat(ClangDiffCategory));
+
+static cl::opt<bool> PrintMemoryUsage(
+    "print-memory-usage",
+    cl::desc("Print the number of bytes taken by the syntax trees and the "
+             "diff to standard error"),
+    cl::init(false), cl::cat(ClangDiffCategory));
+
+static cl::opt<std::string> SaveTreePath(
+    "save-tree",
+    cl::desc("Write the syntax tree of <source> to this file. Saved trees can "
+             "be given instead of source files and are loaded without "
+             "parsing"),
+    cl::init(""), cl::Optional, cl::cat(ClangDiffCategory));
+
+static cl::opt<bool> MainFileOnly(
+    "main-file-only",
+    cl::desc("Build syntax trees only from the declarations in the main file "
+             "and in the files given to -tree-files"),
+    cl::init(false), cl::cat(ClangDiffCategory));
+
+static cl::list<std::string> TreeFiles(
+    "tree-files",
+    cl::desc("Build syntax trees only from the declarations in files that "
+             "match one of these globs, and in the main file with "
+             "-main-file-only"),
+    cl::CommaSeparated, cl::cat(ClangDiffCategory));
+
+static cl::list<std::string> TreeDecls(
+    "tree-decls",
+    cl::desc("Build syntax trees only from the top-level declarations with "
+             "these names"),
+    cl::CommaSeparated, cl::cat(ClangDiffCategory));
+
+static cl::opt<bool> SharePreamble(
+    "share-preamble",
+    cl::desc("Compile the headers shared by the input files into one preamble"),
+    cl::init(false), cl::cat(ClangDiffCategory));
+
 static cl::list<std::string> ArgsAfter(
     "extra-arg",
     cl::desc("Additional argument to append to the compiler command line"),
@@ -89,17 +193,21 @@ static void addExtraArgs(std::unique_ptr<CompilationDatabase> &Compilations) {
   Compilations = std::move(AdjustingCompilations);
 }
 
+// Compilation databases found so far, shared by all inputs of this process.
+static diff::CompilationDatabaseCache CompilationDatabases;
+
+// Errors go to ErrOS, so that a server or batch run reports them with the
+// request they belong to.
 static std::unique_ptr<CompilationDatabase>
-getCompilationDatabase(StringRef Filename) {
+getCompilationDatabase(StringRef Filename, raw_ostream &ErrOS) {
   std::string ErrorMessage;
   std::unique_ptr<CompilationDatabase> Compilations =
-      CompilationDatabase::autoDetectFromSource(
+      CompilationDatabases.autoDetectFromSource(
           BuildPath.empty() ? Filename : BuildPath, ErrorMessage);
   if (!Compilations) {
-    llvm::errs()
-        << "Error while trying to load a compilation database, running "
-           "without flags.\n"
-        << ErrorMessage;
+    ErrOS << "Error while trying to load a compilation database, running "
+             "without flags.\n"
+          << ErrorMessage;
     Compilations = llvm::make_unique<clang::tooling::FixedCompilationDatabase>(
         ".", std::vector<std::string>());
   }
@@ -107,19 +215,119 @@ getCompilationDatabase(StringRef Filename) {
   return Compilations;
 }
 
+// Preambles shared by all ASTs built with -share-preamble.
+static diff::PreambleCache Preambles;
+
+namespace {
+// Does what ASTBuilderAction in Tooling.cpp does.
+class ASTBuilder : public ToolAction {
+public:
+  ASTBuilder(std::vector<std::unique_ptr<ASTUnit>> &ASTs) : ASTs(ASTs) {}
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    std::unique_ptr<ASTUnit> AST = ASTUnit::LoadFromCompilerInvocation(
+        Invocation, std::move(PCHContainerOps),
+        CompilerInstance::createDiagnostics(&Invocation->getDiagnosticOpts(),
+                                            DiagConsumer,
+                                            /*ShouldOwnClient=*/false),
+        Files);
+    if (!AST)
+      return false;
+    ASTs.push_back(std::move(AST));
+    return true;
+  }
+
+private:
+  std::vector<std::unique_ptr<ASTUnit>> &ASTs;
+};
+} // end anonymous namespace
+
+// Contents of files that have not been saved to disk, keyed by absolute path.
+using FileContents = std::map<std::string, std::string>;
+
+// Runs Action on Filename the way ClangTool::run() does, except that relative
+// paths are resolved by a file system with its own working directory. ClangTool
+// changes the working directory of the process, which breaks parses running
+// on other threads. Files in Overlays are read from memory instead of disk,
+// the compile command is still looked up by their path.
+static bool runOnFile(const CompilationDatabase &Compilations,
+                      StringRef Filename, ToolAction &Action,
+                      DiagnosticConsumer &DiagConsumer,
+                      const FileContents &Overlays) {
+  std::vector<CompileCommand> Commands =
+      Compilations.getCompileCommands(Filename);
+  if (Commands.empty())
+    return false;
+  const CompileCommand &Command = Commands[0];
+  IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> FS(
+      new llvm::vfs::OverlayFileSystem(llvm::vfs::createPhysicalFileSystem()));
+  if (!Overlays.empty()) {
+    IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> MemFS(
+        new llvm::vfs::InMemoryFileSystem());
+    for (const auto &Overlay : Overlays)
+      MemFS->addFile(Overlay.first, 0,
+                     llvm::MemoryBuffer::getMemBufferCopy(Overlay.second,
+                                                          Overlay.first));
+    FS->pushOverlay(MemFS);
+  }
+  if (FS->setCurrentWorkingDirectory(Command.Directory))
+    return false;
+  IntrusiveRefCntPtr<FileManager> Files(
+      new FileManager(FileSystemOptions(), FS));
+
+  ArgumentsAdjuster Adjuster = combineAdjusters(
+      combineAdjusters(getClangStripOutputAdjuster(),
+                       getClangSyntaxOnlyAdjuster()),
+      getClangStripDependencyFileAdjuster());
+  std::vector<std::string> CommandLine =
+      Adjuster(Command.CommandLine, Command.Filename);
+  if (llvm::none_of(CommandLine, [](StringRef Arg) {
+        return Arg.startswith("-resource-dir");
+      })) {
+    static int StaticSymbol;
+    CommandLine.push_back(
+        "-resource-dir=" +
+        CompilerInvocation::GetResourcesPath("clang_tool", &StaticSymbol));
+  }
+
+  ToolInvocation Invocation(std::move(CommandLine), &Action, Files.get());
+  Invocation.setDiagnosticConsumer(&DiagConsumer);
+  return Invocation.run();
+}
+
+// Files in Overlays are parsed from memory. Such ASTs bypass the AST cache,
+// which only knows about files on disk.
 static std::unique_ptr<ASTUnit>
 getAST(const std::unique_ptr<CompilationDatabase> &CommonCompilations,
-       const StringRef Filename) {
-  std::array<std::string, 1> Files = {{Filename}};
+       const StringRef Filename, raw_ostream &ErrOS = llvm::errs(),
+       const FileContents &Overlays = FileContents()) {
+  SmallString<256> AbsolutePath(Filename);
+  llvm::sys::fs::make_absolute(AbsolutePath);
   std::unique_ptr<CompilationDatabase> FileCompilations;
   if (!CommonCompilations)
-    FileCompilations = getCompilationDatabase(Filename);
-  ClangTool Tool(CommonCompilations ? *CommonCompilations : *FileCompilations,
-                 Files);
+    FileCompilations = getCompilationDatabase(Filename, ErrOS);
+  const CompilationDatabase &Compilations =
+      CommonCompilations ? *CommonCompilations : *FileCompilations;
+  diff::ASTCache Cache(ASTCacheDir);
+  bool UseCache = !ASTCacheDir.empty() && Overlays.empty();
+  if (UseCache)
+    if (std::unique_ptr<ASTUnit> AST = Cache.load(Compilations, AbsolutePath))
+      return AST;
   std::vector<std::unique_ptr<ASTUnit>> ASTs;
-  Tool.buildASTs(ASTs);
+  std::unique_ptr<ToolAction> Action =
+      SharePreamble ? Preambles.newASTBuilder(Compilations, AbsolutePath, ASTs)
+                    : llvm::make_unique<ASTBuilder>(ASTs);
+  TextDiagnosticPrinter DiagPrinter(ErrOS, new DiagnosticOptions());
+  if (!runOnFile(Compilations, AbsolutePath, *Action, DiagPrinter, Overlays))
+    ErrOS << "Error while processing " << AbsolutePath << ".\n";
   if (ASTs.size() == 0)
     return nullptr;
+  // Units built on a shared preamble depend on its temporary file.
+  if (UseCache && !SharePreamble)
+    Cache.store(Compilations, AbsolutePath, *ASTs[0]);
   return std::move(ASTs[0]);
 }
 
@@ -281,9 +489,7 @@ static unsigned printHtmlForNode(raw_ostream &OS, const diff::ASTDiff &Diff,
   char MyTag, OtherTag;
   diff::NodeId LeftId, RightId;
   diff::SyntaxTree &Tree = Node.getTree();
-  const SourceManager &SM = Tree.getASTContext().getSourceManager();
-  SourceLocation SLoc = Node.getSourceRange().getBegin();
-  if (SLoc.isValid() && !SM.isInMainFile(SLoc))
+  if (!Node.isInMainFile())
     return Offset;
   const diff::Node *Target = Diff.getMapped(Node);
   diff::NodeId TargetId = Target ? Target->getId() : diff::NodeId();
@@ -300,7 +506,7 @@ static unsigned printHtmlForNode(raw_ostream &OS, const diff::ASTDiff &Diff,
   }
   unsigned Begin, End;
   std::tie(Begin, End) = Node.getSourceRangeOffsets();
-  auto Code = SM.getBuffer(SM.getMainFileID())->getBuffer();
+  StringRef Code = Tree.getMainFileText();
   for (; Offset < Begin; ++Offset)
     printHtml(OS, Code[Offset]);
   OS << "<span id='" << MyTag << Node.getId() << "' "
@@ -357,6 +563,24 @@ bool in_array(const std::string &value, const std::vector<std::string> &array)
     return std::find(array.begin(), array.end(), value) != array.end();
 }
 
+// Returns true for the nodes that are printed with the file they are in.
+static bool hasFileAttribute(diff::NodeKind Kind) {
+  switch (Kind) {
+  case diff::NodeKind::EnumConstantDecl:
+  case diff::NodeKind::EnumDecl:
+  case diff::NodeKind::FileScopeAsmDecl:
+  case diff::NodeKind::FunctionDecl:
+  case diff::NodeKind::InitListExpr:
+  case diff::NodeKind::Macro:
+  case diff::NodeKind::RecordDecl:
+  case diff::NodeKind::TypedefDecl:
+  case diff::NodeKind::VarDecl:
+    return true;
+  default:
+    return false;
+  }
+}
+
 static void printNodeAttributes(raw_ostream &OS, diff::SyntaxTree &Tree,
                                 diff::NodeRef Node) {
 
@@ -365,9 +589,7 @@ static void printNodeAttributes(raw_ostream &OS, diff::SyntaxTree &Tree,
     OS << R"(,"parent_id":)" << int(Node.getParent()->getId());
   OS << R"(,"type":")" << Node.getTypeLabel() << '"';
 
-  if (Node.getTypeLabel() == "FunctionDecl" || Node.getTypeLabel() == "TypedefDecl" || Node.getTypeLabel() == "RecordDecl" || Node.getTypeLabel() == "InitListExpr"
-      || Node.getTypeLabel() == "EnumDecl" || Node.getTypeLabel() == "EnumConstantDecl" || Node.getTypeLabel() == "Macro" || Node.getTypeLabel() == "TypedefDecl" || Node.getTypeLabel() == "VarDecl"
-      || Node.getTypeLabel() == "FileScopeAsmDecl"){
+  if (hasFileAttribute(Node.getKind())){
     std::string fileName = Node.getFileName();
       if (!fileName.empty()) {
       OS << R"(,"file":")";
@@ -376,9 +598,8 @@ static void printNodeAttributes(raw_ostream &OS, diff::SyntaxTree &Tree,
     } 
   }
 
-  if (Node.getTypeLabel() == "MemberExpr"){
-    auto memNode = Node.ASTNode.get<MemberExpr>();
-    if (memNode->isArrow()) {
+  if (Node.getKind() == diff::NodeKind::MemberExpr){
+    if (Node.isArrow()) {
       OS << R"(,"isArrow":")";
       printJsonString(OS, "yes");
       OS << '"';
@@ -452,90 +673,489 @@ static void printNodeAsJson(raw_ostream &OS, diff::SyntaxTree &Tree,
 
 static void printTree(raw_ostream &OS, diff::SyntaxTree &Tree) {
   for (diff::NodeRef Node : Tree) {
-    for (int I = 0; I < Node.Depth; ++I)
+    for (int I = 0; I < Node.getDepth(); ++I)
       OS << " ";
     Node.dump(OS);
     OS << "\n";
   }
 }
 
-int main(int argc, const char **argv) {
-  std::string ErrorMessage;
-  std::unique_ptr<CompilationDatabase> CommonCompilations =
-      FixedCompilationDatabase::loadFromCommandLine(argc, argv, ErrorMessage);
-  if (!CommonCompilations && !ErrorMessage.empty())
-    llvm::errs() << ErrorMessage;
-  cl::HideUnrelatedOptions(ClangDiffCategory);
-  if (!cl::ParseCommandLineOptions(argc, argv)) {
-    cl::PrintOptionValues();
-    return 1;
+// Reads the comparison options of a request. Returns true on error.
+static bool getComparisonOptions(const json::Object &Request,
+                                 diff::ComparisonOptions &Options,
+                                 raw_ostream &ErrOS) {
+  int64_t RequestMaxSize = Request.getInteger("max_size").getValueOr(-1);
+  if (RequestMaxSize != -1)
+    Options.MaxSize = RequestMaxSize;
+  StringRef RequestStopAfter = Request.getString("stop_after").getValueOr("");
+  if (!RequestStopAfter.empty()) {
+    if (RequestStopAfter == "topdown")
+      Options.StopAfterTopDown = true;
+    else if (RequestStopAfter == "bottomup")
+      Options.StopAfterBottomUp = true;
+    else {
+      ErrOS << "Error: Invalid argument for -stop-diff-after\n";
+      return true;
+    }
   }
+  Options.MatchRenamedSubtrees =
+      Request.getBoolean("match_renamed").getValueOr(false);
+  return false;
+}
 
-  addExtraArgs(CommonCompilations);
+// Reads the hash function of a request. Returns true on error.
+static bool getHashKind(const json::Object &Request, diff::HashKind &Hash,
+                        raw_ostream &ErrOS) {
+  StringRef Name = Request.getString("node_hash").getValueOr("");
+  if (Name.empty() || Name == "xxhash")
+    Hash = diff::HashKind::XXHash;
+  else if (Name == "md5")
+    Hash = diff::HashKind::MD5;
+  else {
+    ErrOS << "Error: Invalid argument for -node-hash\n";
+    return true;
+  }
+  return false;
+}
 
-  if (ASTDump || ASTDumpJson) {
-    if (!DestinationPath.empty()) {
-      llvm::errs() << "Error: Please specify exactly one filename.\n";
-      return 1;
+static void printMemoryUsage(raw_ostream &OS, const diff::SyntaxTree &SrcTree,
+                             const diff::SyntaxTree &DstTree,
+                             const diff::ASTDiff &Diff) {
+  OS << "Memory usage in bytes: source tree " << SrcTree.getMemoryUsage()
+     << ", destination tree " << DstTree.getMemoryUsage() << ", diff "
+     << Diff.getMemoryUsage() << ", string table "
+     << diff::StringTable::get().getMemoryUsage() << "\n";
+}
+
+static void printDiff(raw_ostream &OS, raw_ostream &ErrOS,
+                      diff::SyntaxTree &SrcTree, diff::SyntaxTree &DstTree,
+                      const diff::ComparisonOptions &Options, bool Html,
+                      bool Matches, bool MemoryUsage) {
+  diff::ASTDiff Diff(SrcTree, DstTree, Options);
+  if (MemoryUsage)
+    printMemoryUsage(ErrOS, SrcTree, DstTree, Diff);
+
+  if (Html) {
+    OS << HtmlDiffHeader << "<pre>";
+    OS << "<div id='L' class='code'>";
+    printHtmlForNode(OS, Diff, true, SrcTree.getRoot(), 0);
+    OS << "</div>";
+    OS << "<div id='R' class='code'>";
+    printHtmlForNode(OS, Diff, false, DstTree.getRoot(), 0);
+    OS << "</div>";
+    OS << "</pre></div></body></html>\n";
+    return;
+  }
+
+  Diff.dumpChanges(OS, Matches);
+}
+
+// The filter from the command line. A server builds all trees with its own
+// filter, whatever the client was given.
+static diff::TreeFilter Filter;
+
+// Fills Filter from the command line. Returns true on error.
+static bool setTreeFilter() {
+  Filter.MainFileOnly = MainFileOnly;
+  Filter.DeclNames.assign(TreeDecls.begin(), TreeDecls.end());
+  for (const std::string &Glob : TreeFiles) {
+    if (auto Err = Filter.addFileGlob(Glob)) {
+      llvm::errs() << "Error: Invalid glob '" << Glob
+                   << "': " << llvm::toString(std::move(Err)) << "\n";
+      return true;
     }
-    std::unique_ptr<ASTUnit> AST = getAST(CommonCompilations, SourcePath);
+  }
+  return false;
+}
+
+namespace {
+// State that is kept between the requests handled by one process.
+struct Session {
+  Session(const std::unique_ptr<CompilationDatabase> &CommonCompilations,
+          unsigned CacheSize)
+      : CommonCompilations(CommonCompilations), Trees(CacheSize, Filter) {}
+
+  const std::unique_ptr<CompilationDatabase> &CommonCompilations;
+  diff::TreeCache Trees;
+};
+} // end anonymous namespace
+
+// Trees parsed with overlays are not cached, a later request may send other
+// contents for the same path. Without UseCache, the tree is parsed anew and
+// not cached either. With Detach set, the tree is detached with Hash
+// and its AST freed before the next file is parsed. Files written by -save-tree are
+// loaded instead of parsed, that is about as fast as a cache lookup.
+static std::shared_ptr<diff::CachedTree>
+getTree(Session &S, StringRef Filename, raw_ostream &ErrOS,
+        const FileContents &Overlays, bool Detach, diff::HashKind Hash,
+        bool UseCache = true) {
+  std::shared_ptr<diff::CachedTree> Tree;
+  if (diff::SyntaxTree::isSavedTree(Filename)) {
+    std::string ErrorMessage;
+    std::unique_ptr<diff::SyntaxTree> Loaded =
+        diff::SyntaxTree::load(Filename, ErrorMessage);
+    if (!Loaded) {
+      ErrOS << "Error: " << ErrorMessage << "\n";
+      return nullptr;
+    }
+    Tree = std::make_shared<diff::CachedTree>();
+    Tree->Tree = std::move(Loaded);
+    return Tree;
+  }
+  UseCache = UseCache && Overlays.empty();
+  if (UseCache)
+    Tree = S.Trees.lookup(Filename);
+  if (!Tree) {
+    std::unique_ptr<ASTUnit> AST =
+        getAST(S.CommonCompilations, Filename, ErrOS, Overlays);
     if (!AST)
+      return nullptr;
+    Tree = UseCache ? S.Trees.insert(Filename, std::move(AST))
+                    : diff::makeCachedTree(std::move(AST), Filter);
+  }
+  if (Detach && !Tree->Tree->isDetached()) {
+    Tree->Tree->detach(Hash);
+    Tree->AST.reset();
+  }
+  return Tree;
+}
+
+// Reads the "files" member of Request, an object that maps paths to their
+// contents. Returns true on error.
+static bool getOverlays(const json::Object &Request, FileContents &Overlays,
+                        raw_ostream &ErrOS) {
+  const json::Value *Files = Request.get("files");
+  if (!Files)
+    return false;
+  const json::Object *Object = Files->getAsObject();
+  if (!Object) {
+    ErrOS << "Error: 'files' must map paths to their contents.\n";
+    return true;
+  }
+  for (const auto &File : *Object) {
+    auto Contents = File.second.getAsString();
+    if (!Contents) {
+      ErrOS << "Error: The contents of " << File.first.str()
+            << " must be a string.\n";
+      return true;
+    }
+    SmallString<256> AbsolutePath(File.first.str());
+    llvm::sys::fs::make_absolute(AbsolutePath);
+    Overlays[AbsolutePath.str()] = *Contents;
+  }
+  return false;
+}
+
+// Handles a request with the command "diff", "ast-dump", "ast-dump-json" or
+// "save-tree". Returns the exit status of the tool.
+static int runRequest(Session &S, const json::Object &Request, raw_ostream &OS,
+                      raw_ostream &ErrOS,
+                      FileContents Overlays = FileContents()) {
+  StringRef Command = Request.getString("command").getValueOr("");
+  StringRef Source = Request.getString("source").getValueOr("");
+  StringRef Destination = Request.getString("destination").getValueOr("");
+  if (Command != "diff" && Command != "ast-dump" &&
+      Command != "ast-dump-json" && Command != "save-tree") {
+    ErrOS << "Error: Unknown command '" << Command << "'.\n";
+    return 1;
+  }
+  if (Source.empty()) {
+    ErrOS << "Error: No source file given.\n";
+    return 1;
+  }
+  // Overlays starts out with the contents given by the caller.
+  if (getOverlays(Request, Overlays, ErrOS))
+    return 1;
+  // Only detached trees can be saved.
+  bool Detach = Request.getBoolean("snapshot").getValueOr(false) ||
+                Command == "save-tree";
+  diff::HashKind Hash;
+  if (getHashKind(Request, Hash, ErrOS))
+    return 1;
+
+  if (Command != "diff") {
+    if (!Destination.empty()) {
+      ErrOS << "Error: Please specify exactly one filename.\n";
+      return 1;
+    }
+    std::shared_ptr<diff::CachedTree> Tree =
+        getTree(S, Source, ErrOS, Overlays, Detach, Hash);
+    if (!Tree)
       return 1;
-    diff::SyntaxTree Tree(*AST);
-    if (ASTDump) {
-      printTree(llvm::outs(), Tree);
+    if (Command == "save-tree") {
+      StringRef Output = Request.getString("output").getValueOr("");
+      if (Output.empty()) {
+        ErrOS << "Error: No output file given.\n";
+        return 1;
+      }
+      std::string ErrorMessage;
+      if (Tree->Tree->save(Output, ErrorMessage)) {
+        ErrOS << "Error: " << ErrorMessage << "\n";
+        return 1;
+      }
       return 0;
     }
-    llvm::outs() << R"({"filename":")";
-    printJsonString(llvm::outs(), SourcePath);
-    llvm::outs() << R"(","root":)";
-    printNodeAsJson(llvm::outs(), Tree, Tree.getRoot());
-    llvm::outs() << "}\n";
+    if (Command == "ast-dump") {
+      printTree(OS, *Tree->Tree);
+      return 0;
+    }
+    OS << R"({"filename":")";
+    printJsonString(OS, Source);
+    OS << R"(","root":)";
+    printNodeAsJson(OS, *Tree->Tree, Tree->Tree->getRoot());
+    OS << "}\n";
     return 0;
   }
 
-  if (DestinationPath.empty()) {
-    llvm::errs() << "Error: Exactly two paths are required.\n";
+  if (Destination.empty()) {
+    ErrOS << "Error: Exactly two paths are required.\n";
     return 1;
   }
-
-  std::unique_ptr<ASTUnit> Src = getAST(CommonCompilations, SourcePath);
-  std::unique_ptr<ASTUnit> Dst = getAST(CommonCompilations, DestinationPath);
+  diff::ComparisonOptions Options;
+  if (getComparisonOptions(Request, Options, ErrOS))
+    return 1;
+  Options.Hash = Hash;
+  std::shared_ptr<diff::CachedTree> Src =
+      getTree(S, Source, ErrOS, Overlays, Detach, Hash);
+  // The diff tells the trees apart by their address, so diffing a file with
+  // itself needs a second tree.
+  std::shared_ptr<diff::CachedTree> Dst =
+      getTree(S, Destination, ErrOS, Overlays, Detach, Hash,
+              /*UseCache=*/Destination != Source);
   if (!Src || !Dst)
     return 1;
+  // Neither tree can be hashed again, every node would compare as changed.
+  if (Src->Tree->isDetached() && Dst->Tree->isDetached() &&
+      Src->Tree->getHashKind() != Dst->Tree->getHashKind()) {
+    ErrOS << "Error: The trees were hashed with different -node-hash settings "
+             "and cannot be hashed again.\n";
+    return 1;
+  }
+  printDiff(OS, ErrOS, *Src->Tree, *Dst->Tree, Options,
+            Request.getBoolean("html").getValueOr(false),
+            Request.getBoolean("dump_matches").getValueOr(false),
+            Request.getBoolean("memory_usage").getValueOr(false));
+  return 0;
+}
 
-  diff::ComparisonOptions Options;
-  if (MaxSize != -1)
-    Options.MaxSize = MaxSize;
-  if (!StopAfter.empty()) {
-    if (StopAfter == "topdown")
-      Options.StopAfterTopDown = true;
-    else if (StopAfter == "bottomup")
-      Options.StopAfterBottomUp = true;
-    else {
-      llvm::errs() << "Error: Invalid argument for -stop-diff-after\n";
-      return 1;
+static json::Value handleRequest(Session &S, const json::Object &Request) {
+  std::string Output, Errors;
+  llvm::raw_string_ostream OS(Output), ErrOS(Errors);
+  int Status = runRequest(S, Request, OS, ErrOS);
+  OS.flush();
+  ErrOS.flush();
+  return diff::makeResponse(Status, std::move(Output), std::move(Errors));
+}
+
+// Returns the request described by the command line. Paths are made absolute
+// if Absolute is set, for a server that runs in another directory. Files, the
+// contents read by readStdinFile(), go into the "files" member.
+static json::Object getRequest(bool Absolute,
+                               const FileContents &Files = FileContents()) {
+  auto GetPath = [&](StringRef Path) -> std::string {
+    SmallString<256> AbsolutePath(Path);
+    if (Absolute && !Path.empty())
+      llvm::sys::fs::make_absolute(AbsolutePath);
+    return AbsolutePath.str();
+  };
+  StringRef Command = !SaveTreePath.empty() ? "save-tree"
+                      : ASTDump              ? "ast-dump"
+                      : ASTDumpJson          ? "ast-dump-json"
+                                             : "diff";
+  json::Object Request{
+      {"command", Command},
+      {"source", GetPath(SourcePath)},
+      {"destination", GetPath(DestinationPath)},
+      {"output", GetPath(SaveTreePath)},
+      {"html", bool(HtmlDiff)},
+      {"dump_matches", bool(PrintMatches)},
+      {"max_size", int(MaxSize)},
+      {"stop_after", std::string(StopAfter)},
+      {"node_hash", std::string(NodeHash)},
+      {"match_renamed", bool(MatchRenamed)},
+      {"snapshot", bool(Snapshot)},
+      {"memory_usage", bool(PrintMemoryUsage)}};
+  if (!Files.empty()) {
+    json::Object Contents;
+    for (const auto &File : Files) {
+      // JSON strings are UTF-8, other encodings do not survive the request.
+      if (json::isUTF8(File.second)) {
+        Contents[File.first] = File.second;
+        continue;
+      }
+      llvm::errs() << "Warning: " << File.first
+                   << " is not valid UTF-8, the server sees a repaired copy.\n";
+      Contents[File.first] = json::fixUTF8(File.second);
     }
+    Request["files"] = std::move(Contents);
   }
-  diff::SyntaxTree SrcTree(*Src);
-  diff::SyntaxTree DstTree(*Dst);
+  return Request;
+}
 
+// With -stdin-file, reads standard input as the contents of that file. Returns
+// true on error.
+static bool readStdinFile(FileContents &Files) {
+  if (StdinPath.empty())
+    return false;
+  auto Buffer = llvm::MemoryBuffer::getSTDIN();
+  if (!Buffer) {
+    llvm::errs() << "Error: Cannot read standard input: "
+                 << Buffer.getError().message() << "\n";
+    return true;
+  }
+  SmallString<256> AbsolutePath(StdinPath);
+  llvm::sys::fs::make_absolute(AbsolutePath);
+  Files[AbsolutePath.str()] = Buffer.get()->getBuffer();
+  return false;
+}
 
-  diff::ASTDiff Diff(SrcTree, DstTree, Options);
+namespace {
+struct BatchEntry {
+  std::string Source, Destination, Output;
+  uint64_t Size;
+};
+} // end anonymous namespace
 
-  if (HtmlDiff) {
-    llvm::outs() << HtmlDiffHeader << "<pre>";
-    llvm::outs() << "<div id='L' class='code'>";
-    printHtmlForNode(llvm::outs(), Diff, true, SrcTree.getRoot(), 0);
-    llvm::outs() << "</div>";
-    llvm::outs() << "<div id='R' class='code'>";
-    printHtmlForNode(llvm::outs(), Diff, false, DstTree.getRoot(), 0);
-    llvm::outs() << "</div>";
-    llvm::outs() << "</pre></div></body></html>\n";
-    return 0;
+// Diffs every pair listed in the manifest at Path, each into its own output
+// file. Pairs are queued largest first so that a few big files do not end up
+// running alone at the end. Returns true if any pair failed.
+static bool
+runBatch(const std::unique_ptr<CompilationDatabase> &CommonCompilations,
+         StringRef Path) {
+  auto Buffer = llvm::MemoryBuffer::getFile(Path);
+  if (!Buffer) {
+    llvm::errs() << "Error: Cannot read " << Path << ": "
+                 << Buffer.getError().message() << "\n";
+    return true;
+  }
+  bool HasErrors = false;
+  std::vector<BatchEntry> Entries;
+  SmallVector<StringRef, 0> Lines;
+  Buffer.get()->getBuffer().split(Lines, '\n');
+  for (size_t I = 0, E = Lines.size(); I < E; ++I) {
+    StringRef Line = Lines[I].trim();
+    if (Line.empty() || Line.startswith("#"))
+      continue;
+    SmallVector<StringRef, 3> Fields;
+    SplitString(Line, Fields);
+    if (Fields.size() != 3) {
+      llvm::errs() << Path << ":" << I + 1
+                   << ": Error: Expected '<source> <destination> <output>'\n";
+      HasErrors = true;
+      continue;
+    }
+    BatchEntry Entry{Fields[0], Fields[1], Fields[2], 0};
+    uint64_t Size;
+    if (!llvm::sys::fs::file_size(Entry.Source, Size))
+      Entry.Size += Size;
+    if (!llvm::sys::fs::file_size(Entry.Destination, Size))
+      Entry.Size += Size;
+    Entries.push_back(std::move(Entry));
   }
 
-  Diff.dumpChanges(llvm::outs(), PrintMatches);
+  std::vector<size_t> Order(Entries.size());
+  std::iota(Order.begin(), Order.end(), 0);
+  std::stable_sort(Order.begin(), Order.end(), [&](size_t A, size_t B) {
+    return Entries[A].Size > Entries[B].Size;
+  });
 
-  return 0;
-}
\ No newline at end of file
+  // Diagnostics are buffered per pair and printed in manifest order.
+  std::vector<std::string> Errors(Entries.size());
+  std::vector<char> Failed(Entries.size(), false);
+  auto Run = [&](size_t I) {
+    const BatchEntry &Entry = Entries[I];
+    llvm::raw_string_ostream ErrOS(Errors[I]);
+    json::Object Request = getRequest(/*Absolute=*/false);
+    Request["source"] = Entry.Source;
+    Request["destination"] = Entry.Destination;
+    // Every thread has its own session, the trees are not shared.
+    Session Local(CommonCompilations, /*CacheSize=*/0);
+    std::string Output;
+    llvm::raw_string_ostream OS(Output);
+    if (runRequest(Local, Request, OS, ErrOS)) {
+      Failed[I] = true;
+      return;
+    }
+    std::error_code EC;
+    llvm::raw_fd_ostream File(Entry.Output, EC, llvm::sys::fs::F_Text);
+    if (EC) {
+      ErrOS << "Error: Cannot write " << Entry.Output << ": " << EC.message()
+            << "\n";
+      Failed[I] = true;
+      return;
+    }
+    File << OS.str();
+  };
+
+  llvm::ThreadPool Pool(Jobs ? Jobs : llvm::hardware_concurrency());
+  for (size_t I : Order)
+    Pool.async(Run, I);
+  Pool.wait();
+
+  for (size_t I = 0, E = Entries.size(); I < E; ++I) {
+    llvm::errs() << Errors[I];
+    if (Failed[I]) {
+      llvm::errs() << "Error: Could not diff " << Entries[I].Source << " and "
+                   << Entries[I].Destination << "\n";
+      HasErrors = true;
+    }
+  }
+  return HasErrors;
+}
+
+int main(int argc, const char **argv) {
+  std::string ErrorMessage;
+  std::unique_ptr<CompilationDatabase> CommonCompilations =
+      FixedCompilationDatabase::loadFromCommandLine(argc, argv, ErrorMessage);
+  if (!CommonCompilations && !ErrorMessage.empty())
+    llvm::errs() << ErrorMessage;
+  cl::HideUnrelatedOptions(ClangDiffCategory);
+  if (!cl::ParseCommandLineOptions(argc, argv)) {
+    cl::PrintOptionValues();
+    return 1;
+  }
+
+  addExtraArgs(CommonCompilations);
+  if (setTreeFilter())
+    return 1;
+
+  if (!ServePath.empty()) {
+    Session Server(CommonCompilations, ServeCacheSize);
+    return diff::serve(ServePath,
+                       [&](const json::Object &Request) {
+                         return handleRequest(Server, Request);
+                       })
+               ? 1
+               : 0;
+  }
+
+  if (!BatchPath.empty()) {
+    if (!SourcePath.empty() || !StdinPath.empty() || !SaveTreePath.empty() ||
+        ASTDump || ASTDumpJson) {
+      llvm::errs() << "Error: -batch takes its paths from the manifest.\n";
+      return 1;
+    }
+    return runBatch(CommonCompilations, BatchPath) ? 1 : 0;
+  }
+
+  // Local runs parse the bytes of standard input as they are, only requests
+  // to a server have to be valid UTF-8.
+  FileContents Stdin;
+  if (readStdinFile(Stdin))
+    return 1;
+
+  if (!ConnectPath.empty()) {
+    llvm::Expected<json::Value> Response =
+        diff::sendRequest(ConnectPath, getRequest(/*Absolute=*/true, Stdin));
+    if (!Response) {
+      llvm::errs() << "Error: " << llvm::toString(Response.takeError())
+                   << "\n";
+      return 1;
+    }
+    return diff::printResponse(*Response);
+  }
+
+  Session Local(CommonCompilations, /*CacheSize=*/0);
+  return runRequest(Local, getRequest(/*Absolute=*/false), llvm::outs(),
+                    llvm::errs(), std::move(Stdin));
+}
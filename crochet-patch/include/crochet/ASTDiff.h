@@ -23,6 +23,8 @@
 
 #include "clang/Frontend/ASTUnit.h"
 #include "crochet/ASTDiffInternal.h"
+#include "crochet/StringTable.h"
+#include "llvm/Support/GlobPattern.h"
 
 namespace clang {
 namespace diff {
@@ -38,6 +40,14 @@ enum ChangeKind {
 
 using NodeRef = const Node &;
 
+/// The hash functions that nodes and subtrees can be compared by.
+enum class HashKind {
+  /// 64-bit xxHash, much faster than MD5.
+  XXHash,
+  /// MD5, for reproducing the results of earlier versions.
+  MD5
+};
+
 struct ComparisonOptions {
   /// During top-down matching, only consider nodes of at least this height.
   int MinHeight = 2;
@@ -53,6 +63,17 @@ struct ComparisonOptions {
   bool StopAfterTopDown = false;
   bool StopAfterBottomUp = false;
 
+  /// Subtrees with equal hashes are taken to be identical. If set, they are
+  /// also compared node by node, which rules out hash collisions.
+  bool VerifySubtreeHashes = false;
+
+  /// After the top-down phase, also match subtrees that are identical but for
+  /// the names in them, as long as the names map one to one. Subtrees with
+  /// renamed locals are then matched before the slower bottom-up phase.
+  bool MatchRenamedSubtrees = false;
+
+  HashKind Hash = HashKind::XXHash;
+
   /// Returns false if the nodes should never be matched.
   bool isMatchingAllowed(NodeRef N1, NodeRef N2) const;
 };
@@ -65,6 +86,10 @@ public:
   const Node *getMapped(NodeRef N) const;
   ChangeKind getNodeChange(NodeRef N) const;
 
+  /// Returns the number of bytes taken by the mapping and the changes, the
+  /// trees are not counted.
+  size_t getMemoryUsage() const;
+
   void dumpChanges(raw_ostream &OS, bool DumpMatches = false) const;
 
   class Impl;
@@ -73,12 +98,32 @@ private:
   std::unique_ptr<Impl> DiffImpl;
 };
 
+/// Restricts the declarations that the tree of a translation unit is built
+/// from. Declarations in system headers are always left out.
+struct TreeFilter {
+  /// Keep the declarations in the main file.
+  bool MainFileOnly = false;
+  /// Keep the declarations in files whose path, as it was given to the
+  /// preprocessor, matches one of these.
+  std::vector<llvm::GlobPattern> FileGlobs;
+  /// If not empty, keep only the top-level declarations with one of these
+  /// names, plain or qualified. The contents of extern "C" blocks count as
+  /// top-level.
+  std::vector<std::string> DeclNames;
+
+  llvm::Error addFileGlob(StringRef Pattern);
+
+  /// Returns true if D and everything in it are left out. If neither
+  /// MainFileOnly nor FileGlobs are set, declarations in any file are kept.
+  bool excludes(const Decl *D, const SourceManager &SM) const;
+};
+
 /// SyntaxTree objects represent subtrees of the AST.
 /// They can be constructed from any Decl or Stmt.
 class SyntaxTree {
 public:
   /// Constructs a tree from a translation unit.
-   SyntaxTree(ASTUnit &AST);
+   SyntaxTree(ASTUnit &AST, const TreeFilter &Filter = TreeFilter());
   /// Constructs a tree from any AST node.
   template <class T>
   SyntaxTree(T *Node, ASTUnit &AST)
@@ -92,8 +137,18 @@ public:
   SourceManager &getSourceManager() const;
   const LangOptions &getLangOpts() const;
   StringRef getFilename() const;
+  /// Returns the presumed line and column of Loc, like
+  /// SourceManager::getPresumedLoc(), or {0, 0} if Loc is invalid. Lines are
+  /// looked up in an index that is built once for each file.
+  std::pair<unsigned, unsigned> getLineAndColumn(SourceLocation Loc) const;
+  /// Returns the start of the first token at or after Loc, comments included,
+  /// or the end of the file if there is none. Every file is lexed only once.
+  SourceLocation getNextTokenLocation(SourceLocation Loc) const;
 
   int getSize() const;
+  /// Returns the number of bytes taken by the nodes and what is stored about
+  /// them. The AST and the StringTable, which trees share, are not counted.
+  size_t getMemoryUsage() const;
   NodeRef getRoot() const;
   NodeId getRootId() const;
   using PreorderIterator = const Node *;
@@ -110,15 +165,42 @@ public:
   std::unique_ptr<Impl> TreeImpl;
 };
 
+/// The kinds of nodes that the tools handle specially. Nodes that start in a
+/// macro expansion are Macro, all other nodes that are not listed here are
+/// Other. The exact kind of every node is available from Node::getType().
+enum class NodeKind : uint8_t {
+  Other,
+  Macro,
+  ArraySubscriptExpr,
+  BinaryOperator,
+  CallExpr,
+  CaseStmt,
+  CompoundStmt,
+  CStyleCastExpr,
+  DeclRefExpr,
+  DeclStmt,
+  EnumConstantDecl,
+  EnumDecl,
+  FieldDecl,
+  FileScopeAsmDecl,
+  FunctionDecl,
+  IfStmt,
+  InitListExpr,
+  IntegerLiteral,
+  MemberExpr,
+  ParmVarDecl,
+  RecordDecl,
+  TypedefDecl,
+  VarDecl
+};
 
 /// Represents a Clang AST node, alongside some additional information.
+///
+/// A Node is only a handle, the attributes of all nodes are stored in arrays
+/// in the tree that are indexed by NodeId.
 struct Node {
   SyntaxTree::Impl &Tree;
-  NodeId Parent, LeftMostDescendant, RightMostDescendant;
-  int Depth, Height;
-  ast_type_traits::DynTypedNode ASTNode;
-  SmallVector<NodeId, 4> Children;
-  Node(SyntaxTree::Impl &Tree) : Tree(Tree), Children() {}
+  Node(SyntaxTree::Impl &Tree) : Tree(Tree) {}
   Node(NodeRef Other) = delete;
   explicit Node(Node &&Other) = default;
   Node &operator=(NodeRef Other) = delete;
@@ -127,11 +209,21 @@ struct Node {
   NodeId getId() const;
   SyntaxTree &getTree() const;
   const Node *getParent() const;
+  NodeId getParentId() const;
+  NodeId getLeftMostDescendant() const;
+  NodeId getRightMostDescendant() const;
+  int getDepth() const;
+  int getHeight() const;
+  const ast_type_traits::DynTypedNode &getASTNode() const;
+  ArrayRef<NodeId> getChildIds() const;
   NodeRef getChild(size_t Index) const;
-  size_t getNumChildren() const { return Children.size(); }
+  size_t getNumChildren() const;
   ast_type_traits::ASTNodeKind getType() const;
+  /// Cheaper to test than getTypeLabel(), the label of a node of any listed
+  /// kind is the name of that kind.
+  NodeKind getKind() const;
   StringRef getTypeLabel() const;
-  bool isLeaf() const { return Children.empty(); }
+  bool isLeaf() const;
   bool isMacro() const;
   llvm::Optional<StringRef> getIdentifier() const;
   llvm::Optional<std::string> getQualifiedIdentifier() const;
@@ -139,7 +231,11 @@ struct Node {
   NodeRefIterator begin() const;
   NodeRefIterator end() const;
 
-  const DeclContext *getEnclosingDeclContext(ASTContext &AST, const Stmt *S) const;
+  /// Returns the context of the declaration that this node's chain of parent
+  /// statements ends at, or null if the chain ends elsewhere, such as at a
+  /// constructor initializer or a type location. The parents are looked up in
+  /// the tree, so that the parent map of the ASTContext is never built.
+  const DeclContext *getEnclosingDeclContext() const;
 
   std::string getRelativeName(const NamedDecl *ND, const DeclContext *Context) const;
   std::string getRelativeName(const NamedDecl *ND) const;
@@ -152,6 +248,14 @@ struct Node {
   std::string getValue() const;
   std::string getFileName() const;
 
+  /// The label, value and identifiers from above as ids in the StringTable.
+  /// They are interned on first use, after that they are cheap to compare.
+  /// Nodes without an identifier get StringTable::NoString.
+  StringId getLabelId() const;
+  StringId getValueId() const;
+  StringId getIdentifierId() const;
+  StringId getQualifiedIdentifierId() const;
+
   void dump(raw_ostream &OS) const {
     OS << getTypeLabel() << "(" << getId() << ")";
   }
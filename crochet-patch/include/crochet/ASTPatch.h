@@ -41,10 +41,17 @@ private:
   patching_error Err;
 };
 
+/// Builds the target tree with TargetTool and applies the script to it.
 llvm::Error patch(tooling::RefactoringTool &TargetTool, std::string MapFilePath, SyntaxTree &Src,
                   SyntaxTree &Dst, std::string ScriptFilePath, const ComparisonOptions &Options,
                   bool Debug = false);
 
+/// Applies the script to an already built target tree and prints the patched
+/// target to OS. TargetTool is only used to collect replacements.
+llvm::Error patch(tooling::RefactoringTool &TargetTool, std::string MapFilePath, SyntaxTree &Src,
+                  SyntaxTree &Dst, SyntaxTree &Target, std::string ScriptFilePath,
+                  const ComparisonOptions &Options, raw_ostream &OS, bool Debug = false);
+
 } // end namespace diff
 } // end namespace clang
 
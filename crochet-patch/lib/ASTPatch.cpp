@@ -157,10 +157,10 @@ namespace clang {
                     int count = 0;
                     for (diff::NodeRef node : Dst) {
 
-                        if (node.getTypeLabel() == "VarDecl" || node.getTypeLabel() == "ParmVarDecl" ||
-                            node.getTypeLabel() == "FieldDecl") {
+                        if (node.getKind() == NodeKind::VarDecl || node.getKind() == NodeKind::ParmVarDecl ||
+                            node.getKind() == NodeKind::FieldDecl) {
 
-                            if (auto vardec = node.ASTNode.get<VarDecl>()) {
+                            if (auto vardec = node.getASTNode().get<VarDecl>()) {
                                 count++;
                                 SourceLocation loc = vardec->getLocation();
                                 std::string locId = loc.printToString(Dst.getSourceManager());
@@ -168,7 +168,7 @@ namespace clang {
                                 // llvm::outs() << nodeid << "\n";
                                 LocNodeMap[locId] = nodeid;
 
-                            } else if (auto pardec = node.ASTNode.get<ParmVarDecl>()) {
+                            } else if (auto pardec = node.getASTNode().get<ParmVarDecl>()) {
                                 count++;
                                 SourceLocation loc = pardec->getLocation();
                                 std::string locId = loc.printToString(Dst.getSourceManager());
@@ -176,7 +176,7 @@ namespace clang {
                                 // llvm::outs() << nodeid << "\n";
                                 LocNodeMap[locId] = nodeid;
 
-                            } else if (auto fielddec = node.ASTNode.get<FieldDecl>()) {
+                            } else if (auto fielddec = node.getASTNode().get<FieldDecl>()) {
                                 count++;
                                 SourceLocation loc = fielddec->getLocation();
                                 std::string locId = loc.printToString(Dst.getSourceManager());
@@ -391,7 +391,7 @@ namespace clang {
                     // If the whole subtree is inserted, we can skip the children, as we
                     // will just copy the text of the entire subtree.
                     if (AtomicInsertions[DstId])
-                        DstId = DstNode.RightMostDescendant;
+                        DstId = DstNode.getRightMostDescendant();
                 }
             }
             // Add existing children.
@@ -407,7 +407,7 @@ namespace clang {
             ChangeKind Change = NoChange;
             for (NodeId DstId = Dst.getRootId(), E = Dst.getSize(); DstId < E;
                  DstId = Change == Insert && AtomicInsertions[DstId]
-                         ? Dst.getNode(DstId).RightMostDescendant + 1
+                         ? Dst.getNode(DstId).getRightMostDescendant() + 1
                          : DstId + 1) {
                 NodeRef DstNode = Dst.getNode(DstId);
                 Change = Diff.getNodeChange(DstNode);
@@ -506,7 +506,7 @@ namespace clang {
                         isRemovedOrMoved(PatchedNode) ? "" : buildSourceText(PatchedNode);
                 if (auto Err = addReplacement({SM, Range, Text, LangOpts}))
                     return Err;
-                TargetId = TargetNode.RightMostDescendant;
+                TargetId = TargetNode.getRightMostDescendant();
             }
             return Error::success();
         }
@@ -552,15 +552,13 @@ namespace clang {
         }
 
         static StringRef trailingText(SourceLocation Loc, SyntaxTree &Tree) {
-            Token NextToken;
-            bool Failure = Lexer::getRawToken(Loc, NextToken, Tree.getSourceManager(),
-                                              Tree.getLangOpts(),
-                    /*IgnoreWhiteSpace=*/true);
-            if (Failure)
+            // The token table of the file is shared with the rest of the tree,
+            // nothing is lexed again here.
+            SourceLocation NextTokenLoc = Tree.getNextTokenLocation(Loc);
+            if (NextTokenLoc.isInvalid())
                 return StringRef();
-            assert(!Failure);
             return Lexer::getSourceText(
-                    CharSourceRange::getCharRange({Loc, NextToken.getLocation()}),
+                    CharSourceRange::getCharRange({Loc, NextTokenLoc}),
                     Tree.getSourceManager(), Tree.getLangOpts());
         }
 
@@ -688,10 +686,10 @@ namespace clang {
             // llvm::errs() << "child count " << childNodesInUpdateRange << "\n";
 
 
-            if (node.getTypeLabel() == "MemberExpr") {
+            if (node.getKind() == NodeKind::MemberExpr) {
 
                 // llvm::outs() << "translating member name \n";
-                auto memNode = node.ASTNode.get<MemberExpr>();
+                auto memNode = node.getASTNode().get<MemberExpr>();
                 auto decNode = memNode->getMemberDecl();
                 SourceLocation loc = decNode->getLocation();
                 std::string locId = loc.printToString(Dst.getSourceManager());
@@ -783,10 +781,10 @@ namespace clang {
 //                return statement;
 
 
-            } else if (node.getTypeLabel() == "FieldDecl") {
+            } else if (node.getKind() == NodeKind::FieldDecl) {
 
                 // llvm::outs() << "translating member definition \n";
-                auto decNode = node.ASTNode.get<FieldDecl>();
+                auto decNode = node.getASTNode().get<FieldDecl>();
                 SourceLocation loc = decNode->getLocation();
                 std::string locId = loc.printToString(Dst.getSourceManager());
                 // llvm::errs() << locId << "\n";
@@ -844,11 +842,11 @@ namespace clang {
                 NodeRef childNode = node.getChild(childIndex);
                 // llvm::outs() << "child " << childIndex << " type " << childNode.getTypeLabel() << "\n";
 
-                if (childNode.getTypeLabel() == "DeclRefExpr") {
+                if (childNode.getKind() == NodeKind::DeclRefExpr) {
 
                     // llvm::outs() << "translating reference \n";
 
-                    auto decRefNode = childNode.ASTNode.get<DeclRefExpr>();
+                    auto decRefNode = childNode.getASTNode().get<DeclRefExpr>();
                     auto decNode = decRefNode->getDecl();
                     SourceLocation loc = decNode->getLocation();
                     std::string locId = loc.printToString(Dst.getSourceManager());
@@ -950,20 +948,20 @@ namespace clang {
                 range.setBegin(startLoc);
             }
 
-            if (deleteNode.getTypeLabel() == "BinaryOperator" && !isMove) {
-                auto binOpNode = deleteNode.ASTNode.get<BinaryOperator>();
+            if (deleteNode.getKind() == NodeKind::BinaryOperator && !isMove) {
+                auto binOpNode = deleteNode.getASTNode().get<BinaryOperator>();
                 range.setBegin(binOpNode->getOperatorLoc());
                 std::string binOp = binOpNode->getOpcodeStr();
                 Rewrite.RemoveText(binOpNode->getOperatorLoc(), binOp.length());
 
-            } else if (deleteNode.getTypeLabel() == "DeclStmt" || deleteNode.getTypeLabel() == "Macro") {
+            } else if (deleteNode.getKind() == NodeKind::DeclStmt || deleteNode.getKind() == NodeKind::Macro) {
                 range = expandRange(range, Target);
                 Rewriter::RewriteOptions delRangeOpts;
                 delRangeOpts.RemoveLineIfEmpty = true;
                 Rewrite.RemoveText(range, delRangeOpts);
 
-            } else if (deleteNode.getTypeLabel() == "MemberExpr") {
-                auto memExpNode = deleteNode.ASTNode.get<MemberExpr>();
+            } else if (deleteNode.getKind() == NodeKind::MemberExpr) {
+                auto memExpNode = deleteNode.getASTNode().get<MemberExpr>();
                 Rewriter::RewriteOptions delRangeOpts;
                 delRangeOpts.RemoveLineIfEmpty = true;
                 range = deleteNode.findRangeForDeletion();
@@ -1015,7 +1013,7 @@ namespace clang {
             insertStatement = translateVariables(insertNode, insertStatement);
             // llvm::outs() << insertStatement << "\n";
 
-            if (insertNode.getTypeLabel() == "FunctionDecl") {
+            if (insertNode.getKind() == NodeKind::FunctionDecl) {
 
                 insertStatement = insertStatement + " \n";
             }
@@ -1024,277 +1022,274 @@ namespace clang {
             if (!insertStatement.empty()) {
 
                 int NumChildren = targetNode.getNumChildren();
-                if (targetNode.getTypeLabel() == "CompoundStmt") {
+                switch (targetNode.getKind()) {
+                    case NodeKind::CompoundStmt:
+                        insertStatement = "\n" + insertStatement + "\n";
 
-                    insertStatement = "\n" + insertStatement + "\n";
+                        if (Offset == 0) {
+                            if (NumChildren > 0) {
+                                Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
+                                modified = true;
 
-                    if (Offset == 0) {
-                        if (NumChildren > 0) {
-                            Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
-                            modified = true;
+                            } else {
+                                Rewrite.InsertTextAfter(insertLoc, insertStatement);
+                                modified = true;
+                            }
 
                         } else {
-                            Rewrite.InsertTextAfter(insertLoc, insertStatement);
+
+                            NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
+                            insertLoc = nearestChildNode.getSourceRange().getEnd();
+
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
                             modified = true;
-                        }
 
-                    } else {
 
-                        NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
-                        insertLoc = nearestChildNode.getSourceRange().getEnd();
+                        }
+                        break;
+                    case NodeKind::IfStmt:
+                        if (Offset == 0) {
+                            auto ifNode = targetNode.getASTNode().get<IfStmt>();
+                            auto condNode = ifNode->getCond();
+                            insertLoc = condNode->getExprLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                            modified = true;
 
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
-                        modified = true;
+                        } else {
 
+                            NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
+                            insertLoc = nearestChildNode.getSourceRange().getEnd();
 
-                    }
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                            modified = true;
 
-                } else if (targetNode.getTypeLabel() == "IfStmt") {
 
-                    if (Offset == 0) {
-                        auto ifNode = targetNode.ASTNode.get<IfStmt>();
-                        auto condNode = ifNode->getCond();
-                        insertLoc = condNode->getExprLoc();
+                        }
+                        break;
+                    case NodeKind::BinaryOperator: {
+                        // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
+                        auto binaryNode = targetNode.getASTNode().get<BinaryOperator>();
+                        insertLoc = binaryNode->getOperatorLoc();
                         //std::string locId = insertLoc.printToString(Target.getSourceManager());
                         // llvm::outs() << locId << "\n";
 
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
-                        modified = true;
+                        if (Offset == 0) {
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                    } else {
 
-                        NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
-                        insertLoc = nearestChildNode.getSourceRange().getEnd();
+                        } else {
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                        }
 
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
                         modified = true;
-
-
-                    }
-
-                } else if (targetNode.getTypeLabel() == "BinaryOperator") {
-
-                    // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
-                    auto binaryNode = targetNode.ASTNode.get<BinaryOperator>();
-                    insertLoc = binaryNode->getOperatorLoc();
-                    //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                    // llvm::outs() << locId << "\n";
-
-                    if (Offset == 0) {
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
-
-
-                    } else {
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        break;
                     }
+                    case NodeKind::CallExpr: {
+                        // llvm::outs() << insertStatement << "\n";
+                        // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
+                        auto callerNode = targetNode.getASTNode().get<CallExpr>();
+                        int numArgs = callerNode->getNumArgs();
 
-                    modified = true;
+                        if (numArgs == 0 or Offset == 1) {
+                            if (insertStatement.find(',') == std::string::npos)
+                                insertStatement = insertStatement + ", ";
 
-                } else if (targetNode.getTypeLabel() == "CallExpr") {
-
-
-                    // llvm::outs() << insertStatement << "\n";
-                    // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
-                    auto callerNode = targetNode.ASTNode.get<CallExpr>();
-                    int numArgs = callerNode->getNumArgs();
-
-                    if (numArgs == 0 or Offset == 1) {
-                        if (insertStatement.find(',') == std::string::npos)
-                            insertStatement = insertStatement + ", ";
+                        } else {
+                            if (insertStatement.find(',') == std::string::npos)
+                                insertStatement = ", " + insertStatement;
+                        }
 
-                    } else {
-                        if (insertStatement.find(',') == std::string::npos)
-                            insertStatement = ", " + insertStatement;
-                    }
+                        // llvm::outs() << insertStatement << "\n";
 
-                    // llvm::outs() << insertStatement << "\n";
+                        if (Offset == 1) {
+                            insertLoc = callerNode->getArg(Offset - 1)->getExprLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                    if (Offset == 1) {
-                        insertLoc = callerNode->getArg(Offset - 1)->getExprLoc();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        } else if (Offset >= numArgs) {
+                            insertLoc = callerNode->getRParenLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
 
-                    } else if (Offset >= numArgs) {
-                        insertLoc = callerNode->getRParenLoc();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        } else {
+                            insertLoc = callerNode->getArg(Offset)->getExprLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
 
-                    } else {
-                        insertLoc = callerNode->getArg(Offset)->getExprLoc();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                        }
 
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        modified = true;
+                        break;
                     }
+                    case NodeKind::EnumDecl: {
+                        int numChildren = targetNode.getNumChildren();
+                        extractRange = insertNode.getSourceRange();
+                        insertStatement = Lexer::getSourceText(extractRange, SourceTree.getSourceManager(),
+                                                               SourceTree.getLangOpts());
 
-                    modified = true;
-
-                } else if (targetNode.getTypeLabel() == "EnumDecl") {
-
-                    int numChildren = targetNode.getNumChildren();
-                    extractRange = insertNode.getSourceRange();
-                    insertStatement = Lexer::getSourceText(extractRange, SourceTree.getSourceManager(),
-                                                           SourceTree.getLangOpts());
+                        // llvm::outs() << insertStatement << "\n";
+                        // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
+                        // auto EnumDeclNode = targetNode.ASTNode.get<EnumDecl>();
 
-                    // llvm::outs() << insertStatement << "\n";
-                    // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
-                    // auto EnumDeclNode = targetNode.ASTNode.get<EnumDecl>();
 
 
+                        if (Offset < numChildren) {
+                            NodeRef neighbor = targetNode.getChild(Offset);
+                            CharSourceRange neighborRange = neighbor.getSourceRange();
+                            insertLoc = neighborRange.getBegin();
+                            insertStatement = insertStatement + ", ";
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                    if (Offset < numChildren) {
-                        NodeRef neighbor = targetNode.getChild(Offset);
-                        CharSourceRange neighborRange = neighbor.getSourceRange();
-                        insertLoc = neighborRange.getBegin();
-                        insertStatement = insertStatement + ", ";
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        } else {
+                            NodeRef neighbor = targetNode.getChild(numChildren - 1);
+                            CharSourceRange neighborRange = neighbor.getSourceRange();
+                            insertLoc = neighborRange.getEnd();
+                            insertStatement = ", " + insertStatement;
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertText(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                        }
 
-                    } else {
-                        NodeRef neighbor = targetNode.getChild(numChildren - 1);
-                        CharSourceRange neighborRange = neighbor.getSourceRange();
-                        insertLoc = neighborRange.getEnd();
-                        insertStatement = ", " + insertStatement;
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
-                        if (Rewrite.InsertText(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        modified = true;
+                        break;
                     }
+                    case NodeKind::RecordDecl: {
+                        int numChildren = targetNode.getNumChildren();
+                        extractRange = insertNode.getSourceRange();
+                        insertStatement = Lexer::getSourceText(extractRange, SourceTree.getSourceManager(),
+                                                               SourceTree.getLangOpts());
+
+                        if (Offset < numChildren) {
+                            insertStatement = insertStatement + " \n";
+                            NodeRef neighbor = targetNode.getChild(Offset);
+                            CharSourceRange neighborRange = neighbor.getSourceRange();
+                            insertLoc = neighborRange.getBegin();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                    modified = true;
-
-                } else if (targetNode.getTypeLabel() == "RecordDecl") {
-
-                    int numChildren = targetNode.getNumChildren();
-                    extractRange = insertNode.getSourceRange();
-                    insertStatement = Lexer::getSourceText(extractRange, SourceTree.getSourceManager(),
-                                                           SourceTree.getLangOpts());
-
-                    if (Offset < numChildren) {
-                        insertStatement = insertStatement + " \n";
-                        NodeRef neighbor = targetNode.getChild(Offset);
-                        CharSourceRange neighborRange = neighbor.getSourceRange();
-                        insertLoc = neighborRange.getBegin();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        } else {
+                            insertStatement = "\n" + insertStatement;
+                            NodeRef neighbor = targetNode.getChild(numChildren - 1);
+                            CharSourceRange neighborRange = neighbor.getSourceRange();
+                            insertLoc = neighborRange.getEnd();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertTextAfter(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                        }
 
-                    } else {
-                        insertStatement = "\n" + insertStatement;
-                        NodeRef neighbor = targetNode.getChild(numChildren - 1);
-                        CharSourceRange neighborRange = neighbor.getSourceRange();
-                        insertLoc = neighborRange.getEnd();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
-                        if (Rewrite.InsertTextAfter(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        modified = true;
+                        break;
                     }
+                    case NodeKind::InitListExpr: {
+                        int numChildren = targetNode.getNumChildren();
+                        extractRange = insertNode.getSourceRange();
+                        insertStatement = Lexer::getSourceText(extractRange, SourceTree.getSourceManager(),
+                                                               SourceTree.getLangOpts());
+
+                        // llvm::outs() << insertStatement << "\n";
+                        // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
+                        // auto EnumDeclNode = targetNode.ASTNode.get<EnumDecl>();
+
+
+
+                        if (Offset < numChildren) {
+                            NodeRef neighbor = targetNode.getChild(Offset);
+                            CharSourceRange neighborRange = neighbor.getSourceRange();
+                            insertLoc = neighborRange.getBegin();
+                            insertStatement = insertStatement + ",\n";
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                    modified = true;
-
-                } else if (targetNode.getTypeLabel() == "InitListExpr") {
-
-                    int numChildren = targetNode.getNumChildren();
-                    extractRange = insertNode.getSourceRange();
-                    insertStatement = Lexer::getSourceText(extractRange, SourceTree.getSourceManager(),
-                                                           SourceTree.getLangOpts());
-
-                    // llvm::outs() << insertStatement << "\n";
-                    // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
-                    // auto EnumDeclNode = targetNode.ASTNode.get<EnumDecl>();
-
-
-
-                    if (Offset < numChildren) {
-                        NodeRef neighbor = targetNode.getChild(Offset);
-                        CharSourceRange neighborRange = neighbor.getSourceRange();
-                        insertLoc = neighborRange.getBegin();
-                        insertStatement = insertStatement + ",\n";
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        } else {
+                            NodeRef neighbor = targetNode.getChild(numChildren - 1);
+                            CharSourceRange neighborRange = neighbor.getSourceRange();
+                            insertLoc = neighborRange.getEnd();
+                            insertStatement = ", " + insertStatement;
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertText(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                        }
 
-                    } else {
-                        NodeRef neighbor = targetNode.getChild(numChildren - 1);
-                        CharSourceRange neighborRange = neighbor.getSourceRange();
-                        insertLoc = neighborRange.getEnd();
-                        insertStatement = ", " + insertStatement;
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
-                        if (Rewrite.InsertText(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        modified = true;
+                        break;
                     }
+                    default:
+                        if (Offset == 0) {
+                            if (NumChildren > 0) {
+                                // NodeRef firstChild = targetNode.getChild(Offset);
+                                // startLoc = firstChild.getSourceRange().getBegin();
+                                // crochetPatcher.Rewrite.InsertTextBefore(startLoc, insertStatement);
 
-                    modified = true;
+                                Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
+                                modified = true;
 
-                } else {
-
-                    if (Offset == 0) {
-                        if (NumChildren > 0) {
-                            // NodeRef firstChild = targetNode.getChild(Offset);
-                            // startLoc = firstChild.getSourceRange().getBegin();
-                            // crochetPatcher.Rewrite.InsertTextBefore(startLoc, insertStatement);
 
-                            Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
-                            modified = true;
+                            } else {
 
+                                Rewrite.InsertTextAfter(insertLoc, insertStatement);
+                                modified = true;
+                                // Rewrite.InsertTextAfter(r.getBegin(), insert_value);
+                                // PresumedLoc InsertLoc = SM.getPresumedLoc(r.getBegin());
+                                // llvm::outs() << "InsertLoc: " << InsertLoc.getLine() << ":" << InsertLoc.getColumn() << "\n";
+                            }
 
                         } else {
 
-                            Rewrite.InsertTextAfter(insertLoc, insertStatement);
-                            modified = true;
-                            // Rewrite.InsertTextAfter(r.getBegin(), insert_value);
-                            // PresumedLoc InsertLoc = SM.getPresumedLoc(r.getBegin());
-                            // llvm::outs() << "InsertLoc: " << InsertLoc.getLine() << ":" << InsertLoc.getColumn() << "\n";
-                        }
+                            // llvm::outs() << Offset << "\n";
+                            // llvm::outs() << NumChildren << "\n";
+
+                            if (Offset <= NumChildren - 1) {
+                                // llvm::outs() <<"if leg\n";
+                                NodeRef nearestChildNode = targetNode.getChild(Offset);
+                                // llvm::outs() <<"got child\n";
+                                insertLoc = nearestChildNode.getSourceRange().getBegin();
+                                // llvm::outs() <<"got loc\n";
+                                // if (insertLoc.isValid())
+                                //  llvm::outs() <<"valid\n";
+                                if (Rewrite.InsertText(insertLoc, insertStatement))
+                                    llvm::errs() << "error inserting\n";
+                                // llvm::outs() <<"inserted\n";
+                                modified = true;
 
-                    } else {
+                            } else {
+                                // llvm::outs() <<"else leg\n";
+                                NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
+                                // llvm::outs() <<"got child\n";
+                                insertLoc = nearestChildNode.getSourceRange().getEnd();
+                                // llvm::outs() <<"got loc\n";
+                                Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
+                                // llvm::outs() <<"inserted\n";
+                                modified = true;
+                            }
 
-                        // llvm::outs() << Offset << "\n";
-                        // llvm::outs() << NumChildren << "\n";
-
-                        if (Offset <= NumChildren - 1) {
-                            // llvm::outs() <<"if leg\n";
-                            NodeRef nearestChildNode = targetNode.getChild(Offset);
-                            // llvm::outs() <<"got child\n";
-                            insertLoc = nearestChildNode.getSourceRange().getBegin();
-                            // llvm::outs() <<"got loc\n";
-                            // if (insertLoc.isValid())
-                            //  llvm::outs() <<"valid\n";
-                            if (Rewrite.InsertText(insertLoc, insertStatement))
-                                llvm::errs() << "error inserting\n";
-                            // llvm::outs() <<"inserted\n";
-                            modified = true;
 
-                        } else {
-                            // llvm::outs() <<"else leg\n";
-                            NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
-                            // llvm::outs() <<"got child\n";
-                            insertLoc = nearestChildNode.getSourceRange().getEnd();
-                            // llvm::outs() <<"got loc\n";
-                            Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
-                            // llvm::outs() <<"inserted\n";
-                            modified = true;
                         }
-
-
-                    }
-
+                        break;
                 }
 
 
@@ -1361,10 +1356,10 @@ bool Patcher::updateCode(NodeRef updateNode, NodeRef targetNode, SyntaxTree &Sou
     // llvm::outs() << "nodes matched\n";
     CharSourceRange range;
 
-    if (targetNode.getTypeLabel() == "BinaryOperator") {
+    if (targetNode.getKind() == NodeKind::BinaryOperator) {
 
-        SourceRange r = targetNode.ASTNode.getSourceRange();
-        auto binOpNode = targetNode.ASTNode.get<BinaryOperator>();
+        SourceRange r = targetNode.getASTNode().getSourceRange();
+        auto binOpNode = targetNode.getASTNode().get<BinaryOperator>();
         range.setBegin(binOpNode->getOperatorLoc());
 //        std::string binOp = binOpNode->getOpcodeStr();
 //        Rewrite.RemoveText(binOpNode->getOperatorLoc(), binOp.length());
@@ -1393,12 +1388,12 @@ bool Patcher::updateCode(NodeRef updateNode, NodeRef targetNode, SyntaxTree &Sou
     std::string oldValue = targetNode.getValue();
 
 
-    if (targetNode.getTypeLabel() == "MemberExpr") {
+    if (targetNode.getKind() == NodeKind::MemberExpr) {
 
         updateValue = updateValue.substr(1);
         oldValue = oldValue.substr(1);
 
-    } else if (targetNode.getTypeLabel() == "IntegerLiteral") {
+    } else if (targetNode.getKind() == NodeKind::IntegerLiteral) {
 
         updateValue = Lexer::getSourceText(updateNode.getSourceRange(), SourceTree.getSourceManager(),
                                            SourceTree.getLangOpts());
@@ -1432,7 +1427,7 @@ bool Patcher::updateCode(NodeRef updateNode, NodeRef targetNode, SyntaxTree &Sou
         replaceSubString(statement, oldValue, updateValue);
         // llvm::outs() << statement << "\n";
 
-        if (targetNode.getTypeLabel() == "BinaryOperator") {
+        if (targetNode.getKind() == NodeKind::BinaryOperator) {
             modified = Rewrite.ReplaceText(range.getBegin(), statement);
             return true;
         }
@@ -1482,6 +1477,12 @@ Error patch(RefactoringTool &TargetTool,std::string MapFilePath, SyntaxTree &Src
         return error(patching_error::failed_to_build_AST);
     SyntaxTree Target(*TargetASTs[0]);
 
+    return patch(TargetTool, MapFilePath, Src, Dst, Target, ScriptFilePath, Options, llvm::outs(), Debug);
+}
+
+Error patch(RefactoringTool &TargetTool,std::string MapFilePath, SyntaxTree &Src, SyntaxTree &Dst, SyntaxTree &Target,
+            std::string ScriptFilePath, const ComparisonOptions &Options, raw_ostream &OS, bool Debug) {
+
     Patcher crochetPatcher(Src, Dst, Target, Options, TargetTool, Debug);
     crochetPatcher.loadVariableMapping(MapFilePath);
 
@@ -1733,7 +1734,7 @@ Error patch(RefactoringTool &TargetTool,std::string MapFilePath, SyntaxTree &Src
             Target.getSourceManager().getMainFileID());
     // llvm::outs()  << "/* Start Crochet Output */\n";
     if (modified)
-        llvm::outs() << std::string(RewriteBuf->begin(), RewriteBuf->end());
+        OS << std::string(RewriteBuf->begin(), RewriteBuf->end());
     // llvm::outs()  << "/* End Crochet Output */\n";
 
     // return Patcher(Src, Dst, Target, Options, TargetTool, Debug).apply();
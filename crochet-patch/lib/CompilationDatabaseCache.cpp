@@ -0,0 +1,102 @@
+//===- CompilationDatabaseCache.cpp - Reusing loaded databases -*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "crochet/CompilationDatabaseCache.h"
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+using namespace llvm;
+using namespace clang;
+using namespace tooling;
+
+namespace clang {
+namespace diff {
+
+namespace {
+// Hands out a database that is owned by the cache.
+class SharedCompilationDatabase : public CompilationDatabase {
+public:
+  SharedCompilationDatabase(std::shared_ptr<CompilationDatabase> Base)
+      : Base(std::move(Base)) {}
+
+  std::vector<CompileCommand>
+  getCompileCommands(StringRef FilePath) const override {
+    return Base->getCompileCommands(FilePath);
+  }
+
+  std::vector<std::string> getAllFiles() const override {
+    return Base->getAllFiles();
+  }
+
+  std::vector<CompileCommand> getAllCompileCommands() const override {
+    return Base->getAllCompileCommands();
+  }
+
+private:
+  std::shared_ptr<CompilationDatabase> Base;
+};
+} // end anonymous namespace
+
+std::unique_ptr<CompilationDatabase>
+CompilationDatabaseCache::autoDetectFromSource(StringRef SourceFile,
+                                               std::string &ErrorMessage) {
+  SmallString<1024> AbsolutePath(SourceFile);
+  llvm::sys::fs::make_absolute(AbsolutePath);
+  llvm::sys::path::remove_dots(AbsolutePath, /*remove_dot_dot=*/true);
+  std::string ErrorStr;
+  std::shared_ptr<CompilationDatabase> DB =
+      findFromDirectory(llvm::sys::path::parent_path(AbsolutePath), ErrorStr);
+  if (!DB) {
+    ErrorMessage = ("Could not auto-detect compilation database for file \"" +
+                    SourceFile + "\"\n" + ErrorStr)
+                       .str();
+    return nullptr;
+  }
+  return llvm::make_unique<SharedCompilationDatabase>(std::move(DB));
+}
+
+std::shared_ptr<CompilationDatabase>
+CompilationDatabaseCache::findFromDirectory(StringRef Directory,
+                                            std::string &ErrorMessage) {
+  // Loading a database can take long, but threads that wait here would
+  // usually end up loading the same one.
+  std::lock_guard<std::mutex> Lock(Mutex);
+  std::shared_ptr<CompilationDatabase> DB;
+  std::vector<StringRef> Searched;
+  std::string LoadErrorMessage;
+  for (StringRef Dir = Directory; !Dir.empty();
+       Dir = llvm::sys::path::parent_path(Dir)) {
+    auto It = Databases.find(Dir);
+    if (It != Databases.end()) {
+      DB = It->second;
+      break;
+    }
+    Searched.push_back(Dir);
+    std::string LoadError;
+    if (std::unique_ptr<CompilationDatabase> Loaded =
+            CompilationDatabase::loadFromDirectory(Dir, LoadError)) {
+      DB = std::move(Loaded);
+      break;
+    }
+    if (LoadErrorMessage.empty())
+      LoadErrorMessage = LoadError;
+  }
+  // Every directory on the way to the database finds the same one.
+  for (StringRef Dir : Searched)
+    Databases[Dir] = DB;
+  if (!DB)
+    ErrorMessage = ("No compilation database found in " + Directory +
+                    " or any parent directory\n" + LoadErrorMessage)
+                       .str();
+  return DB;
+}
+
+} // end namespace diff
+} // end namespace clang
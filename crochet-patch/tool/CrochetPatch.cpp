@@ -12,11 +12,21 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "crochet/ASTCache.h"
 #include "crochet/ASTDiff.h"
+#include "crochet/CompilationDatabaseCache.h"
 #include "crochet/ASTPatch.h"
+#include "crochet/PreambleCache.h"
+#include "crochet/Server.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include <map>
 
 
 using namespace llvm;
@@ -27,16 +37,27 @@ using namespace clang::tooling;
 static cl::OptionCategory CrochetPatchCategory("gizmo-instrument-patch options");
 
 
-static cl::opt<std::string> ScriptPath("script", cl::desc("<script>"), cl::Required, cl::cat(CrochetPatchCategory));
-static cl::opt<std::string> TargetPath("target", cl::desc("<target>"), cl::Required, cl::cat(CrochetPatchCategory));
-static cl::opt<std::string> SourcePath("source", cl::desc("<source>"), cl::Required, cl::cat(CrochetPatchCategory));
-static cl::opt<std::string> DestinationPath("destination", cl::desc("<destination>"), cl::Required, cl::cat(CrochetPatchCategory));
-static cl::opt<std::string> MapPath("map", cl::desc("<variable mapping>"), cl::Required, cl::cat(CrochetPatchCategory));
+static cl::opt<std::string> ScriptPath("script", cl::desc("<script>"), cl::Optional, cl::cat(CrochetPatchCategory));
+static cl::opt<std::string> TargetPath("target", cl::desc("<target>"), cl::Optional, cl::cat(CrochetPatchCategory));
+static cl::opt<std::string> SourcePath("source", cl::desc("<source>"), cl::Optional, cl::cat(CrochetPatchCategory));
+static cl::opt<std::string> DestinationPath("destination", cl::desc("<destination>"), cl::Optional, cl::cat(CrochetPatchCategory));
+static cl::opt<std::string> MapPath("map", cl::desc("<variable mapping>"), cl::Optional, cl::cat(CrochetPatchCategory));
 static cl::opt<std::string> StopAfter("stop-diff-after", cl::desc("<topdown|bottomup>"), cl::Optional, cl::init(""), cl::cat(CrochetPatchCategory));
 
 static cl::opt<int> MaxSize("s", cl::desc("<maxsize>"), cl::Optional, cl::init(-1), cl::cat(CrochetPatchCategory));
 static cl::opt<float> MinSimilarity("min-sim", cl::desc("<minsimilarity>"), cl::Optional, cl::init(-1), cl::cat(CrochetPatchCategory));
+static cl::opt<std::string> NodeHash("node-hash", cl::desc("Hash function for comparing nodes, xxhash (the default) or md5"), cl::Optional, cl::init(""), cl::cat(CrochetPatchCategory));
+static cl::opt<bool> MatchRenamed("match-renamed", cl::desc("Also match subtrees that only differ in the names in them"), cl::init(false), cl::Optional, cl::cat(CrochetPatchCategory));
 static cl::opt<std::string> BuildPath("p", cl::desc("Build path"), cl::init(""), cl::Optional, cl::cat(CrochetPatchCategory));
+static cl::opt<std::string> ASTCacheDir("ast-cache-dir", cl::desc("Directory for caching serialized ASTs across invocations"), cl::init(""), cl::Optional, cl::cat(CrochetPatchCategory));
+static cl::opt<bool> SharePreamble("share-preamble", cl::desc("Compile the headers shared by the input files into one preamble"), cl::init(false), cl::Optional, cl::cat(CrochetPatchCategory));
+static cl::opt<std::string> ServePath("serve", cl::desc("Serve requests on this Unix domain socket until a shutdown request arrives"), cl::init(""), cl::Optional, cl::cat(CrochetPatchCategory));
+static cl::opt<std::string> ConnectPath("connect", cl::desc("Send the request to the server listening on this socket"), cl::init(""), cl::Optional, cl::cat(CrochetPatchCategory));
+static cl::opt<std::string> StdinPath("stdin-file", cl::desc("Read the contents of this file from standard input instead of from disk"), cl::init(""), cl::Optional, cl::cat(CrochetPatchCategory));
+static cl::opt<bool> MainFileOnly("main-file-only", cl::desc("Build syntax trees only from the declarations in the main file and in the files given to -tree-files"), cl::init(false), cl::Optional, cl::cat(CrochetPatchCategory));
+static cl::list<std::string> TreeFiles("tree-files", cl::desc("Build syntax trees only from the declarations in files that match one of these globs, and in the main file with -main-file-only"), cl::CommaSeparated, cl::cat(CrochetPatchCategory));
+static cl::list<std::string> TreeDecls("tree-decls", cl::desc("Build syntax trees only from the top-level declarations with these names"), cl::CommaSeparated, cl::cat(CrochetPatchCategory));
+static cl::opt<unsigned> ServeCacheSize("serve-cache-size", cl::desc("Number of syntax trees a server keeps in memory"), cl::init(32), cl::Optional, cl::cat(CrochetPatchCategory));
 static cl::list<std::string> ArgsAfter("extra-arg", cl::desc("Additional argument to append to the compiler command line"), cl::cat(CrochetPatchCategory));
 static cl::list<std::string> ArgsBefore("extra-arg-before", cl::desc("Additional argument to prepend to the compiler command line"), cl::cat(CrochetPatchCategory));
 
@@ -54,17 +75,21 @@ static void addExtraArgs(std::unique_ptr<CompilationDatabase> &Compilations) {
 }
 
 
+// Compilation databases found so far, shared by all inputs of this process.
+static diff::CompilationDatabaseCache CompilationDatabases;
+
+// Errors go to ErrOS, so that a server or batch run reports them with the
+// request they belong to.
 static std::unique_ptr<CompilationDatabase>
-getCompilationDatabase(StringRef Filename) {
+getCompilationDatabase(StringRef Filename, raw_ostream &ErrOS) {
   std::string ErrorMessage;
   std::unique_ptr<CompilationDatabase> Compilations =
-      CompilationDatabase::autoDetectFromSource(
+      CompilationDatabases.autoDetectFromSource(
           BuildPath.empty() ? Filename : BuildPath, ErrorMessage);
   if (!Compilations) {
-    llvm::errs()
-        << "Error while trying to load a compilation database, running "
-           "without flags.\n"
-        << ErrorMessage;
+    ErrOS << "Error while trying to load a compilation database, running "
+             "without flags.\n"
+          << ErrorMessage;
     Compilations = llvm::make_unique<clang::tooling::FixedCompilationDatabase>(
         ".", std::vector<std::string>());
   }
@@ -86,108 +111,421 @@ bool in_array(const std::string &value, const std::vector<std::string> &array)
 
 
 
+// Preambles shared by all ASTs built with -share-preamble.
+static diff::PreambleCache Preambles;
+
+namespace {
+// Does what ASTBuilderAction in Tooling.cpp does.
+class ASTBuilder : public ToolAction {
+public:
+  ASTBuilder(std::vector<std::unique_ptr<ASTUnit>> &ASTs) : ASTs(ASTs) {}
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    std::unique_ptr<ASTUnit> AST = ASTUnit::LoadFromCompilerInvocation(
+        Invocation, std::move(PCHContainerOps),
+        CompilerInstance::createDiagnostics(&Invocation->getDiagnosticOpts(),
+                                            DiagConsumer,
+                                            /*ShouldOwnClient=*/false),
+        Files);
+    if (!AST)
+      return false;
+    ASTs.push_back(std::move(AST));
+    return true;
+  }
+
+private:
+  std::vector<std::unique_ptr<ASTUnit>> &ASTs;
+};
+} // end anonymous namespace
+
+// Contents of files that have not been saved to disk, keyed by absolute path.
+using FileContents = std::map<std::string, std::string>;
+
+// Runs Action on Filename the way ClangTool::run() does, except that relative
+// paths are resolved by a file system with its own working directory. ClangTool
+// changes the working directory of the process, which breaks parses running
+// on other threads. Files in Overlays are read from memory instead of disk,
+// the compile command is still looked up by their path.
+static bool runOnFile(const CompilationDatabase &Compilations,
+                      StringRef Filename, ToolAction &Action,
+                      DiagnosticConsumer &DiagConsumer,
+                      const FileContents &Overlays) {
+  std::vector<CompileCommand> Commands =
+      Compilations.getCompileCommands(Filename);
+  if (Commands.empty())
+    return false;
+  const CompileCommand &Command = Commands[0];
+  IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> FS(
+      new llvm::vfs::OverlayFileSystem(llvm::vfs::createPhysicalFileSystem()));
+  if (!Overlays.empty()) {
+    IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> MemFS(
+        new llvm::vfs::InMemoryFileSystem());
+    for (const auto &Overlay : Overlays)
+      MemFS->addFile(Overlay.first, 0,
+                     llvm::MemoryBuffer::getMemBufferCopy(Overlay.second,
+                                                          Overlay.first));
+    FS->pushOverlay(MemFS);
+  }
+  if (FS->setCurrentWorkingDirectory(Command.Directory))
+    return false;
+  IntrusiveRefCntPtr<FileManager> Files(
+      new FileManager(FileSystemOptions(), FS));
+
+  ArgumentsAdjuster Adjuster = combineAdjusters(
+      combineAdjusters(getClangStripOutputAdjuster(),
+                       getClangSyntaxOnlyAdjuster()),
+      getClangStripDependencyFileAdjuster());
+  std::vector<std::string> CommandLine =
+      Adjuster(Command.CommandLine, Command.Filename);
+  if (llvm::none_of(CommandLine, [](StringRef Arg) {
+        return Arg.startswith("-resource-dir");
+      })) {
+    static int StaticSymbol;
+    CommandLine.push_back(
+        "-resource-dir=" +
+        CompilerInvocation::GetResourcesPath("clang_tool", &StaticSymbol));
+  }
+
+  ToolInvocation Invocation(std::move(CommandLine), &Action, Files.get());
+  Invocation.setDiagnosticConsumer(&DiagConsumer);
+  return Invocation.run();
+}
+
+// Files in Overlays are parsed from memory, the compile command is still looked
+// up by their path. The ASTs refer to the contents in Overlays and must not
+// outlive them. They bypass the AST cache, which only knows about files on
+// disk.
 static std::unique_ptr<ASTUnit>
-getAST(const std::unique_ptr<CompilationDatabase> &CommonCompilations,
-       const StringRef Filename) {
-  std::array<std::string, 1> Files = {{Filename}};
-  std::unique_ptr<CompilationDatabase> FileCompilations;
-  if (!CommonCompilations)
-    FileCompilations = getCompilationDatabase(Filename);
-  ClangTool Tool(CommonCompilations ? *CommonCompilations : *FileCompilations,
-                 Files);
+getAST(const CompilationDatabase &Compilations, const StringRef Filename,
+       raw_ostream &ErrOS, const FileContents &Overlays) {
+  diff::ASTCache Cache(ASTCacheDir);
+  bool UseCache = !ASTCacheDir.empty() && Overlays.empty();
+  if (UseCache)
+    if (std::unique_ptr<ASTUnit> AST = Cache.load(Compilations, Filename))
+      return AST;
   std::vector<std::unique_ptr<ASTUnit>> ASTs;
-  Tool.buildASTs(ASTs);
+  std::unique_ptr<ToolAction> Action =
+      SharePreamble ? Preambles.newASTBuilder(Compilations, Filename, ASTs)
+                    : llvm::make_unique<ASTBuilder>(ASTs);
+  TextDiagnosticPrinter DiagPrinter(ErrOS, new DiagnosticOptions());
+  if (!runOnFile(Compilations, Filename, *Action, DiagPrinter, Overlays))
+    ErrOS << "Error while processing " << Filename << ".\n";
   if (ASTs.size() == 0){
-    llvm::errs() << "Error: no AST built\n";
+    ErrOS << "Error: no AST built\n";
     return NULL;
   }
-  if (ASTs.size() != Files.size()){    
-    llvm::errs() << "more than one tree was built\n";
-  }
+  // Units built on a shared preamble depend on its temporary file.
+  if (UseCache && !SharePreamble)
+    Cache.store(Compilations, Filename, *ASTs[0]);
   
   return std::move(ASTs[0]);
 }
 
+// Builds the ASTs for all Files, one thread per file, whatever directories
+// they are compiled in. Diagnostics are buffered per file and printed to ErrOS
+// in the order of Files once all of them are done.
+static std::vector<std::unique_ptr<ASTUnit>>
+getASTs(const std::unique_ptr<CompilationDatabase> &CommonCompilations,
+        std::vector<std::string> Files, raw_ostream &ErrOS,
+        const FileContents &Overlays) {
+  std::vector<std::unique_ptr<CompilationDatabase>> FileCompilations(Files.size());
+  std::vector<const CompilationDatabase *> Compilations;
+  for (size_t I = 0, E = Files.size(); I < E; ++I) {
+    if (!CommonCompilations)
+      FileCompilations[I] = getCompilationDatabase(Files[I], ErrOS);
+    Compilations.push_back(CommonCompilations ? CommonCompilations.get()
+                                              : FileCompilations[I].get());
+    SmallString<256> AbsolutePath(Files[I]);
+    if (!llvm::sys::fs::make_absolute(AbsolutePath))
+      Files[I] = AbsolutePath.str();
+  }
 
+  std::vector<std::unique_ptr<ASTUnit>> ASTs(Files.size());
+  std::vector<std::string> Errors(Files.size());
+  auto Build = [&](size_t I) {
+    llvm::raw_string_ostream ErrOS(Errors[I]);
+    ASTs[I] = getAST(*Compilations[I], Files[I], ErrOS, Overlays);
+  };
+
+  // Every parse resolves relative paths against its own compile directory, so
+  // files from different directories can be parsed at the same time.
+  llvm::ThreadPool Pool(Files.size());
+  for (size_t I = 0, E = Files.size(); I < E; ++I)
+    Pool.async(Build, I);
+  Pool.wait();
+
+  for (const std::string &Error : Errors)
+    ErrOS << Error;
+  return ASTs;
+}
 
-int main(int argc, const char **argv) {
- 
-  std::string ErrorMessage;
-  std::unique_ptr<CompilationDatabase> CommonCompilations =
-      FixedCompilationDatabase::loadFromCommandLine(argc, argv, ErrorMessage);
-  if (!CommonCompilations && !ErrorMessage.empty())
-    llvm::errs() << ErrorMessage;
-  cl::HideUnrelatedOptions(CrochetPatchCategory);
-  if (!cl::ParseCommandLineOptions(argc, argv)) {
-    cl::PrintOptionValues();
+
+
+// The filter from the command line. A server builds all trees with its own
+// filter, whatever the client was given.
+static diff::TreeFilter Filter;
+
+// Fills Filter from the command line. Returns true on error.
+static bool setTreeFilter() {
+  Filter.MainFileOnly = MainFileOnly;
+  Filter.DeclNames.assign(TreeDecls.begin(), TreeDecls.end());
+  for (const std::string &Glob : TreeFiles) {
+    if (auto Err = Filter.addFileGlob(Glob)) {
+      llvm::errs() << "Error: Invalid glob '" << Glob
+                   << "': " << llvm::toString(std::move(Err)) << "\n";
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace {
+// State that is kept between the requests handled by one process.
+struct Session {
+  Session(const std::unique_ptr<CompilationDatabase> &CommonCompilations,
+          unsigned CacheSize)
+      : CommonCompilations(CommonCompilations), Trees(CacheSize, Filter) {}
+
+  const std::unique_ptr<CompilationDatabase> &CommonCompilations;
+  diff::TreeCache Trees;
+};
+} // end anonymous namespace
+
+// Reads the "files" member of Request, an object that maps paths to their
+// contents. Returns true on error.
+static bool getOverlays(const json::Object &Request, FileContents &Overlays,
+                        raw_ostream &ErrOS) {
+  const json::Value *Files = Request.get("files");
+  if (!Files)
+    return false;
+  const json::Object *Object = Files->getAsObject();
+  if (!Object) {
+    ErrOS << "Error: 'files' must map paths to their contents.\n";
+    return true;
+  }
+  for (const auto &File : *Object) {
+    auto Contents = File.second.getAsString();
+    if (!Contents) {
+      ErrOS << "Error: The contents of " << File.first.str()
+            << " must be a string.\n";
+      return true;
+    }
+    SmallString<256> AbsolutePath(File.first.str());
+    llvm::sys::fs::make_absolute(AbsolutePath);
+    Overlays[AbsolutePath.str()] = *Contents;
+  }
+  return false;
+}
+
+// Handles a request with the command "patch". Returns the exit status of the
+// tool.
+static int runRequest(Session &S, const json::Object &Request, raw_ostream &OS,
+                      raw_ostream &ErrOS,
+                      FileContents Overlays = FileContents()) {
+  StringRef Command = Request.getString("command").getValueOr("");
+  if (Command != "patch") {
+    ErrOS << "Error: Unknown command '" << Command << "'.\n";
     return 1;
   }
-  
-  addExtraArgs(CommonCompilations);
- 
-  
-  std::unique_ptr<ASTUnit> Src = getAST(CommonCompilations, SourcePath);
-  // llvm::outs() << "Building AST for destination\n";
-  std::unique_ptr<ASTUnit> Dst = getAST(CommonCompilations, DestinationPath);
- 
-  if (!Src || !Dst){
-    if (!Src)
-      llvm::errs() << "Error: Could not build AST for source\n";
-    if (!Dst)
-      llvm::errs() << "Error: Could not build AST for destination\n";
+  const char *Fields[] = {"source", "destination", "target", "map", "script"};
+  std::string Paths[5];
+  for (int I = 0; I < 5; ++I) {
+    Paths[I] = Request.getString(Fields[I]).getValueOr("");
+    if (Paths[I].empty()) {
+      ErrOS << "Error: No " << Fields[I] << " given.\n";
+      return 1;
+    }
+  }
 
+  // Declared before the trees, which refer to the buffers. Trees parsed with
+  // overlays are not cached, a later request may send other contents for the
+  // same path. Overlays starts out with the contents given by the caller.
+  if (getOverlays(Request, Overlays, ErrOS))
     return 1;
+
+  // Only the inputs that are not in the cache are parsed, concurrently. The
+  // diff and the patcher tell the trees apart by their address, so a path
+  // given for several inputs gets a tree of its own for each but the first.
+  auto IsRepeated = [&](int I) {
+    return std::find(Paths, Paths + I, Paths[I]) != Paths + I;
+  };
+  std::shared_ptr<diff::CachedTree> Trees[3];
+  std::vector<std::string> Missing;
+  for (int I = 0; I < 3; ++I) {
+    if (Overlays.empty() && !IsRepeated(I))
+      Trees[I] = S.Trees.lookup(Paths[I]);
+    if (!Trees[I])
+      Missing.push_back(Paths[I]);
   }
+  std::vector<std::unique_ptr<ASTUnit>> ASTs =
+      getASTs(S.CommonCompilations, Missing, ErrOS, Overlays);
+  for (int I = 0, J = 0; I < 3; ++I) {
+    if (Trees[I])
+      continue;
+    if (ASTs[J] && (!Overlays.empty() || IsRepeated(I)))
+      Trees[I] = diff::makeCachedTree(std::move(ASTs[J]), Filter);
+    else if (ASTs[J])
+      Trees[I] = S.Trees.insert(Paths[I], std::move(ASTs[J]));
+    else
+      ErrOS << "Error: Could not build AST for " << Fields[I] << "\n";
+    ++J;
+  }
+  if (!Trees[0] || !Trees[1] || !Trees[2])
+    return 1;
 
   diff::ComparisonOptions Options;
-  if (MaxSize != -1)
-    Options.MaxSize = MaxSize;
-  if (!StopAfter.empty()) {
-    if (StopAfter == "topdown")
+  int64_t RequestMaxSize = Request.getInteger("max_size").getValueOr(-1);
+  if (RequestMaxSize != -1)
+    Options.MaxSize = RequestMaxSize;
+  StringRef RequestStopAfter = Request.getString("stop_after").getValueOr("");
+  if (!RequestStopAfter.empty()) {
+    if (RequestStopAfter == "topdown")
       Options.StopAfterTopDown = true;
-    else if (StopAfter == "bottomup")
+    else if (RequestStopAfter == "bottomup")
       Options.StopAfterBottomUp = true;
     else {
-      llvm::errs() << "Error: Invalid argument for -stop-diff-after\n";
+      ErrOS << "Error: Invalid argument for -stop-diff-after\n";
       return 1;
     }
   }
+  StringRef RequestNodeHash = Request.getString("node_hash").getValueOr("");
+  if (RequestNodeHash == "md5")
+    Options.Hash = diff::HashKind::MD5;
+  else if (!RequestNodeHash.empty() && RequestNodeHash != "xxhash") {
+    ErrOS << "Error: Invalid argument for -node-hash\n";
+    return 1;
+  }
+  Options.MatchRenamedSubtrees =
+      Request.getBoolean("match_renamed").getValueOr(false);
 
-  // llvm::outs() << "Building AST for target\n";
-
- 
   std::unique_ptr<CompilationDatabase> FileCompilations;
-  if (!CommonCompilations)
-    FileCompilations = getCompilationDatabase(TargetPath);
+  if (!S.CommonCompilations)
+    FileCompilations = getCompilationDatabase(Paths[2], ErrOS);
 
-  std::array<std::string, 1> Files = {{TargetPath}};
-  RefactoringTool TargetTool(CommonCompilations ? *CommonCompilations : *FileCompilations, Files);
-  std::vector<std::unique_ptr<ASTUnit>> TargetASTs;
-  TargetTool.buildASTs(TargetASTs);
+  std::array<std::string, 1> Files = {{Paths[2]}};
+  RefactoringTool TargetTool(S.CommonCompilations ? *S.CommonCompilations : *FileCompilations, Files);
+  for (const auto &Overlay : Overlays)
+    TargetTool.mapVirtualFile(Overlay.first, Overlay.second);
 
-  if (TargetASTs.size() == 0){
-    llvm::errs() << "Error: Could not build AST for target\n";
-    return 1;
-  }
-    
+  if (auto Err = diff::patch(TargetTool, Paths[3], *Trees[0]->Tree, *Trees[1]->Tree, *Trees[2]->Tree, Paths[4], Options, OS)) {
+      llvm::handleAllErrors(
+          std::move(Err),
+          [&](const diff::PatchingError &PE) { PE.log(ErrOS); },
+          [&](const ReplacementError &RE) { RE.log(ErrOS); });
+      ErrOS << "*** errors occured, patching failed.\n";
+      return 1;
+    }
 
-  std::unique_ptr<ASTUnit> Tgt = std::move(TargetASTs[0]);
+  return 0;
+}
 
-  // llvm::outs() << "Creating synax trees\n";
+static json::Value handleRequest(Session &S, const json::Object &Request) {
+  std::string Output, Errors;
+  llvm::raw_string_ostream OS(Output), ErrOS(Errors);
+  int Status = runRequest(S, Request, OS, ErrOS);
+  OS.flush();
+  ErrOS.flush();
+  return diff::makeResponse(Status, std::move(Output), std::move(Errors));
+}
 
-  diff::SyntaxTree SrcTree(*Src);
-  diff::SyntaxTree DstTree(*Dst);
-  diff::SyntaxTree TgtTree(*Tgt);
+// Returns the request described by the command line. Paths are made absolute
+// if Absolute is set, for a server that runs in another directory. Files, the
+// contents read by readStdinFile(), go into the "files" member.
+static json::Object getRequest(bool Absolute,
+                               const FileContents &Files = FileContents()) {
+  auto GetPath = [&](StringRef Path) -> std::string {
+    SmallString<256> AbsolutePath(Path);
+    if (Absolute && !Path.empty())
+      llvm::sys::fs::make_absolute(AbsolutePath);
+    return AbsolutePath.str();
+  };
+  json::Object Request{{"command", "patch"},
+                       {"source", GetPath(SourcePath)},
+                       {"destination", GetPath(DestinationPath)},
+                       {"target", GetPath(TargetPath)},
+                       {"map", GetPath(MapPath)},
+                       {"script", GetPath(ScriptPath)},
+                       {"max_size", int(MaxSize)},
+                       {"stop_after", std::string(StopAfter)},
+                       {"node_hash", std::string(NodeHash)},
+                       {"match_renamed", bool(MatchRenamed)}};
+  if (!Files.empty()) {
+    json::Object Contents;
+    for (const auto &File : Files) {
+      // JSON strings are UTF-8, other encodings do not survive the request.
+      if (json::isUTF8(File.second)) {
+        Contents[File.first] = File.second;
+        continue;
+      }
+      llvm::errs() << "Warning: " << File.first
+                   << " is not valid UTF-8, the server sees a repaired copy.\n";
+      Contents[File.first] = json::fixUTF8(File.second);
+    }
+    Request["files"] = std::move(Contents);
+  }
+  return Request;
+}
 
+// With -stdin-file, reads standard input as the contents of that file. Returns
+// true on error.
+static bool readStdinFile(FileContents &Files) {
+  if (StdinPath.empty())
+    return false;
+  auto Buffer = llvm::MemoryBuffer::getSTDIN();
+  if (!Buffer) {
+    llvm::errs() << "Error: Cannot read standard input: "
+                 << Buffer.getError().message() << "\n";
+    return true;
+  }
+  SmallString<256> AbsolutePath(StdinPath);
+  llvm::sys::fs::make_absolute(AbsolutePath);
+  Files[AbsolutePath.str()] = Buffer.get()->getBuffer();
+  return false;
+}
+
+int main(int argc, const char **argv) {
+ 
+  std::string ErrorMessage;
+  std::unique_ptr<CompilationDatabase> CommonCompilations =
+      FixedCompilationDatabase::loadFromCommandLine(argc, argv, ErrorMessage);
+  if (!CommonCompilations && !ErrorMessage.empty())
+    llvm::errs() << ErrorMessage;
+  cl::HideUnrelatedOptions(CrochetPatchCategory);
+  if (!cl::ParseCommandLineOptions(argc, argv)) {
+    cl::PrintOptionValues();
+    return 1;
+  }
   
-  if (auto Err = diff::patch(TargetTool, MapPath, SrcTree, DstTree, ScriptPath, Options)) {
-      llvm::handleAllErrors(
-          std::move(Err),
-          [](const diff::PatchingError &PE) { PE.log(llvm::errs()); },
-          [](const ReplacementError &RE) { RE.log(llvm::errs()); });
-      llvm::errs() << "*** errors occured, patching failed.\n";
+  addExtraArgs(CommonCompilations);
+  if (setTreeFilter())
+    return 1;
+
+  if (!ServePath.empty()) {
+    Session Server(CommonCompilations, ServeCacheSize);
+    return diff::serve(ServePath, [&](const json::Object &Request) {
+      return handleRequest(Server, Request);
+    }) ? 1 : 0;
+  }
+
+  // Local runs parse the bytes of standard input as they are, only requests
+  // to a server have to be valid UTF-8.
+  FileContents Stdin;
+  if (readStdinFile(Stdin))
+    return 1;
+
+  if (!ConnectPath.empty()) {
+    llvm::Expected<json::Value> Response =
+        diff::sendRequest(ConnectPath, getRequest(/*Absolute=*/true, Stdin));
+    if (!Response) {
+      llvm::errs() << "Error: " << llvm::toString(Response.takeError()) << "\n";
       return 1;
     }
+    return diff::printResponse(*Response);
+  }
 
-  return 0;
+  Session Local(CommonCompilations, /*CacheSize=*/0);
+  return runRequest(Local, getRequest(/*Absolute=*/false), llvm::outs(), llvm::errs(), std::move(Stdin));
 }
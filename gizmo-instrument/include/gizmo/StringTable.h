@@ -0,0 +1,96 @@
+//===- StringTable.h - Interned node labels and values --------*- C++ -*- -===//
+//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the table that gives the labels, values and identifiers
+// of syntax tree nodes small integer ids, so that they can be compared without
+// looking at the characters.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_ASTDIFF_STRINGTABLE_H
+#define LLVM_CLANG_TOOLING_ASTDIFF_STRINGTABLE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include <mutex>
+#include <vector>
+
+namespace clang {
+namespace diff {
+
+/// Identifies a string in the StringTable.
+using StringId = unsigned;
+
+/// Maps strings to ids, equal strings get equal ids. There is one table per
+/// process, so ids from different syntax trees can be compared. Every string
+/// counts its users, each a TreeStrings. When the last user releases a string,
+/// the string is removed and its id is given to the next new string.
+///
+/// The table is safe to use from several threads.
+class StringTable {
+public:
+  /// Stands for a string that is absent, such as the identifier of an unnamed
+  /// node. It is different from the id of the empty string.
+  static const StringId NoString = 0;
+
+  static StringTable &get();
+
+  /// Returns the id of Str and the table's copy of it, and counts one more
+  /// user of it. The copy stays valid until the last user releases it.
+  std::pair<StringId, llvm::StringRef> acquire(llvm::StringRef Str);
+  /// Counts one user less for each of Ids.
+  void release(llvm::ArrayRef<StringId> Ids);
+  /// Returns the number of bytes taken by the table and its strings.
+  size_t getMemoryUsage();
+
+private:
+  StringTable();
+
+  std::mutex Mutex;
+  llvm::StringMap<StringId> Ids;
+  /// Indexed by id, refers to the keys of Ids.
+  std::vector<llvm::StringRef> Strings;
+  /// Indexed by id, zero for ids that are free.
+  std::vector<unsigned> NumUsers;
+  std::vector<StringId> FreeIds;
+};
+
+/// The strings that one syntax tree uses. A string the tree has seen before
+/// is looked up here, without taking the lock of the table. The strings are
+/// released when the tree is destroyed, so evicting a tree frees the strings
+/// that only it used.
+///
+/// Not safe to use from several threads.
+class TreeStrings {
+public:
+  TreeStrings() = default;
+  TreeStrings(const TreeStrings &) = delete;
+  TreeStrings &operator=(const TreeStrings &) = delete;
+  ~TreeStrings();
+
+  StringId intern(llvm::StringRef Str);
+  /// Returns the string for an id returned by intern(), or the empty string
+  /// for NoString.
+  llvm::StringRef getString(StringId Id) const;
+  /// Returns the number of bytes taken by the lookup tables, the strings are
+  /// counted by the StringTable.
+  size_t getMemoryUsage() const;
+
+private:
+  /// The keys refer to the strings in the StringTable.
+  llvm::DenseMap<llvm::StringRef, StringId> Ids;
+  llvm::DenseMap<StringId, llvm::StringRef> Strings;
+};
+
+} // end namespace diff
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_ASTDIFF_STRINGTABLE_H
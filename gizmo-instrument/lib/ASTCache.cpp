@@ -0,0 +1,97 @@
+//===- ASTCache.cpp - On-disk cache for serialized ASTs -------*- C++ -*- -===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "gizmo/ASTCache.h"
+
+#include "clang/Basic/Version.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/PCHContainerOperations.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+
+using namespace llvm;
+using namespace clang;
+using namespace tooling;
+
+namespace clang {
+namespace diff {
+
+std::string ASTCache::getEntryPath(const CompilationDatabase &Compilations,
+                                   StringRef Filename,
+                                   std::string *WorkingDir) const {
+  std::vector<CompileCommand> Commands =
+      Compilations.getCompileCommands(Filename);
+  if (Commands.empty())
+    return "";
+  auto Buffer = llvm::MemoryBuffer::getFile(Filename);
+  if (!Buffer)
+    return "";
+  const CompileCommand &Command = Commands[0];
+  llvm::MD5 Hash;
+  auto AddField = [&Hash](StringRef Field) {
+    Hash.update(Field);
+    Hash.update(StringRef("\0", 1));
+  };
+  AddField(getClangFullRepositoryVersion());
+  AddField(Command.Directory);
+  AddField(Command.Filename);
+  for (const std::string &Arg : Command.CommandLine)
+    AddField(Arg);
+  Hash.update(Buffer.get()->getBuffer());
+  llvm::MD5::MD5Result HashResult;
+  Hash.final(HashResult);
+  SmallString<32> Digest;
+  llvm::MD5::stringifyResult(HashResult, Digest);
+  SmallString<256> Path(Directory);
+  llvm::sys::path::append(Path, Digest + ".ast");
+  if (WorkingDir)
+    *WorkingDir = Command.Directory;
+  return Path.str();
+}
+
+std::unique_ptr<ASTUnit> ASTCache::load(const CompilationDatabase &Compilations,
+                                        StringRef Filename) const {
+  std::string WorkingDir;
+  std::string Path = getEntryPath(Compilations, Filename, &WorkingDir);
+  if (Path.empty() || !llvm::sys::fs::exists(Path))
+    return nullptr;
+  // The reader keeps a reference to the container operations for as long as
+  // the unit is alive.
+  static auto PCHContainerOps = std::make_shared<PCHContainerOperations>();
+  // Stale entries are reported through the diagnostics engine, they are just
+  // cache misses to us.
+  IntrusiveRefCntPtr<DiagnosticsEngine> Diags =
+      CompilerInstance::createDiagnostics(new DiagnosticOptions(),
+                                          new IgnoringDiagConsumer());
+  FileSystemOptions FileSystemOpts;
+  FileSystemOpts.WorkingDir = WorkingDir;
+  return ASTUnit::LoadFromASTFile(Path, PCHContainerOps->getRawReader(),
+                                  ASTUnit::LoadEverything, Diags,
+                                  FileSystemOpts);
+}
+
+bool ASTCache::store(const CompilationDatabase &Compilations,
+                     StringRef Filename, ASTUnit &AST) const {
+  // The reader refuses to load units that were built with errors.
+  if (AST.getDiagnostics().hasErrorOccurred())
+    return true;
+  std::string Path = getEntryPath(Compilations, Filename);
+  if (Path.empty())
+    return true;
+  if (llvm::sys::fs::create_directories(Directory))
+    return true;
+  // ASTUnit::Save() writes to a temporary file first, so concurrent runs
+  // never observe partially written entries.
+  return AST.Save(Path);
+}
+
+} // end namespace diff
+} // end namespace clang
@@ -677,9 +677,9 @@ namespace clang {
         std::string Patcher::translateVariables(NodeRef node, std::string statement) {
             unsigned childNodesInUpdateRange = node.getNumChildren();
              llvm::errs() << "child count " << childNodesInUpdateRange << "\n";
-            if (node.getTypeLabel() == "VarDecl") {
+            if (node.getKind() == NodeKind::VarDecl) {
                 // llvm::outs() << "translating variable definition \n";
-                auto decNode = node.ASTNode.get<VarDecl>();
+                auto decNode = node.getASTNode().get<VarDecl>();
                 SourceLocation loc = decNode->getLocation();
                 std::string locId = loc.printToString(Src.getSourceManager());
                 // llvm::errs() << locId << "\n";
@@ -704,9 +704,9 @@ namespace clang {
                 return statement;
 
 
-            } else if (node.getTypeLabel() == "MemberExpr") {
+            } else if (node.getKind() == NodeKind::MemberExpr) {
                  llvm::outs() << "translating member name \n";
-                auto memNode = node.ASTNode.get<MemberExpr>();
+                auto memNode = node.getASTNode().get<MemberExpr>();
                 auto decNode = memNode->getMemberDecl();
                 SourceLocation loc = decNode->getLocation();
                 std::string locId = loc.printToString(Src.getSourceManager());
@@ -780,9 +780,9 @@ namespace clang {
 //                 llvm::errs() << "child " << childIndex << "\n";
                 NodeRef childNode = node.getChild(childIndex);
 //                 llvm::outs() << "child " << childIndex << " type " << childNode.getTypeLabel() << "\n";
-                if (childNode.getTypeLabel() == "DeclRefExpr") {
+                if (childNode.getKind() == NodeKind::DeclRefExpr) {
                     // llvm::outs() << "translating reference \n";
-                    auto decRefNode = childNode.ASTNode.get<DeclRefExpr>();
+                    auto decRefNode = childNode.getASTNode().get<DeclRefExpr>();
                     auto decNode = decRefNode->getDecl();
                     SourceLocation loc = decNode->getLocation();
                     std::string locId = loc.printToString(Src.getSourceManager());
@@ -855,14 +855,14 @@ namespace clang {
                 range.setBegin(startLoc);
             }
 
-            if (deleteNode.getTypeLabel() == "BinaryOperator" && !isMove) {
-                auto binOpNode = deleteNode.ASTNode.get<BinaryOperator>();
+            if (deleteNode.getKind() == NodeKind::BinaryOperator && !isMove) {
+                auto binOpNode = deleteNode.getASTNode().get<BinaryOperator>();
                 range.setBegin(binOpNode->getOperatorLoc());
                 std::string binOp = binOpNode->getOpcodeStr();
                 Rewrite.RemoveText(binOpNode->getOperatorLoc(), binOp.length());
 
-            } else if (deleteNode.getTypeLabel() == "DeclStmt" || deleteNode.getTypeLabel() == "Macro" ||
-                       deleteNode.getTypeLabel() == "MemberExpr") {
+            } else if (deleteNode.getKind() == NodeKind::DeclStmt || deleteNode.getKind() == NodeKind::Macro ||
+                       deleteNode.getKind() == NodeKind::MemberExpr) {
                 range = expandRange(range, Target);
                 Rewriter::RewriteOptions delRangeOpts;
                 delRangeOpts.RemoveLineIfEmpty = true;
@@ -917,197 +917,194 @@ namespace clang {
             if (!insertStatement.empty()) {
 
                 int NumChildren = targetNode.getNumChildren();
-                if (targetNode.getTypeLabel() == "CompoundStmt") {
+                switch (targetNode.getKind()) {
+                    case NodeKind::CompoundStmt:
+                        insertStatement = "\n" + insertStatement + "\n";
 
-                    insertStatement = "\n" + insertStatement + "\n";
+                        if (Offset == 0) {
+                            if (NumChildren > 0) {
+                                Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
+                                modified = true;
 
-                    if (Offset == 0) {
-                        if (NumChildren > 0) {
-                            Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
-                            modified = true;
+                            } else {
+                                Rewrite.InsertTextAfter(insertLoc, insertStatement);
+                                modified = true;
+                            }
 
                         } else {
-                            Rewrite.InsertTextAfter(insertLoc, insertStatement);
+
+                            NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
+                            insertLoc = nearestChildNode.getSourceRange().getEnd();
+
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
                             modified = true;
-                        }
 
-                    } else {
 
-                        NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
-                        insertLoc = nearestChildNode.getSourceRange().getEnd();
+                        }
+                        break;
+                    case NodeKind::IfStmt:
+                        if (Offset == 0) {
+                            auto ifNode = targetNode.getASTNode().get<IfStmt>();
+                            auto condNode = ifNode->getCond();
+                            insertLoc = condNode->getExprLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                            modified = true;
 
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
-                        modified = true;
+                        } else {
 
+                            NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
+                            insertLoc = nearestChildNode.getSourceRange().getEnd();
 
-                    }
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                            modified = true;
 
-                } else if (targetNode.getTypeLabel() == "IfStmt") {
 
-                    if (Offset == 0) {
-                        auto ifNode = targetNode.ASTNode.get<IfStmt>();
-                        auto condNode = ifNode->getCond();
-                        insertLoc = condNode->getExprLoc();
+                        }
+                        break;
+                    case NodeKind::BinaryOperator: {
+                        // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
+                        auto binaryNode = targetNode.getASTNode().get<BinaryOperator>();
+                        insertLoc = binaryNode->getOperatorLoc();
                         //std::string locId = insertLoc.printToString(Target.getSourceManager());
                         // llvm::outs() << locId << "\n";
 
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
-                        modified = true;
+                        if (Offset == 0) {
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                    } else {
 
-                        NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
-                        insertLoc = nearestChildNode.getSourceRange().getEnd();
+                        } else {
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                        }
 
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
                         modified = true;
-
-
-                    }
-
-                } else if (targetNode.getTypeLabel() == "BinaryOperator") {
-
-                    // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
-                    auto binaryNode = targetNode.ASTNode.get<BinaryOperator>();
-                    insertLoc = binaryNode->getOperatorLoc();
-                    //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                    // llvm::outs() << locId << "\n";
-
-                    if (Offset == 0) {
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
-
-
-                    } else {
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        break;
                     }
+                    case NodeKind::CallExpr: {
+                        // llvm::outs() << insertStatement << "\n";
+                        // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
+                        auto callerNode = targetNode.getASTNode().get<CallExpr>();
+                        int numArgs = callerNode->getNumArgs();
 
-                    modified = true;
-
-                } else if (targetNode.getTypeLabel() == "CallExpr") {
+                        if (numArgs == 0) {
+                            insertStatement = insertStatement + ", ";
 
+                        } else {
+                            insertStatement = ", " + insertStatement;
+                        }
 
-                    // llvm::outs() << insertStatement << "\n";
-                    // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
-                    auto callerNode = targetNode.ASTNode.get<CallExpr>();
-                    int numArgs = callerNode->getNumArgs();
+                        // llvm::outs() << insertStatement << "\n";
 
-                    if (numArgs == 0) {
-                        insertStatement = insertStatement + ", ";
 
-                    } else {
-                        insertStatement = ", " + insertStatement;
-                    }
+                        if (Offset >= numArgs) {
+                            insertLoc = callerNode->getRParenLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
 
-                    // llvm::outs() << insertStatement << "\n";
-
-
-                    if (Offset >= numArgs) {
-                        insertLoc = callerNode->getRParenLoc();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        } else {
+                            insertLoc = callerNode->getArg(Offset)->getExprLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
 
-                    } else {
-                        insertLoc = callerNode->getArg(Offset)->getExprLoc();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                        }
 
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        modified = true;
+                        break;
                     }
+                    case NodeKind::MemberExpr: {
+                        extractRange = insertNode.getSourceRange();
+                        insertStatement = Lexer::getSourceText(extractRange, SourceTree.getSourceManager(),
+                                                               SourceTree.getLangOpts());
+    //                    insertStatement = translateVariables(insertNode, insertStatement);
+                        // llvm::outs() << insertStatement << "\n";
+                        // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
+                        auto memberNode = targetNode.getASTNode().get<MemberExpr>();
+
+                        if (Offset == 0) {
+                            // insertStatement = insertStatement + "->";
+                            insertLoc = memberNode->getLocStart();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                    modified = true;
-
-                } else if (targetNode.getTypeLabel() == "MemberExpr") {
-
-                    extractRange = insertNode.getSourceRange();
-                    insertStatement = Lexer::getSourceText(extractRange, SourceTree.getSourceManager(),
-                                                           SourceTree.getLangOpts());
-//                    insertStatement = translateVariables(insertNode, insertStatement);
-                    // llvm::outs() << insertStatement << "\n";
-                    // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
-                    auto memberNode = targetNode.ASTNode.get<MemberExpr>();
-
-                    if (Offset == 0) {
-                        // insertStatement = insertStatement + "->";
-                        insertLoc = memberNode->getLocStart();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
-
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        } else {
+                            insertLoc = memberNode->getMemberLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
 
-                    } else {
-                        insertLoc = memberNode->getMemberLoc();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertText(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                        }
 
-                        if (Rewrite.InsertText(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        modified = true;
+                        break;
                     }
+                    default:
+                        if (Offset == 0) {
+                            if (NumChildren > 0) {
+                                // NodeRef firstChild = targetNode.getChild(Offset);
+                                // startLoc = firstChild.getSourceRange().getBegin();
+                                // crochetPatcher.Rewrite.InsertTextBefore(startLoc, insertStatement);
 
-                    modified = true;
+                                Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
+                                modified = true;
 
-                } else {
-
-                    if (Offset == 0) {
-                        if (NumChildren > 0) {
-                            // NodeRef firstChild = targetNode.getChild(Offset);
-                            // startLoc = firstChild.getSourceRange().getBegin();
-                            // crochetPatcher.Rewrite.InsertTextBefore(startLoc, insertStatement);
 
-                            Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
-                            modified = true;
+                            } else {
 
+                                Rewrite.InsertTextAfter(insertLoc, insertStatement);
+                                modified = true;
+                                // Rewrite.InsertTextAfter(r.getBegin(), insert_value);
+                                // PresumedLoc InsertLoc = SM.getPresumedLoc(r.getBegin());
+                                // llvm::outs() << "InsertLoc: " << InsertLoc.getLine() << ":" << InsertLoc.getColumn() << "\n";
+                            }
 
                         } else {
 
-                            Rewrite.InsertTextAfter(insertLoc, insertStatement);
-                            modified = true;
-                            // Rewrite.InsertTextAfter(r.getBegin(), insert_value);
-                            // PresumedLoc InsertLoc = SM.getPresumedLoc(r.getBegin());
-                            // llvm::outs() << "InsertLoc: " << InsertLoc.getLine() << ":" << InsertLoc.getColumn() << "\n";
-                        }
+                            // llvm::outs() << Offset << "\n";
+                            // llvm::outs() << NumChildren << "\n";
+
+                            if (Offset <= NumChildren - 1) {
+                                // llvm::outs() <<"if leg\n";
+                                NodeRef nearestChildNode = targetNode.getChild(Offset);
+                                // llvm::outs() <<"got child\n";
+                                insertLoc = nearestChildNode.getSourceRange().getBegin();
+                                // llvm::outs() <<"got loc\n";
+                                // if (insertLoc.isValid())
+                                //  llvm::outs() <<"valid\n";
+                                if (Rewrite.InsertText(insertLoc, insertStatement))
+                                    llvm::errs() << "error inserting\n";
+                                // llvm::outs() <<"inserted\n";
+                                modified = true;
+
+                            } else {
+                                // llvm::outs() <<"else leg\n";
+                                NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
+                                // llvm::outs() <<"got child\n";
+                                insertLoc = nearestChildNode.getSourceRange().getEnd();
+                                // llvm::outs() <<"got loc\n";
+                                Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
+                                // llvm::outs() <<"inserted\n";
+                                modified = true;
+                            }
 
-                    } else {
 
-                        // llvm::outs() << Offset << "\n";
-                        // llvm::outs() << NumChildren << "\n";
-
-                        if (Offset <= NumChildren - 1) {
-                            // llvm::outs() <<"if leg\n";
-                            NodeRef nearestChildNode = targetNode.getChild(Offset);
-                            // llvm::outs() <<"got child\n";
-                            insertLoc = nearestChildNode.getSourceRange().getBegin();
-                            // llvm::outs() <<"got loc\n";
-                            // if (insertLoc.isValid())
-                            //  llvm::outs() <<"valid\n";
-                            if (Rewrite.InsertText(insertLoc, insertStatement))
-                                llvm::errs() << "error inserting\n";
-                            // llvm::outs() <<"inserted\n";
-                            modified = true;
-
-                        } else {
-                            // llvm::outs() <<"else leg\n";
-                            NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
-                            // llvm::outs() <<"got child\n";
-                            insertLoc = nearestChildNode.getSourceRange().getEnd();
-                            // llvm::outs() <<"got loc\n";
-                            Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
-                            // llvm::outs() <<"inserted\n";
-                            modified = true;
                         }
-
-
-                    }
-
+                        break;
                 }
 
 
@@ -1137,9 +1134,9 @@ namespace clang {
             // llvm::outs() << "nodes matched\n";
             CharSourceRange range;
 
-            if (targetNode.getTypeLabel() == "BinaryOperator") {
+            if (targetNode.getKind() == NodeKind::BinaryOperator) {
 
-                SourceRange r = targetNode.ASTNode.getSourceRange();
+                SourceRange r = targetNode.getASTNode().getSourceRange();
                 range.setBegin(r.getBegin());
                 range.setEnd(r.getEnd());
 
@@ -1164,7 +1161,7 @@ namespace clang {
             std::string oldValue = targetNode.getValue();
 
 
-            if (targetNode.getTypeLabel() == "MemberExpr") {
+            if (targetNode.getKind() == NodeKind::MemberExpr) {
 
                 updateValue = updateValue.substr(1);
                 oldValue = oldValue.substr(1);
@@ -1209,6 +1206,12 @@ namespace clang {
                 return error(patching_error::failed_to_build_AST);
             SyntaxTree Target(*TargetASTs[0]);
 
+            return patch(TargetTool, Src, Target, MapFilePath, ScriptFilePath, Options, Debug);
+        }
+
+        Error patch(RefactoringTool &TargetTool, SyntaxTree &Src, SyntaxTree &Target, std::string MapFilePath, std::string ScriptFilePath,
+                    const ComparisonOptions &Options, bool Debug) {
+
             Patcher crochetPatcher(Src, Target, Options, TargetTool, Debug);
             crochetPatcher.loadVariableMapping(MapFilePath);
             std::ifstream infile(ScriptFilePath);
@@ -0,0 +1,130 @@
+//===- SelectiveASTBuilder.cpp - Parse only some function bodies -*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "gizmo/SelectiveASTBuilder.h"
+
+#include "clang/AST/ASTConsumer.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Lex/Lexer.h"
+
+using namespace llvm;
+using namespace clang;
+using namespace tooling;
+
+namespace clang {
+namespace diff {
+
+namespace {
+
+class SkipBodiesConsumer : public ASTConsumer {
+public:
+  SkipBodiesConsumer(CompilerInstance &CI, const BodyFilter &KeepBody)
+      : CI(CI), KeepBody(KeepBody) {}
+
+  bool shouldSkipFunctionBody(Decl *D) override {
+    return !KeepBody(*D, CI.getSourceManager(), CI.getLangOpts());
+  }
+
+private:
+  CompilerInstance &CI;
+  const BodyFilter &KeepBody;
+};
+
+class SkipBodiesAction : public ASTFrontendAction {
+public:
+  SkipBodiesAction(const BodyFilter &KeepBody) : KeepBody(KeepBody) {}
+
+protected:
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
+                                                 StringRef) override {
+    return llvm::make_unique<SkipBodiesConsumer>(CI, KeepBody);
+  }
+
+private:
+  const BodyFilter &KeepBody;
+};
+
+} // end anonymous namespace
+
+// Returns the line of the brace that closes the body of D, or 0 if it cannot
+// be found. The parser is positioned at the start of the body, so this lexes
+// the raw text that follows the declarator.
+static unsigned getBodyEndLine(const Decl &D, const SourceManager &SM,
+                               const LangOptions &LangOpts) {
+  SourceLocation Loc = SM.getExpansionLoc(D.getSourceRange().getEnd());
+  if (Loc.isInvalid() || !SM.isInMainFile(Loc))
+    return 0;
+  std::pair<FileID, unsigned> LocInfo = SM.getDecomposedLoc(Loc);
+  StringRef Buffer = SM.getBufferData(LocInfo.first);
+  Lexer Lex(SM.getLocForStartOfFile(LocInfo.first), LangOpts, Buffer.begin(),
+            Buffer.begin() + LocInfo.second, Buffer.end());
+  Token Tok;
+  // Skip the last token of the declarator.
+  Lex.LexFromRawLexer(Tok);
+  unsigned Depth = 0, EndLine = 0;
+  while (true) {
+    Lex.LexFromRawLexer(Tok);
+    if (Tok.is(tok::eof))
+      return EndLine;
+    if (EndLine) {
+      // Constructor initializers such as a{1}, b{2} and the handlers of a
+      // function try block continue the body.
+      if (!Tok.isOneOf(tok::comma, tok::l_brace) &&
+          !(Tok.is(tok::raw_identifier) && Tok.getRawIdentifier() == "catch"))
+        return EndLine;
+      EndLine = 0;
+    }
+    if (Tok.is(tok::l_brace))
+      ++Depth;
+    else if (Tok.is(tok::r_brace) && Depth && !--Depth)
+      EndLine = SM.getExpansionLineNumber(Tok.getLocation());
+  }
+}
+
+BodyFilter keepMainFileBodies() {
+  return [](const Decl &D, const SourceManager &SM, const LangOptions &) {
+    return SM.isInMainFile(SM.getExpansionLoc(D.getLocation()));
+  };
+}
+
+BodyFilter keepBodiesContainingLine(unsigned Line) {
+  return [Line](const Decl &D, const SourceManager &SM,
+                const LangOptions &LangOpts) {
+    SourceLocation Begin = SM.getExpansionLoc(D.getSourceRange().getBegin());
+    if (!SM.isInMainFile(Begin))
+      return false;
+    if (SM.getExpansionLineNumber(Begin) > Line)
+      return false;
+    // Keep the body if its end cannot be determined.
+    unsigned EndLine = getBodyEndLine(D, SM, LangOpts);
+    return EndLine == 0 || EndLine >= Line;
+  };
+}
+
+bool SelectiveASTBuilder::runInvocation(
+    std::shared_ptr<CompilerInvocation> Invocation, FileManager *Files,
+    std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+    DiagnosticConsumer *DiagConsumer) {
+  Invocation->getFrontendOpts().SkipFunctionBodies = true;
+  SkipBodiesAction Action(KeepBody);
+  std::unique_ptr<ASTUnit> AST(ASTUnit::LoadFromCompilerInvocationAction(
+      Invocation, std::move(PCHContainerOps),
+      CompilerInstance::createDiagnostics(&Invocation->getDiagnosticOpts(),
+                                          DiagConsumer,
+                                          /*ShouldOwnClient=*/false),
+      &Action));
+  if (!AST)
+    return false;
+  ASTs.push_back(std::move(AST));
+  return true;
+}
+
+} // end namespace diff
+} // end namespace clang
@@ -16,8 +16,10 @@
 #include <iostream>
 #include <list>
 #include <vector>
+#include "gizmo/ASTCache.h"
 #include "gizmo/ASTDiff.h"
 #include "gizmo/ASTPatch.h"
+#include "gizmo/SelectiveASTBuilder.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Rewrite/Core/Rewriter.h"
 #include "clang/Tooling/Tooling.h"
@@ -33,6 +35,8 @@ static cl::OptionCategory GizmoCategory("gizmo-instrument options");
 static cl::opt<std::string> LineNumber("line-number", cl::desc("<line number in the source code>"), cl::Required, cl::cat(GizmoCategory));
 static cl::opt<std::string> Transformation("transformation", cl::desc("<transformation type>"), cl::Required, cl::cat(GizmoCategory));
 static cl::opt<std::string> SourcePath("source", cl::desc("<source>"), cl::Required, cl::cat(GizmoCategory));
+static cl::opt<std::string> ASTCacheDir("ast-cache-dir", cl::desc("Directory for caching serialized ASTs across invocations"), cl::init(""), cl::Optional, cl::cat(GizmoCategory));
+static cl::opt<bool> SkipBodies("skip-function-bodies", cl::desc("Skip the bodies of functions that do not span the line number"), cl::init(false), cl::Optional, cl::cat(GizmoCategory));
 
 std::list<std::string> variableNameList;
 std::list<std::string>::iterator it;
@@ -58,7 +62,7 @@ getCompilationDatabase(StringRef Filename) {
 int traverseNode(clang::diff::NodeRef node){
   auto ChildBegin = node.begin(), ChildEnd = node.end();
 //  llvm::outs() << node.getTypeLabel() << "\n";
-  std::string nodeType = node.getTypeLabel();
+  diff::NodeKind nodeKind = node.getKind();
   int nodeId = node.getId();
   auto startLoc = node.getSourceBeginLocation();
   int locLineNumber = startLoc.first;
@@ -69,10 +73,11 @@ int traverseNode(clang::diff::NodeRef node){
 
 
 
-  if (nodeType == "ParmVarDecl" || nodeType == "VarDecl"){
+  if (nodeKind == diff::NodeKind::ParmVarDecl ||
+      nodeKind == diff::NodeKind::VarDecl){
     auto identifier = node.getIdentifier();
     variableNameList.push_front(*identifier);
-  } else if (nodeType == "MemberExpr"){
+  } else if (nodeKind == diff::NodeKind::MemberExpr){
     std::string varName;
     std::string nodeValue = node.getValue();
     if (nodeValue == "")
@@ -80,8 +85,7 @@ int traverseNode(clang::diff::NodeRef node){
 
     std::string identifier =  nodeValue.substr(nodeValue.find("::") + 2);
     clang::diff::NodeRef childNode = *ChildBegin;
-    std::string childNodeType = childNode.getTypeLabel();
-    if (childNodeType != "DeclRefExpr")
+    if (childNode.getKind() != diff::NodeKind::DeclRefExpr)
       return 0;
 
     varName = childNode.getValue() + "->" + identifier;
@@ -169,9 +173,24 @@ int main(int argc, const char **argv) {
     FileCompilations = getCompilationDatabase(SourcePath);
 
   std::array<std::string, 1> Files = {{SourcePath}};
-  RefactoringTool RefactorTool(CommonCompilations ? *CommonCompilations : *FileCompilations, Files);
+  const CompilationDatabase &Compilations = CommonCompilations ? *CommonCompilations : *FileCompilations;
+  RefactoringTool RefactorTool(Compilations, Files);
   std::vector<std::unique_ptr<ASTUnit>> SrcASTs;
-  RefactorTool.buildASTs(SrcASTs);
+  clang::diff::ASTCache Cache(ASTCacheDir);
+  // Units with skipped bodies are incomplete, they are kept out of the cache.
+  bool UseCache = !ASTCacheDir.empty() && !SkipBodies;
+  if (UseCache)
+    if (std::unique_ptr<ASTUnit> CachedAST = Cache.load(Compilations, SourcePath))
+      SrcASTs.push_back(std::move(CachedAST));
+  if (SrcASTs.empty()) {
+    if (SkipBodies) {
+      clang::diff::SelectiveASTBuilder Builder(SrcASTs, clang::diff::keepBodiesContainingLine(stoi(LineNumber)));
+      RefactorTool.run(&Builder);
+    } else
+      RefactorTool.buildASTs(SrcASTs);
+    if (!SrcASTs.empty() && UseCache)
+      Cache.store(Compilations, SourcePath, *SrcASTs[0]);
+  }
 
   if (SrcASTs.size() == 0){
     llvm::errs() << "Error: Could not build AST for target\n";
@@ -192,15 +211,15 @@ int main(int argc, const char **argv) {
   std::size_t found = SourcePath.find_last_of("/\\");
   std::string sourceFileName = SourcePath.substr(found+1);
 
+  int lineNumber = stoi(LineNumber);
   for (diff::NodeRef node : SrcTree) {
     auto StartLoc = node.getSourceBeginLocation();
     auto EndLoc = node.getSourceEndLocation();
     int startLine = StartLoc.first;
     int endLine = EndLoc.first;
-    int lineNumber = stoi(LineNumber);
-    std::string nodeType = node.getTypeLabel();
+    diff::NodeKind nodeKind = node.getKind();
     if (startLine <= lineNumber && endLine >= lineNumber){
-      if (nodeType == "FunctionDecl"){
+      if (nodeKind == diff::NodeKind::FunctionDecl){
         std::string fileName = node.getFileName();
         if (!fileName.empty()) {
           if (fileName == sourceFileName){
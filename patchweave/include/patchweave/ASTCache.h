@@ -0,0 +1,56 @@
+//===- ASTCache.h - On-disk cache for serialized ASTs ---------*- C++ -*- -===//
+//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares a persistent cache for translation units. ASTs are
+// serialized with ASTUnit::Save() and reloaded with
+// ASTUnit::LoadFromASTFile() instead of being parsed again.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_ASTDIFF_ASTCACHE_H
+#define LLVM_CLANG_TOOLING_ASTDIFF_ASTCACHE_H
+
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Tooling/CompilationDatabase.h"
+
+namespace clang {
+namespace diff {
+
+/// Stores serialized ASTs in a directory. An entry is keyed by the contents
+/// of the main file, the compile command that is used to build it and the
+/// version of clang. Included files are validated by the AST reader when an
+/// entry is loaded, entries with modified headers are treated as misses.
+class ASTCache {
+public:
+  ASTCache(StringRef Directory) : Directory(Directory) {}
+
+  /// Returns the cached AST for Filename, or null if there is no usable entry.
+  std::unique_ptr<ASTUnit>
+  load(const tooling::CompilationDatabase &Compilations,
+       StringRef Filename) const;
+
+  /// Serializes AST into the cache. Returns true on error.
+  bool store(const tooling::CompilationDatabase &Compilations,
+             StringRef Filename, ASTUnit &AST) const;
+
+private:
+  /// Returns the path of the cache entry for Filename, or an empty string if
+  /// the key cannot be computed.
+  std::string getEntryPath(const tooling::CompilationDatabase &Compilations,
+                           StringRef Filename,
+                           std::string *WorkingDir = nullptr) const;
+
+  std::string Directory;
+};
+
+} // end namespace diff
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_ASTDIFF_ASTCACHE_H
@@ -15,9 +15,14 @@
 
 #include "clang/AST/LexicallyOrderedRecursiveASTVisitor.h"
 #include "clang/Lex/Lexer.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/PriorityQueue.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/Support/MD5.h"
+#include "llvm/Support/xxhash.h"
 
+#include <climits>
+#include <cstring>
 #include <limits>
 #include <memory>
 #include <unordered_set>
@@ -68,7 +73,8 @@ private:
 
 public:
   SyntaxTree::Impl &T1, &T2;
-  std::map<NodeId, NodeChange> ChangesT1, ChangesT2;
+  /// Indexed by NodeId.
+  std::vector<NodeChange> ChangesT1, ChangesT2;
 
   Impl(SyntaxTree::Impl &T1, SyntaxTree::Impl &T2,
        const ComparisonOptions &Options);
@@ -83,6 +89,8 @@ public:
 
   ChangeKind getNodeChange(NodeRef N) const;
 
+  size_t getMemoryUsage() const;
+
   void dumpChanges(raw_ostream &OS, bool DumpMatches) const;
 
 private:
@@ -96,6 +104,13 @@ private:
   // Returns true if the two subtrees are identical.
   bool identical(NodeRef N1, NodeRef N2) const;
 
+  // Compares two subtrees node by node, for when their hashes are equal.
+  bool verifyIdentical(NodeRef N1, NodeRef N2) const;
+
+  // Returns true if the two subtrees have the same structural hash and the
+  // names in one can be renamed one to one into those of the other.
+  bool isRenaming(NodeRef N1, NodeRef N2) const;
+
   // Returns false if the nodes must not be mached.
   bool isMatchingPossible(NodeRef N1, NodeRef N2) const;
 
@@ -106,9 +121,14 @@ private:
   // subtrees, but only if both have fewer nodes than MaxSize.
   void addOptimalMapping(NodeRef N1, NodeRef N2);
 
+  // Returns the NodeIds that the descendants of N1 are mapped to, sorted.
+  std::vector<NodeId> getMappedDescendants(NodeRef N1) const;
+
   // Computes the ratio of common descendants between the two nodes.
   // Descendants are only considered to be equal when they are mapped.
-  double getJaccardSimilarity(NodeRef N1, NodeRef N2) const;
+  // MappedDescendants1 is what getMappedDescendants() returns for N1.
+  double getJaccardSimilarity(NodeRef N1, NodeRef N2,
+                              ArrayRef<NodeId> MappedDescendants1) const;
 
   double getNodeSimilarity(NodeRef N1, NodeRef N2) const;
 
@@ -117,8 +137,13 @@ private:
 
   const Node *findCandidateFromChildren(NodeRef N1, NodeRef P2) const;
 
-  // Returns a mapping of identical subtrees.
-  void matchTopDown();
+  // Returns a mapping of identical subtrees. With IgnoreNames, unmatched
+  // subtrees that are identical up to renaming are matched instead.
+  void matchTopDown(bool IgnoreNames = false);
+
+  // Matches the pairs of subtrees of the same height that are renamings of
+  // each other, if neither has another renaming among them.
+  void matchRenamedSubtrees(ArrayRef<NodeId> H1, ArrayRef<NodeId> H2);
 
   // Tries to match any yet unmapped nodes, in a bottom-up fashion.
   void matchBottomUp();
@@ -153,8 +178,10 @@ using HashType = std::array<uint8_t, 16>;
 class SyntaxTree::Impl {
 public:
   Impl(SyntaxTree *Parent, ASTUnit &AST);
-  /// Constructs a tree from an AST node.
-  Impl(SyntaxTree *Parent, Decl *N, ASTUnit &AST);
+  /// Constructs a tree from an AST node. Filter, if given, applies to the
+  /// declarations in it.
+  Impl(SyntaxTree *Parent, Decl *N, ASTUnit &AST,
+       const TreeFilter *Filter = nullptr);
   Impl(SyntaxTree *Parent, Stmt *N, ASTUnit &AST);
   template <class T>
   Impl(SyntaxTree *Parent,
@@ -170,13 +197,115 @@ public:
   SyntaxTree *Parent;
   ASTUnit &AST;
   PrintingPolicy TypePP;
-  /// Nodes in preorder.
+  /// Nodes in preorder. The attributes of the node with id I are stored at
+  /// index I of the arrays that follow.
   std::vector<Node> Nodes;
+  std::vector<NodeId> Parents, LeftMostDescendants, RightMostDescendants;
+  std::vector<int> Depths, Heights;
+  std::vector<ast_type_traits::ASTNodeKind> Kinds;
+  std::vector<NodeKind> NodeKinds;
+  std::vector<DynTypedNode> ASTNodes;
+  /// The Decl that each node's parent is, or that the chain of Stmts above it
+  /// ends at, if any.
+  std::vector<NodeId> EnclosingDecls;
+  /// The children of node I are ChildIds[ChildOffsets[I]] up to, but not
+  /// including, ChildIds[ChildOffsets[I + 1]].
+  std::vector<NodeId> ChildIds;
+  std::vector<unsigned> ChildOffsets;
   NodeList Leaves;
   std::vector<int> PreorderToPostorderId;
   NodeList NodesBfs;
   NodeList NodesPostorder;
-  std::map<NodeId, SourceRange> TemplateArgumentLocations;
+  /// The source ranges of template arguments, sorted by NodeId because nodes
+  /// are added in preorder.
+  std::vector<std::pair<NodeId, SourceRange>> TemplateArgumentLocations;
+
+  /// Where a node is in its file, as offsets and as presumed line and column
+  /// of both ends of its source range.
+  struct NodeLocations {
+    std::pair<unsigned, unsigned> Offsets, Begin, End;
+  };
+  /// Indexed by NodeId. These take a while to compute, so they are filled in
+  /// on first use.
+  std::vector<CharSourceRange> SourceRanges;
+  std::vector<NodeLocations> Locations;
+  std::vector<bool> HasSourceRange, HasLocations;
+
+  CharSourceRange getSourceRange(NodeId Id);
+  const NodeLocations &getLocations(NodeId Id);
+
+  /// The offsets at which the lines of a file start.
+  struct LineIndex {
+    std::vector<unsigned> LineOffsets;
+    /// Set for files with #line directives or lone carriage returns, their
+    /// locations are left to the SourceManager.
+    bool UsePresumedLocs = false;
+  };
+  /// Built on first use, one for each file that nodes are in.
+  llvm::DenseMap<FileID, LineIndex> LineIndices;
+
+  const LineIndex &getLineIndex(FileID FID);
+  std::pair<unsigned, unsigned> getLineAndColumn(SourceLocation Loc);
+
+  /// A token as the raw lexer sees it.
+  struct FileToken {
+    unsigned Offset, Length;
+    tok::TokenKind Kind;
+    /// Comments and semicolons are left out of node hashes.
+    bool IsCommentOrSemi;
+  };
+  /// The tokens of a file in order, comments included.
+  struct TokenTable {
+    SourceLocation Start;
+    StringRef Buffer;
+    std::vector<FileToken> Tokens;
+  };
+  /// The tokens that start in a range, as a slice of a TokenTable.
+  struct TokenSpan {
+    SourceLocation Start;
+    StringRef Buffer;
+    ArrayRef<FileToken> Tokens;
+
+    SourceLocation getLocation(const FileToken &Tok) const {
+      return Start.getLocWithOffset(Tok.Offset);
+    }
+    StringRef getText(const FileToken &Tok) const {
+      return Buffer.substr(Tok.Offset, Tok.Length);
+    }
+    Token getToken(const FileToken &Tok) const;
+  };
+  /// Built on first use, one for each file that nodes are in. Every file is
+  /// lexed once, ranges are mapped to slices of its table by binary search.
+  llvm::DenseMap<FileID, TokenTable> TokenTables;
+
+  const TokenTable &getTokenTable(FileID FID);
+  TokenSpan getTokenSpan(CharSourceRange Range);
+  SourceLocation getNextTokenLocation(SourceLocation Loc);
+
+  /// The strings that the ids of this tree refer to.
+  TreeStrings InternedStrings;
+  /// Interned node attributes by NodeId, filled in on first use.
+  std::vector<StringId> LabelIds, ValueIds, IdentifierIds,
+      QualifiedIdentifierIds;
+
+  /// Hashes of the tokens that each node owns, and of whole subtrees, indexed
+  /// by NodeId. The hash of a subtree covers the kind, node hash and number
+  /// of children of its root, followed by the subtree hashes of the children.
+  std::vector<HashType> NodeHashes, SubtreeHashes;
+  HashKind HashedWith = HashKind::XXHash;
+
+  /// Fills NodeHashes and SubtreeHashes in postorder, unless that has been
+  /// done before with the same kind of hash.
+  void computeHashes(HashKind Kind);
+
+  /// Subtree hashes that leave out names, indexed by NodeId. Identifiers are
+  /// replaced by a placeholder and literals by their kind, so only the node
+  /// kinds, keywords and operators are left. Filled on first use.
+  std::vector<HashType> StructuralHashes;
+
+  void computeStructuralHashes();
+
+  size_t getMemoryUsage() const;
 
   int getSize() const { return Nodes.size(); }
   NodeRef getRoot() const { return getNode(getRootId()); }
@@ -190,12 +319,13 @@ public:
   }
 
   NodeRef getNode(NodeId Id) const { return Nodes[Id]; }
-  Node &getMutableNode(NodeRef N) { return Nodes[N.getId()]; }
-  Node &getMutableNode(NodeId Id) { return getMutableNode(getNode(Id)); }
+
+  /// Appends a node to the arrays, its descendants follow later.
+  NodeId addNode(const DynTypedNode &ASTNode, NodeId Parent, int Depth);
 
 private:
   void initTree();
-  void setLeftMostDescendants();
+  void setChildIds();
 };
 
 NodeRef NodeRefIterator::operator*() const { return Tree->getNode(*IdPointer); }
@@ -250,36 +380,157 @@ template <class T> static bool isNodeExcluded(ASTUnit &AST, T *N) {
   return isSpecializedNodeExcluded(N);
 }
 
+Error TreeFilter::addFileGlob(StringRef Pattern) {
+  Expected<GlobPattern> Glob = GlobPattern::create(Pattern);
+  if (!Glob)
+    return Glob.takeError();
+  FileGlobs.push_back(std::move(*Glob));
+  return Error::success();
+}
+
+// Returns true if D is written at the top level of its file.
+static bool isTopLevelDecl(const Decl *D) {
+  const DeclContext *DC = D->getLexicalDeclContext();
+  while (isa<LinkageSpecDecl>(DC))
+    DC = DC->getLexicalParent();
+  return DC->isTranslationUnit();
+}
+
+bool TreeFilter::excludes(const Decl *D, const SourceManager &SM) const {
+  if (isa<TranslationUnitDecl>(D))
+    return false;
+  if (!DeclNames.empty() && isTopLevelDecl(D)) {
+    auto *ND = dyn_cast<NamedDecl>(D);
+    // The declarations in an extern "C" block are checked one by one.
+    if (!ND)
+      return !isa<LinkageSpecDecl>(D);
+    if (!llvm::is_contained(DeclNames, ND->getNameAsString()) &&
+        !llvm::is_contained(DeclNames, ND->getQualifiedNameAsString()))
+      return true;
+  }
+  if (!MainFileOnly && FileGlobs.empty())
+    return false;
+  SourceLocation Loc = SM.getExpansionLoc(D->getLocation());
+  if (Loc.isInvalid() || (MainFileOnly && SM.isInMainFile(Loc)))
+    return false;
+  StringRef Filename = SM.getFilename(Loc);
+  return llvm::none_of(FileGlobs, [&](const GlobPattern &Glob) {
+    return Glob.match(Filename);
+  });
+}
+
+static NodeKind classifyNode(const DynTypedNode &ASTNode) {
+  if (ASTNode.getSourceRange().getBegin().isMacroID())
+    return NodeKind::Macro;
+  if (auto *D = ASTNode.get<Decl>()) {
+    switch (D->getKind()) {
+    case Decl::EnumConstant:
+      return NodeKind::EnumConstantDecl;
+    case Decl::Enum:
+      return NodeKind::EnumDecl;
+    case Decl::Field:
+      return NodeKind::FieldDecl;
+    case Decl::FileScopeAsm:
+      return NodeKind::FileScopeAsmDecl;
+    case Decl::Function:
+      return NodeKind::FunctionDecl;
+    case Decl::ParmVar:
+      return NodeKind::ParmVarDecl;
+    case Decl::Record:
+      return NodeKind::RecordDecl;
+    case Decl::Typedef:
+      return NodeKind::TypedefDecl;
+    case Decl::Var:
+      return NodeKind::VarDecl;
+    default:
+      return NodeKind::Other;
+    }
+  }
+  if (auto *S = ASTNode.get<Stmt>()) {
+    switch (S->getStmtClass()) {
+    case Stmt::ArraySubscriptExprClass:
+      return NodeKind::ArraySubscriptExpr;
+    case Stmt::BinaryOperatorClass:
+      return NodeKind::BinaryOperator;
+    case Stmt::CallExprClass:
+      return NodeKind::CallExpr;
+    case Stmt::CaseStmtClass:
+      return NodeKind::CaseStmt;
+    case Stmt::CompoundStmtClass:
+      return NodeKind::CompoundStmt;
+    case Stmt::CStyleCastExprClass:
+      return NodeKind::CStyleCastExpr;
+    case Stmt::DeclRefExprClass:
+      return NodeKind::DeclRefExpr;
+    case Stmt::DeclStmtClass:
+      return NodeKind::DeclStmt;
+    case Stmt::IfStmtClass:
+      return NodeKind::IfStmt;
+    case Stmt::InitListExprClass:
+      return NodeKind::InitListExpr;
+    case Stmt::IntegerLiteralClass:
+      return NodeKind::IntegerLiteral;
+    case Stmt::MemberExprClass:
+      return NodeKind::MemberExpr;
+    default:
+      return NodeKind::Other;
+    }
+  }
+  return NodeKind::Other;
+}
+
+NodeId SyntaxTree::Impl::addNode(const DynTypedNode &ASTNode, NodeId Parent,
+                                 int Depth) {
+  NodeId Id = getSize();
+  Nodes.emplace_back(*this);
+  Parents.push_back(Parent);
+  LeftMostDescendants.emplace_back();
+  RightMostDescendants.emplace_back();
+  PreorderToPostorderId.emplace_back();
+  Depths.push_back(Depth);
+  Heights.push_back(1);
+  Kinds.push_back(ASTNode.getNodeKind());
+  NodeKinds.push_back(classifyNode(ASTNode));
+  ASTNodes.push_back(ASTNode);
+  NodeId EnclosingDecl;
+  // Like the walk over the parent map that this replaces, only statements lead
+  // up to a declaration. Below a constructor initializer or a type location
+  // there is none, so names there keep their qualifiers.
+  if (Parent.isValid()) {
+    if (ASTNodes[Parent].get<Decl>())
+      EnclosingDecl = Parent;
+    else if (ASTNodes[Parent].get<Stmt>())
+      EnclosingDecl = EnclosingDecls[Parent];
+  }
+  EnclosingDecls.push_back(EnclosingDecl);
+  return Id;
+}
+
 namespace {
-// Sets Height, Parent and Children for each node.
+// Sets Height, Parent, the descendant bounds and the postorder id of each node,
+// and collects the leaves and the postorder list.
 struct PreorderVisitor
     : public LexicallyOrderedRecursiveASTVisitor<PreorderVisitor> {
   using BaseType = LexicallyOrderedRecursiveASTVisitor<PreorderVisitor>;
 
-  int Id = 0, Depth = 0;
+  int Id = 0, Depth = 0, PostorderId = 0;
   NodeId Parent;
   SyntaxTree::Impl &Tree;
+  const TreeFilter *Filter;
 
-  PreorderVisitor(SyntaxTree::Impl &Tree)
-      : BaseType(Tree.AST.getSourceManager()), Tree(Tree) {}
+  PreorderVisitor(SyntaxTree::Impl &Tree, const TreeFilter *Filter = nullptr)
+      : BaseType(Tree.AST.getSourceManager()), Tree(Tree), Filter(Filter) {}
 
   template <class T> std::tuple<NodeId, NodeId> PreTraverse(const T &ASTNode) {
-    NodeId MyId = Id;
-    Tree.Nodes.emplace_back(Tree);
-    Node &N = Tree.getMutableNode(MyId);
-    N.Parent = Parent;
-    N.Depth = Depth;
-    N.ASTNode = DynTypedNode::create(ASTNode);
-    assert(!N.ASTNode.getNodeKind().isNone() &&
+    NodeId MyId = Tree.addNode(DynTypedNode::create(ASTNode), Parent, Depth);
+    assert(MyId == Id && "Nodes must be added in preorder.");
+    assert(!Tree.Kinds[MyId].isNone() &&
            "Expected nodes to have a valid kind.");
-    if (Parent.isValid()) {
-      Node &P = Tree.getMutableNode(Parent);
-      P.Children.push_back(MyId);
-    }
+    NodeId PreviousParent = Parent;
     Parent = MyId;
     ++Id;
     ++Depth;
-    return std::make_tuple(MyId, Tree.getNode(MyId).Parent);
+    return std::make_tuple(MyId, PreviousParent);
   }
   void PostTraverse(std::tuple<NodeId, NodeId> State) {
     NodeId MyId, PreviousParent;
@@ -287,19 +538,27 @@ struct PreorderVisitor
     assert(MyId.isValid() && "Expecting to only traverse valid nodes.");
     Parent = PreviousParent;
     --Depth;
-    Node &N = Tree.getMutableNode(MyId);
-    N.RightMostDescendant = Id - 1;
-    assert(N.RightMostDescendant >= Tree.getRootId() &&
-           N.RightMostDescendant < Tree.getSize() &&
+    NodeId RightMostDescendant = Id - 1;
+    assert(RightMostDescendant >= Tree.getRootId() &&
+           RightMostDescendant < Tree.getSize() &&
            "Rightmost descendant must be a valid tree node.");
-    if (N.isLeaf())
+    Tree.RightMostDescendants[MyId] = RightMostDescendant;
+    // The first child, if any, directly follows its parent in preorder.
+    bool IsLeaf = RightMostDescendant == MyId;
+    Tree.LeftMostDescendants[MyId] =
+        IsLeaf ? MyId : Tree.LeftMostDescendants[MyId + 1];
+    if (IsLeaf)
       Tree.Leaves.push_back(MyId);
-    N.Height = 1;
-    for (NodeId Child : N.Children)
-      N.Height = std::max(N.Height, 1 + Tree.getNode(Child).Height);
+    Tree.PreorderToPostorderId[MyId] = PostorderId++;
+    Tree.NodesPostorder.push_back(MyId);
+    // The children are done by now, so the height of this node is final.
+    if (Parent.isValid())
+      Tree.Heights[Parent] =
+          std::max(Tree.Heights[Parent], 1 + Tree.Heights[MyId]);
   }
   bool TraverseDecl(Decl *D) {
-    if (isNodeExcluded(Tree.AST, D))
+    if (isNodeExcluded(Tree.AST, D) ||
+        (Filter && Filter->excludes(D, Tree.AST.getSourceManager())))
       return true;
     auto SavedState = PreTraverse(*D);
     BaseType::TraverseDecl(D);
@@ -341,7 +600,7 @@ struct PreorderVisitor
   bool TraverseTemplateArgumentLoc(const TemplateArgumentLoc &ArgLoc) {
     if (isNodeExcluded(Tree.AST, &ArgLoc))
       return true;
-    Tree.TemplateArgumentLocations.emplace(Id, ArgLoc.getSourceRange());
+    Tree.TemplateArgumentLocations.emplace_back(Id, ArgLoc.getSourceRange());
     auto SavedState = PreTraverse(ArgLoc.getArgument());
     BaseType::TraverseTemplateArgumentLoc(ArgLoc);
     PostTraverse(SavedState);
@@ -364,9 +623,10 @@ SyntaxTree::Impl::Impl(SyntaxTree *Parent, ASTUnit &AST)
   TypePP.AnonymousTagLocations = false;
 }
 
-SyntaxTree::Impl::Impl(SyntaxTree *Parent, Decl *N, ASTUnit &AST)
+SyntaxTree::Impl::Impl(SyntaxTree *Parent, Decl *N, ASTUnit &AST,
+                       const TreeFilter *Filter)
     : Impl(Parent, AST) {
-  PreorderVisitor PreorderWalker(*this);
+  PreorderVisitor PreorderWalker(*this, Filter);
   PreorderWalker.TraverseDecl(N);
   initTree();
 }
@@ -378,14 +638,8 @@ SyntaxTree::Impl::Impl(SyntaxTree *Parent, Stmt *N, ASTUnit &AST)
   initTree();
 }
 
-static void getSubtreePostorder(NodeList &Ids, NodeRef Root) {
-  std::function<void(NodeRef)> Traverse = [&](NodeRef N) {
-    for (NodeRef Child : N)
-      Traverse(Child);
-    Ids.push_back(N.getId());
-  };
-  Traverse(Root);
-}
+// Marks the attributes that have not been interned yet.
+static const StringId NotInterned = std::numeric_limits<StringId>::max();
 
 static void getSubtreeBfs(NodeList &Ids, NodeRef Root) {
   size_t Expanded = 0;
@@ -395,63 +649,165 @@ static void getSubtreeBfs(NodeList &Ids, NodeRef Root) {
       Ids.push_back(Child.getId());
 }
 
+// Everything that can be computed during the traversal already is, what is
+// left needs the finished child lists.
 void SyntaxTree::Impl::initTree() {
-  setLeftMostDescendants();
-  int PostorderId = 0;
-  PreorderToPostorderId.resize(getSize());
-  std::function<void(NodeRef)> PostorderTraverse = [&](NodeRef N) {
-    for (NodeRef Child : N)
-      PostorderTraverse(Child);
-    PreorderToPostorderId[N.getId()] = PostorderId;
-    ++PostorderId;
-  };
-  PostorderTraverse(getRoot());
+  setChildIds();
   getSubtreeBfs(NodesBfs, getRoot());
-  getSubtreePostorder(NodesPostorder, getRoot());
-}
-
-void SyntaxTree::Impl::setLeftMostDescendants() {
-  for (NodeRef Leaf : Leaves) {
-    getMutableNode(Leaf).LeftMostDescendant = Leaf.getId();
-    const Node *Parent, *Cur = &Leaf;
-    while ((Parent = Cur->getParent()) && &Parent->getChild(0) == Cur) {
-      Cur = Parent;
-      getMutableNode(*Cur).LeftMostDescendant = Leaf.getId();
-    }
-  }
+  SourceRanges.resize(getSize());
+  Locations.resize(getSize());
+  HasSourceRange.resize(getSize());
+  HasLocations.resize(getSize());
+  LabelIds.assign(getSize(), NotInterned);
+  ValueIds.assign(getSize(), NotInterned);
+  IdentifierIds.assign(getSize(), NotInterned);
+  QualifiedIdentifierIds.assign(getSize(), NotInterned);
+}
+
+// Groups the children by parent. Children are visited in preorder, so each
+// group ends up sorted.
+void SyntaxTree::Impl::setChildIds() {
+  ChildOffsets.assign(getSize() + 1, 0);
+  for (NodeId Parent : Parents)
+    if (Parent.isValid())
+      ++ChildOffsets[Parent + 1];
+  for (int I = 0, E = getSize(); I < E; ++I)
+    ChildOffsets[I + 1] += ChildOffsets[I];
+  ChildIds.resize(ChildOffsets.back());
+  std::vector<unsigned> Next(ChildOffsets.begin(), ChildOffsets.end() - 1);
+  for (int I = 0, E = getSize(); I < E; ++I)
+    if (Parents[I].isValid())
+      ChildIds[Next[Parents[I]]++] = I;
 }
 
 static int getNumberOfDescendants(NodeRef N) {
-  return N.RightMostDescendant - N.getId() + 1;
+  return N.getRightMostDescendant() - N.getId() + 1;
 }
 
-static bool isInSubtree(NodeRef N, NodeRef SubtreeRoot) {
-  return N.getId() >= SubtreeRoot.getId() &&
-         N.getId() <= SubtreeRoot.RightMostDescendant;
+// Hashes Data in one go. XXHash fills the first eight bytes of the result.
+static HashType hashBytes(HashKind Kind, StringRef Data) {
+  HashType Result{};
+  switch (Kind) {
+  case HashKind::XXHash: {
+    uint64_t Hash = llvm::xxHash64(Data);
+    std::memcpy(Result.data(), &Hash, sizeof(Hash));
+    break;
+  }
+  case HashKind::MD5: {
+    llvm::MD5 Hash;
+    Hash.update(Data);
+    llvm::MD5::MD5Result HashResult;
+    Hash.final(HashResult);
+    Result = HashResult;
+    break;
+  }
+  }
+  return Result;
+}
+
+static HashType hashNode(NodeRef N, HashKind Kind) {
+  // The text of the tokens is collected first, hashing many small pieces is
+  // slow.
+  SmallString<128> Text;
+  for (CharSourceRange Range : N.getOwnedSourceRanges()) {
+    SyntaxTree::Impl::TokenSpan Span = N.Tree.getTokenSpan(Range);
+    for (const SyntaxTree::Impl::FileToken &Tok : Span.Tokens) {
+      // Commas are list separators, which getOwnedTokens() leaves out too.
+      // Comments and semicolons are left out to make CompoundStmt nodes
+      // compare equal, to make the tests pass. It should be changed to
+      // include changes to comments.
+      if (Tok.Kind != tok::comma && !Tok.IsCommentOrSemi)
+        Text += Span.getText(Tok);
+    }
+  }
+  return hashBytes(Kind, Text);
+}
+
+// Returns true if Name is spelled like a keyword of any language mode. The raw
+// lexer does not tell keywords from identifiers.
+static bool isKeyword(StringRef Name) {
+  static const llvm::StringSet<> Keywords = [] {
+    llvm::StringSet<> Keywords;
+#define KEYWORD(NAME, FLAGS) Keywords.insert(#NAME);
+#define ALIAS(NAME, KIND, FLAGS) Keywords.insert(NAME);
+#define CXX_KEYWORD_OPERATOR(NAME, KIND) Keywords.insert(#NAME);
+#include "clang/Basic/TokenKinds.def"
+    return Keywords;
+  }();
+  return Keywords.count(Name);
+}
+
+// Like hashNode(), but names do not count.
+static HashType hashNodeStructure(NodeRef N, HashKind Kind) {
+  SmallString<128> Text;
+  for (CharSourceRange Range : N.getOwnedSourceRanges()) {
+    SyntaxTree::Impl::TokenSpan Span = N.Tree.getTokenSpan(Range);
+    for (const SyntaxTree::Impl::FileToken &Tok : Span.Tokens) {
+      if (Tok.Kind == tok::comma || Tok.IsCommentOrSemi)
+        continue;
+      StringRef TokText = Span.getText(Tok);
+      if (Tok.Kind == tok::raw_identifier && !isKeyword(TokText))
+        Text += "$";
+      else if (tok::isLiteral(Tok.Kind))
+        Text += tok::getTokenName(Tok.Kind);
+      else
+        Text += TokText;
+      // Placeholders must not run into their neighbours.
+      Text += ' ';
+    }
+  }
+  return hashBytes(Kind, Text);
 }
 
-static HashType hashNode(NodeRef N) {
-  llvm::MD5 Hash;
-  SourceManager &SM = N.getTree().getSourceManager();
-  const LangOptions &LangOpts = N.getTree().getLangOpts();
-  Token Tok;
-  for (auto TokenLocation : N.getOwnedTokens()) {
-    // bool Failure = Lexer::getRawToken(TokenLocation, Tok, SM, LangOpts,/*IgnoreWhiteSpace=*/true);
-    assert(!Failure);
-    auto Range = CharSourceRange::getCharRange(TokenLocation, Tok.getEndLoc());
-    // This is here to make CompoundStmt nodes compare equal, to make the tests
-    // pass. It should be changed to include changes to comments.
-    if (!Tok.isOneOf(tok::comment, tok::semi))
-      Hash.update(Lexer::getSourceText(Range, SM, LangOpts));
+// Hashes the kind, node hash and number of children of N, followed by the
+// subtree hashes of its children.
+static HashType hashSubtree(NodeRef N, const HashType &NodeHash,
+                            const std::vector<HashType> &SubtreeHashes,
+                            HashKind Kind) {
+  auto Append = [](SmallString<128> &Data, const void *Bytes, size_t Size) {
+    Data.append(StringRef(static_cast<const char *>(Bytes), Size));
+  };
+  // Macro nodes are matched whatever their kind, see
+  // ComparisonOptions::isMatchingAllowed().
+  SmallString<128> Data(N.isMacro() ? StringRef("Macro")
+                                    : N.Tree.Kinds[N.getId()].asStringRef());
+  Append(Data, NodeHash.data(), sizeof(HashType));
+  uint32_t NumChildren = N.getNumChildren();
+  Append(Data, &NumChildren, sizeof(NumChildren));
+  for (NodeRef Child : N)
+    Append(Data, SubtreeHashes[Child.getId()].data(), sizeof(HashType));
+  return hashBytes(Kind, Data);
+}
+
+void SyntaxTree::Impl::computeHashes(HashKind Kind) {
+  if (!SubtreeHashes.empty() && HashedWith == Kind)
+    return;
+  HashedWith = Kind;
+  NodeHashes.resize(getSize());
+  SubtreeHashes.resize(getSize());
+  StructuralHashes.clear();
+  // Children come before their parents in postorder.
+  for (NodeRef N : postorder()) {
+    NodeId Id = N.getId();
+    NodeHashes[Id] = hashNode(N, Kind);
+    SubtreeHashes[Id] = hashSubtree(N, NodeHashes[Id], SubtreeHashes, Kind);
   }
-  llvm::MD5::MD5Result HashResult;
-  Hash.final(HashResult);
-  return HashResult;
+}
+
+void SyntaxTree::Impl::computeStructuralHashes() {
+  if (!StructuralHashes.empty())
+    return;
+  StructuralHashes.resize(getSize());
+  for (NodeRef N : postorder())
+    StructuralHashes[N.getId()] =
+        hashSubtree(N, hashNodeStructure(N, HashedWith), StructuralHashes,
+                    HashedWith);
 }
 
 static bool areNodesDifferent(NodeRef N1, NodeRef N2) {
-  return hashNode(N1) != hashNode(N2);
+  return N1.Tree.NodeHashes[N1.getId()] != N2.Tree.NodeHashes[N2.getId()];
 }
+
 /// Identifies a node in a subtree by its postorder offset, starting at 1.
 struct SNodeId {
   int Id = 0;
@@ -491,7 +847,7 @@ public:
   }
   NodeId getPostorderIdInRoot(SNodeId Id = SNodeId(1)) const {
     assert(Id > 0 && Id <= getSize() && "Invalid subtree node index.");
-    return Id - 1 + Tree.PreorderToPostorderId[Root.LeftMostDescendant];
+    return Id - 1 + Tree.PreorderToPostorderId[Root.getLeftMostDescendant()];
   }
 
 private:
@@ -508,7 +864,7 @@ private:
              "Postorder traversal in subtree should correspond to traversal in "
              "the root tree by a constant offset.");
       LeftMostDescendants[I] =
-          SNodeId(Tree.PreorderToPostorderId[N.LeftMostDescendant] -
+          SNodeId(Tree.PreorderToPostorderId[N.getLeftMostDescendant()] -
                   getPostorderIdInRoot());
     }
     return NumLeaves;
@@ -662,17 +1018,38 @@ private:
 NodeId Node::getId() const { return this - &Tree.getRoot(); }
 SyntaxTree &Node::getTree() const { return *Tree.Parent; }
 const Node *Node::getParent() const {
+  NodeId Parent = getParentId();
   if (Parent.isInvalid())
     return nullptr;
   return &Tree.getNode(Parent);
 }
 
+NodeId Node::getParentId() const { return Tree.Parents[getId()]; }
+NodeId Node::getLeftMostDescendant() const {
+  return Tree.LeftMostDescendants[getId()];
+}
+NodeId Node::getRightMostDescendant() const {
+  return Tree.RightMostDescendants[getId()];
+}
+int Node::getDepth() const { return Tree.Depths[getId()]; }
+int Node::getHeight() const { return Tree.Heights[getId()]; }
+const DynTypedNode &Node::getASTNode() const { return Tree.ASTNodes[getId()]; }
+
+ArrayRef<NodeId> Node::getChildIds() const {
+  NodeId Id = getId();
+  return makeArrayRef(Tree.ChildIds.data() + Tree.ChildOffsets[Id],
+                      Tree.ChildIds.data() + Tree.ChildOffsets[Id + 1]);
+}
+
 NodeRef Node::getChild(size_t Index) const {
-  return Tree.getNode(Children[Index]);
+  return Tree.getNode(getChildIds()[Index]);
 }
 
+size_t Node::getNumChildren() const { return getChildIds().size(); }
+bool Node::isLeaf() const { return getRightMostDescendant() == getId(); }
+
 ast_type_traits::ASTNodeKind Node::getType() const {
-  return ASTNode.getNodeKind();
+  return Tree.Kinds[getId()];
 }
 
 StringRef Node::getTypeLabel() const {
@@ -681,14 +1058,14 @@ StringRef Node::getTypeLabel() const {
   return getType().asStringRef();
 }
 
-bool Node::isMacro() const {
-  return ASTNode.getSourceRange().getBegin().isMacroID();
-}
+NodeKind Node::getKind() const { return Tree.NodeKinds[getId()]; }
+
+bool Node::isMacro() const { return getKind() == NodeKind::Macro; }
 
 llvm::Optional<std::string> Node::getQualifiedIdentifier() const {
   if (isMacro())
     return llvm::None;
-  if (auto *ND = ASTNode.get<NamedDecl>()) {
+  if (auto *ND = getASTNode().get<NamedDecl>()) {
     if (ND->getDeclName().isIdentifier())
       return ND->getQualifiedNameAsString();
     else
@@ -700,7 +1077,7 @@ llvm::Optional<std::string> Node::getQualifiedIdentifier() const {
 llvm::Optional<StringRef> Node::getIdentifier() const {
   if (isMacro())
     return llvm::None;
-  if (auto *ND = ASTNode.get<NamedDecl>()) {
+  if (auto *ND = getASTNode().get<NamedDecl>()) {
     if (ND->getDeclName().isIdentifier())
       return ND->getName();
     else
@@ -709,6 +1086,40 @@ llvm::Optional<StringRef> Node::getIdentifier() const {
   return llvm::None;
 }
 
+StringId Node::getLabelId() const {
+  StringId &Id = Tree.LabelIds[getId()];
+  if (Id == NotInterned)
+    Id = Tree.InternedStrings.intern(getTypeLabel());
+  return Id;
+}
+
+StringId Node::getValueId() const {
+  StringId &Id = Tree.ValueIds[getId()];
+  if (Id == NotInterned)
+    Id = Tree.InternedStrings.intern(getValue());
+  return Id;
+}
+
+StringId Node::getIdentifierId() const {
+  StringId &Id = Tree.IdentifierIds[getId()];
+  if (Id == NotInterned) {
+    auto Identifier = getIdentifier();
+    Id = Identifier ? Tree.InternedStrings.intern(*Identifier)
+                    : StringTable::NoString;
+  }
+  return Id;
+}
+
+StringId Node::getQualifiedIdentifierId() const {
+  StringId &Id = Tree.QualifiedIdentifierIds[getId()];
+  if (Id == NotInterned) {
+    auto Identifier = getQualifiedIdentifier();
+    Id = Identifier ? Tree.InternedStrings.intern(*Identifier)
+                    : StringTable::NoString;
+  }
+  return Id;
+}
+
 
 static std::string getInitializerValue(const CXXCtorInitializer *Init, const PrintingPolicy &TypePP) {
   if (Init->isAnyMemberInitializer())
@@ -764,13 +1175,13 @@ std::string Node::getValue() const {
 
   if (isMacro())
     return getMacroValue();
-  if (auto *S = ASTNode.get<Stmt>())
+  if (auto *S = getASTNode().get<Stmt>())
     return getStmtValue(S);
-  if (auto *D = ASTNode.get<Decl>())
+  if (auto *D = getASTNode().get<Decl>())
     return getDeclValue(D);
-  if (auto *T = ASTNode.get<TypeLoc>())
+  if (auto *T = getASTNode().get<TypeLoc>())
     return getTypeValue(T);
-  if (auto *Init = ASTNode.get<CXXCtorInitializer>())
+  if (auto *Init = getASTNode().get<CXXCtorInitializer>())
     return getInitializerValue(Init, Tree.TypePP);
   return "";
 
@@ -813,17 +1224,11 @@ std::string Node::getDeclValue(const Decl *D) const {
   return Value;
 }
 
-const DeclContext *Node::getEnclosingDeclContext(ASTContext &AST, const Stmt *S) const {
-  while (S) {
-    const auto &Parents = AST.getParents(*S);
-    if (Parents.empty())
-      return nullptr;
-    const auto &P = Parents[0];
-    if (const auto *D = P.get<Decl>())
-      return D->getDeclContext();
-    S = P.get<Stmt>();
-  }
-  return nullptr;
+const DeclContext *Node::getEnclosingDeclContext() const {
+  NodeId EnclosingDecl = Tree.EnclosingDecls[getId()];
+  if (EnclosingDecl.isInvalid())
+    return nullptr;
+  return Tree.getNode(EnclosingDecl).getASTNode().get<Decl>()->getDeclContext();
 }
 
 std::string Node::getStmtValue(const Stmt *S) const {
@@ -844,7 +1249,7 @@ std::string Node::getStmtValue(const Stmt *S) const {
     return Str.str();
   }
   if (auto *D = dyn_cast<DeclRefExpr>(S))
-    return getRelativeName(D->getDecl(), getEnclosingDeclContext(Tree.AST.getASTContext(), S));
+    return getRelativeName(D->getDecl(), getEnclosingDeclContext());
   if (auto *String = dyn_cast<StringLiteral>(S))
     return String->getString();
   if (auto *B = dyn_cast<CXXBoolLiteralExpr>(S))
@@ -854,22 +1259,22 @@ std::string Node::getStmtValue(const Stmt *S) const {
 
 
 NodeRefIterator Node::begin() const {
-  return {&Tree, isLeaf() ? nullptr : &Children[0]};
+  return {&Tree, getChildIds().begin()};
 }
 NodeRefIterator Node::end() const {
-  return {&Tree, isLeaf() ? nullptr : &Children[0] + Children.size()};
+  return {&Tree, getChildIds().end()};
 }
 
 int Node::findPositionInParent() const {
   if (!getParent())
     return 0;
-  const ArrayRef<NodeId> &Siblings = getParent()->Children;
+  ArrayRef<NodeId> Siblings = getParent()->getChildIds();
   return std::find(Siblings.begin(), Siblings.end(), getId()) -
          Siblings.begin();
 }
 
 static SourceRange getSourceRangeImpl(NodeRef N) {
-  const DynTypedNode &DTN = N.ASTNode;
+  const DynTypedNode &DTN = N.getASTNode();
   SyntaxTree::Impl &Tree = N.Tree;
   SourceManager &SM = Tree.AST.getSourceManager();
   const LangOptions &LangOpts = Tree.AST.getLangOpts();
@@ -899,7 +1304,7 @@ static SourceRange getSourceRangeImpl(NodeRef N) {
   } else if (DTN.get<DeclStmt>() || DTN.get<FieldDecl>() ||
              DTN.get<VarDecl>() ||
              (DTN.get<CallExpr>() &&
-              N.getParent()->ASTNode.get<CompoundStmt>()) ||
+              N.getParent()->getASTNode().get<CompoundStmt>()) ||
              (DTN.get<FunctionDecl>() &&
               !DTN.get<FunctionDecl>()->isThisDeclarationADefinition()) ||
              DTN.get<TypeDecl>() || DTN.get<UsingDirectiveDecl>() ||
@@ -916,36 +1321,244 @@ static SourceRange getSourceRangeImpl(NodeRef N) {
   return TokenToCharRange(Range);
 }
 
+// A precompiled preamble is loaded as a file of its own, whose text is the
+// start of the main file. It may have been built from another file that starts
+// the same way. Locations in it are moved to the same offset in the main file,
+// like ASTUnit::mapLocationFromPreamble() does.
+static SourceLocation mapLocationFromPreamble(const SourceManager &SM,
+                                              SourceLocation Loc) {
+  FileID PreambleID = SM.getPreambleFileID();
+  unsigned Offset;
+  if (Loc.isInvalid() || PreambleID.isInvalid() ||
+      !SM.isInFileID(Loc, PreambleID, &Offset))
+    return Loc;
+  return SM.getLocForStartOfFile(SM.getMainFileID()).getLocWithOffset(Offset);
+}
+
+CharSourceRange SyntaxTree::Impl::getSourceRange(NodeId Id) {
+  if (!HasSourceRange[Id]) {
+    const SourceManager &SM = AST.getSourceManager();
+    SourceRange Range = getSourceRangeImpl(getNode(Id));
+    SourceRanges[Id] = CharSourceRange::getCharRange(
+        mapLocationFromPreamble(SM, Range.getBegin()),
+        mapLocationFromPreamble(SM, Range.getEnd()));
+    HasSourceRange[Id] = true;
+  }
+  return SourceRanges[Id];
+}
+
+static std::pair<unsigned, unsigned>
+getPresumedLineAndColumn(const SourceManager &SM, SourceLocation Loc) {
+  PresumedLoc PLoc = SM.getPresumedLoc(Loc);
+  if (PLoc.isInvalid())
+    return {0, 0};
+  return {PLoc.getLine(), PLoc.getColumn()};
+}
+
+const SyntaxTree::Impl::LineIndex &
+SyntaxTree::Impl::getLineIndex(FileID FID) {
+  auto Inserted = LineIndices.try_emplace(FID);
+  LineIndex &Index = Inserted.first->second;
+  if (!Inserted.second)
+    return Index;
+  const SourceManager &SM = AST.getSourceManager();
+  bool InvalidEntry = false, InvalidBuffer = false;
+  const SrcMgr::SLocEntry &Entry = SM.getSLocEntry(FID, &InvalidEntry);
+  StringRef Buffer = SM.getBufferData(FID, &InvalidBuffer);
+  if (InvalidEntry || InvalidBuffer || !Entry.isFile() ||
+      Entry.getFile().hasLineDirectives()) {
+    Index.UsePresumedLocs = true;
+    return Index;
+  }
+  // memchr() is vectorized by the C library, so this is much faster than
+  // looking at one character at a time.
+  const char *Begin = Buffer.data(), *End = Begin + Buffer.size();
+  Index.LineOffsets.push_back(0);
+  for (const char *P = Begin;
+       (P = static_cast<const char *>(std::memchr(P, '\n', End - P)));
+       ++P)
+    Index.LineOffsets.push_back(P - Begin + 1);
+  // The SourceManager also ends a line at a carriage return that is not
+  // followed by a newline.
+  for (const char *P = Begin;
+       (P = static_cast<const char *>(std::memchr(P, '\r', End - P)));
+       ++P) {
+    if (P + 1 == End || P[1] != '\n') {
+      Index.UsePresumedLocs = true;
+      break;
+    }
+  }
+  return Index;
+}
+
+// Gives the same result as getPresumedLineAndColumn(), with a binary search
+// instead of a walk through the line table of the SourceManager.
+std::pair<unsigned, unsigned>
+SyntaxTree::Impl::getLineAndColumn(SourceLocation Loc) {
+  const SourceManager &SM = AST.getSourceManager();
+  if (Loc.isInvalid())
+    return {0, 0};
+  std::pair<FileID, unsigned> Decomposed = SM.getDecomposedExpansionLoc(Loc);
+  const LineIndex &Index = getLineIndex(Decomposed.first);
+  if (Index.UsePresumedLocs)
+    return getPresumedLineAndColumn(SM, Loc);
+  const std::vector<unsigned> &Lines = Index.LineOffsets;
+  unsigned Line = std::upper_bound(Lines.begin(), Lines.end(),
+                                   Decomposed.second) -
+                  Lines.begin();
+  return {Line, Decomposed.second - Lines[Line - 1] + 1};
+}
+
+const SyntaxTree::Impl::TokenTable &
+SyntaxTree::Impl::getTokenTable(FileID FID) {
+  auto Inserted = TokenTables.try_emplace(FID);
+  TokenTable &Table = Inserted.first->second;
+  if (!Inserted.second)
+    return Table;
+  const SourceManager &SM = AST.getSourceManager();
+  bool Invalid = false;
+  StringRef Buffer = SM.getBufferData(FID, &Invalid);
+  if (Invalid)
+    return Table;
+  Table.Start = SM.getLocForStartOfFile(FID);
+  Table.Buffer = Buffer;
+  // Comments are kept, as they are by Lexer::getRawToken().
+  Lexer Lex(Table.Start, AST.getLangOpts(), Buffer.begin(), Buffer.begin(),
+            Buffer.end());
+  Lex.SetCommentRetentionState(true);
+  Token Tok;
+  for (Lex.LexFromRawLexer(Tok); Tok.isNot(tok::eof); Lex.LexFromRawLexer(Tok))
+    Table.Tokens.push_back({SM.getFileOffset(Tok.getLocation()),
+                            Tok.getLength(), Tok.getKind(),
+                            Tok.isOneOf(tok::comment, tok::semi)});
+  return Table;
+}
+
+static bool startsBefore(const SyntaxTree::Impl::FileToken &Tok,
+                         unsigned Offset) {
+  return Tok.Offset < Offset;
+}
+
+SyntaxTree::Impl::TokenSpan
+SyntaxTree::Impl::getTokenSpan(CharSourceRange Range) {
+  TokenSpan Span;
+  SourceLocation Begin = Range.getBegin(), End = Range.getEnd();
+  if (Begin.isInvalid() || End.isInvalid())
+    return Span;
+  const SourceManager &SM = AST.getSourceManager();
+  std::pair<FileID, unsigned> BeginLoc = SM.getDecomposedExpansionLoc(Begin),
+                              EndLoc = SM.getDecomposedExpansionLoc(End);
+  const TokenTable &Table = getTokenTable(BeginLoc.first);
+  ArrayRef<FileToken> Tokens = Table.Tokens;
+  size_t First = std::lower_bound(Tokens.begin(), Tokens.end(),
+                                  BeginLoc.second, startsBefore) -
+                 Tokens.begin();
+  size_t Last = Tokens.size();
+  // A range that ends in a later file takes the rest of this one.
+  if (EndLoc.first == BeginLoc.first)
+    Last = std::lower_bound(Tokens.begin() + First, Tokens.end(),
+                            EndLoc.second, startsBefore) -
+           Tokens.begin();
+  else if (!SM.isBeforeInTranslationUnit(Begin, End))
+    Last = First;
+  Span.Start = Table.Start;
+  Span.Buffer = Table.Buffer;
+  Span.Tokens = Tokens.slice(First, Last - First);
+  return Span;
+}
+
+SourceLocation SyntaxTree::Impl::getNextTokenLocation(SourceLocation Loc) {
+  if (Loc.isInvalid())
+    return Loc;
+  std::pair<FileID, unsigned> Decomposed =
+      AST.getSourceManager().getDecomposedExpansionLoc(Loc);
+  const TokenTable &Table = getTokenTable(Decomposed.first);
+  if (Table.Start.isInvalid())
+    return SourceLocation();
+  auto It = std::lower_bound(Table.Tokens.begin(), Table.Tokens.end(),
+                             Decomposed.second, startsBefore);
+  return Table.Start.getLocWithOffset(
+      It == Table.Tokens.end() ? Table.Buffer.size() : It->Offset);
+}
+
+Token SyntaxTree::Impl::TokenSpan::getToken(const FileToken &FileTok) const {
+  Token Tok;
+  Tok.startToken();
+  Tok.setKind(FileTok.Kind);
+  Tok.setLocation(getLocation(FileTok));
+  Tok.setLength(FileTok.Length);
+  const char *Data = Buffer.data() + FileTok.Offset;
+  if (Tok.is(tok::raw_identifier))
+    Tok.setRawIdentifierData(Data);
+  else if (Tok.isLiteral())
+    Tok.setLiteralData(Data);
+  return Tok;
+}
+
+template <class T> static size_t getCapacityInBytes(const std::vector<T> &V) {
+  return V.capacity() * sizeof(T);
+}
+static size_t getCapacityInBytes(const std::vector<bool> &V) {
+  return V.capacity() / CHAR_BIT;
+}
+
+size_t SyntaxTree::Impl::getMemoryUsage() const {
+  size_t Size =
+      getCapacityInBytes(Nodes) + getCapacityInBytes(Parents) +
+      getCapacityInBytes(LeftMostDescendants) +
+      getCapacityInBytes(RightMostDescendants) + getCapacityInBytes(Depths) +
+      getCapacityInBytes(Heights) + getCapacityInBytes(Kinds) +
+      getCapacityInBytes(NodeKinds) + getCapacityInBytes(ASTNodes) +
+      getCapacityInBytes(EnclosingDecls) + getCapacityInBytes(ChildIds) +
+      getCapacityInBytes(ChildOffsets) + getCapacityInBytes(Leaves.Ids) +
+      getCapacityInBytes(PreorderToPostorderId) +
+      getCapacityInBytes(NodesBfs.Ids) +
+      getCapacityInBytes(NodesPostorder.Ids) +
+      getCapacityInBytes(TemplateArgumentLocations) +
+      getCapacityInBytes(SourceRanges) + getCapacityInBytes(Locations) +
+      getCapacityInBytes(HasSourceRange) + getCapacityInBytes(HasLocations) +
+      getCapacityInBytes(LabelIds) + getCapacityInBytes(ValueIds) +
+      getCapacityInBytes(IdentifierIds) +
+      getCapacityInBytes(QualifiedIdentifierIds) +
+      getCapacityInBytes(NodeHashes) + getCapacityInBytes(SubtreeHashes) +
+      getCapacityInBytes(StructuralHashes) + InternedStrings.getMemoryUsage() +
+      LineIndices.getMemorySize() + TokenTables.getMemorySize();
+  for (const auto &Entry : LineIndices)
+    Size += getCapacityInBytes(Entry.second.LineOffsets);
+  for (const auto &Entry : TokenTables)
+    Size += getCapacityInBytes(Entry.second.Tokens);
+  return Size;
+}
+
+const SyntaxTree::Impl::NodeLocations &
+SyntaxTree::Impl::getLocations(NodeId Id) {
+  NodeLocations &L = Locations[Id];
+  if (HasLocations[Id])
+    return L;
+  const SourceManager &SM = AST.getSourceManager();
+  CharSourceRange Range = getSourceRange(Id);
+  L.Offsets = {SM.getFileOffset(Range.getBegin()),
+               SM.getFileOffset(Range.getEnd())};
+  L.Begin = getLineAndColumn(Range.getBegin());
+  L.End = getLineAndColumn(Range.getEnd());
+  HasLocations[Id] = true;
+  return L;
+}
+
 CharSourceRange Node::getSourceRange() const {
-  return CharSourceRange::getCharRange(getSourceRangeImpl(*this));
+  return Tree.getSourceRange(getId());
 }
 
 std::pair<unsigned, unsigned> Node::getSourceRangeOffsets() const {
-  const SourceManager &SM = Tree.AST.getSourceManager();
-  CharSourceRange Range = getSourceRange();
-  unsigned Begin = SM.getFileOffset(Range.getBegin());
-  unsigned End = SM.getFileOffset(Range.getEnd());
-  return {Begin, End};
+  return Tree.getLocations(getId()).Offsets;
 }
 
 std::pair<unsigned, unsigned> Node::getSourceBeginLocation() const {
-  const SourceManager &SM = Tree.AST.getSourceManager();
-  CharSourceRange Range = getSourceRange();  
-  SourceLocation BeginLoc = Range.getBegin();  
-  PresumedLoc PLoc = SM.getPresumedLoc(BeginLoc); 
-  if (PLoc.isInvalid())
-    return {NULL, NULL};
-  return {PLoc.getLine(), PLoc.getColumn()};
+  return Tree.getLocations(getId()).Begin;
 }
 
 std::pair<unsigned, unsigned> Node::getSourceEndLocation() const {
-  const SourceManager &SM = Tree.AST.getSourceManager();
-  CharSourceRange Range = getSourceRange();
-  SourceLocation EndLoc = Range.getEnd(); 
-  PresumedLoc PLoc = SM.getPresumedLoc(EndLoc); 
-  if (PLoc.isInvalid())
-    return {NULL, NULL};
-  return {PLoc.getLine(), PLoc.getColumn()};
+  return Tree.getLocations(getId()).End;
 }
 
 static bool onlyWhitespace(StringRef Str) {
@@ -973,9 +1586,9 @@ SmallVector<CharSourceRange, 4> Node::getOwnedSourceRanges() const {
   for (NodeRef Descendant : *this) {
     CharSourceRange DescendantRange = Descendant.getSourceRange();
     CharSourceRange LMDRange =
-        getTree().getNode(Descendant.LeftMostDescendant).getSourceRange();
+        getTree().getNode(Descendant.getLeftMostDescendant()).getSourceRange();
     CharSourceRange RMDRange =
-        getTree().getNode(Descendant.RightMostDescendant).getSourceRange();
+        getTree().getNode(Descendant.getRightMostDescendant()).getSourceRange();
     auto MinValidBegin = [&Less](CharSourceRange &Range1,
                                  CharSourceRange &Range2) {
       SourceLocation Begin1 = Range1.getBegin(), Begin2 = Range2.getBegin();
@@ -1013,10 +1626,10 @@ CharSourceRange Node::findRangeForDeletion() const {
   SyntaxTree &Tree = getTree();
   SourceManager &SM = Tree.getSourceManager();
   const LangOptions &LangOpts = Tree.getLangOpts();
-  auto &DTN = ASTNode;
-  auto &ParentDTN = Parent.ASTNode;
+  auto &DTN = getASTNode();
+  auto &ParentDTN = Parent.getASTNode();
   size_t SiblingIndex = findPositionInParent();
-  const auto &Siblings = Parent.Children;
+  ArrayRef<NodeId> Siblings = Parent.getChildIds();
   // Remove the comma if the location is within a comma-separated list of
   // at least size 2 (minus the callee for CallExpr).
   if ((ParentDTN.get<CallExpr>() && Siblings.size() > 2) ||
@@ -1038,16 +1651,10 @@ CharSourceRange Node::findRangeForDeletion() const {
 
 void forEachTokenInRange(CharSourceRange Range, SyntaxTree &Tree,
                          std::function<void(Token &)> Body) {
-  SourceLocation Begin = Range.getBegin(), End = Range.getEnd();
-  SourceManager &SM = Tree.getSourceManager();
-  BeforeThanCompare<SourceLocation> Less(SM);
-  Token Tok;
-  while (Begin.isValid() && Less(Begin, End) &&
-         !Lexer::getRawToken(Begin, Tok, SM, Tree.getLangOpts(),
-                             /*IgnoreWhiteSpace=*/true) &&
-         Less(Tok.getLocation(), End)) {
+  SyntaxTree::Impl::TokenSpan Span = Tree.TreeImpl->getTokenSpan(Range);
+  for (const SyntaxTree::Impl::FileToken &FileTok : Span.Tokens) {
+    Token Tok = Span.getToken(FileTok);
     Body(Tok);
-    Begin = Tok.getEndLoc();
   }
 }
 
@@ -1070,7 +1677,7 @@ struct HeightLess {
   SyntaxTree::Impl &Tree;
   HeightLess(SyntaxTree::Impl &Tree) : Tree(Tree) {}
   bool operator()(NodeId Id1, NodeId Id2) const {
-    return Tree.getNode(Id1).Height < Tree.getNode(Id2).Height;
+    return Tree.Heights[Id1] < Tree.Heights[Id2];
   }
 };
 } // end anonymous namespace
@@ -1105,7 +1712,7 @@ public:
   int peekMax() const {
     if (List.empty())
       return 0;
-    return Tree.getNode(List.top()).Height;
+    return Tree.Heights[List.top()];
   }
   void open(NodeRef N) {
     for (NodeRef Child : N)
@@ -1115,15 +1722,57 @@ public:
 } // end anonymous namespace
 
 bool ASTDiff::Impl::identical(NodeRef N1, NodeRef N2) const {
+  if (N1.Tree.SubtreeHashes[N1.getId()] != N2.Tree.SubtreeHashes[N2.getId()])
+    return false;
+  return !Options.VerifySubtreeHashes || verifyIdentical(N1, N2);
+}
+
+bool ASTDiff::Impl::verifyIdentical(NodeRef N1, NodeRef N2) const {
   if (N1.getNumChildren() != N2.getNumChildren() ||
       !isMatchingPossible(N1, N2) || areNodesDifferent(N1, N2))
     return false;
   for (size_t Id = 0, E = N1.getNumChildren(); Id < E; ++Id)
-    if (!identical(N1.getChild(Id), N2.getChild(Id)))
+    if (!verifyIdentical(N1.getChild(Id), N2.getChild(Id)))
       return false;
   return true;
 }
 
+// Returns the name that N declares or refers to, or StringTable::NoString.
+static StringId getDeclaredOrReferencedName(NodeRef N) {
+  if (N.getKind() == NodeKind::DeclRefExpr ||
+      N.getKind() == NodeKind::MemberExpr)
+    return N.getValueId();
+  return N.getIdentifierId();
+}
+
+bool ASTDiff::Impl::isRenaming(NodeRef N1, NodeRef N2) const {
+  if (N1.Tree.StructuralHashes[N1.getId()] !=
+          N2.Tree.StructuralHashes[N2.getId()] ||
+      getNumberOfDescendants(N1) != getNumberOfDescendants(N2) ||
+      !isMatchingPossible(N1, N2))
+    return false;
+  // The subtrees have the same shape, so their nodes pair up in preorder.
+  llvm::DenseMap<StringId, StringId> Renamed1, Renamed2;
+  for (int I = 0, E = getNumberOfDescendants(N1); I < E; ++I) {
+    NodeRef D1 = T1.getNode(N1.getId() + I);
+    NodeRef D2 = T2.getNode(N2.getId() + I);
+    // Descendants matched by the earlier phase must be matched to each
+    // other.
+    if (getDst(D1) != (getSrc(D2) ? &D2 : nullptr))
+      return false;
+    StringId Ident1 = getDeclaredOrReferencedName(D1),
+             Ident2 = getDeclaredOrReferencedName(D2);
+    if ((Ident1 == StringTable::NoString) != (Ident2 == StringTable::NoString))
+      return false;
+    if (Ident1 == StringTable::NoString)
+      continue;
+    if (Renamed1.try_emplace(Ident1, Ident2).first->second != Ident2 ||
+        Renamed2.try_emplace(Ident2, Ident1).first->second != Ident1)
+      return false;
+  }
+  return true;
+}
+
 bool ASTDiff::Impl::isMatchingPossible(NodeRef N1, NodeRef N2) const {
   return Options.isMatchingAllowed(N1, N2);
 }
@@ -1148,18 +1797,11 @@ void ASTDiff::Impl::addOptimalMapping(NodeRef N1, NodeRef N2) {
   }
 }
 
-double ASTDiff::Impl::getJaccardSimilarity(NodeRef N1, NodeRef N2) const {
-  int CommonDescendants = 0;
-  // Count the common descendants, excluding the subtree root.
-  for (NodeId Src = N1.getId() + 1; Src <= N1.RightMostDescendant; ++Src) {
-    const Node *Dst = getDst(T1.getNode(Src));
-    if (Dst)
-      CommonDescendants += isInSubtree(*Dst, N2);
-  }
-  // We need to subtract 1 to get the number of descendants excluding the
-  // root.
-  double Denominator = getNumberOfDescendants(N1) - 1 +
-                       getNumberOfDescendants(N2) - 1 - CommonDescendants;
+// Returns the ratio of common descendants of two subtrees with Descendants1
+// and Descendants2 descendants.
+static double getJaccardIndex(int Descendants1, int Descendants2,
+                              int CommonDescendants) {
+  double Denominator = Descendants1 + Descendants2 - CommonDescendants;
   // CommonDescendants is less than the size of one subtree.
   assert(Denominator >= 0 && "Expected non-negative denominator.");
   if (Denominator == 0)
@@ -1167,11 +1809,37 @@ double ASTDiff::Impl::getJaccardSimilarity(NodeRef N1, NodeRef N2) const {
   return CommonDescendants / Denominator;
 }
 
+std::vector<NodeId> ASTDiff::Impl::getMappedDescendants(NodeRef N1) const {
+  std::vector<NodeId> MappedDescendants;
+  // The root of the subtree is left out.
+  for (NodeId Src = N1.getId() + 1; Src <= N1.getRightMostDescendant(); ++Src) {
+    if (const Node *Dst = getDst(T1.getNode(Src)))
+      MappedDescendants.push_back(Dst->getId());
+  }
+  std::sort(MappedDescendants.begin(), MappedDescendants.end());
+  return MappedDescendants;
+}
+
+double ASTDiff::Impl::getJaccardSimilarity(
+    NodeRef N1, NodeRef N2, ArrayRef<NodeId> MappedDescendants1) const {
+  // The subtree of N2 is a contiguous range of NodeIds, the common
+  // descendants are found by binary search instead of a walk through the
+  // subtree of N1.
+  auto First = std::lower_bound(MappedDescendants1.begin(),
+                                MappedDescendants1.end(), N2.getId());
+  auto Last = std::upper_bound(First, MappedDescendants1.end(),
+                               N2.getRightMostDescendant());
+  // We need to subtract 1 to get the number of descendants excluding the
+  // root.
+  return getJaccardIndex(getNumberOfDescendants(N1) - 1,
+                         getNumberOfDescendants(N2) - 1, Last - First);
+}
+
 double ASTDiff::Impl::getNodeSimilarity(NodeRef N1, NodeRef N2) const {
-  auto Ident1 = N1.getIdentifier(), Ident2 = N2.getIdentifier();
+  StringId Ident1 = N1.getIdentifierId(), Ident2 = N2.getIdentifierId();
 
   bool SameValue = !areNodesDifferent(N1, N2);
-  auto SameIdent = Ident1 && Ident2 && *Ident1 == *Ident2;
+  bool SameIdent = Ident1 != StringTable::NoString && Ident1 == Ident2;
 
   double NodeSimilarity = 0;
   NodeSimilarity += SameValue;
@@ -1184,12 +1852,22 @@ double ASTDiff::Impl::getNodeSimilarity(NodeRef N1, NodeRef N2) const {
 const Node *ASTDiff::Impl::findCandidate(NodeRef N1) const {
   const Node *Candidate = nullptr;
   double HighestSimilarity = 0.0;
+  std::vector<NodeId> MappedDescendants = getMappedDescendants(N1);
+  int Descendants1 = getNumberOfDescendants(N1) - 1;
   for (NodeRef N2 : T2) {
     if (!isMatchingPossible(N1, N2))
       continue;
     if (getSrc(N2))
       continue;
-    double Similarity = getJaccardSimilarity(N1, N2);
+    // At most the mapped descendants of N1 that fit into the subtree of N2
+    // are in common. Most candidates are ruled out by their size alone.
+    int Descendants2 = getNumberOfDescendants(N2) - 1;
+    double Bound = getJaccardIndex(
+        Descendants1, Descendants2,
+        std::min<int>(MappedDescendants.size(), Descendants2));
+    if (Bound < Options.MinSimilarity || Bound <= HighestSimilarity)
+      continue;
+    double Similarity = getJaccardSimilarity(N1, N2, MappedDescendants);
     if (Similarity >= Options.MinSimilarity && Similarity > HighestSimilarity) {
       HighestSimilarity = Similarity;
       Candidate = &N2;
@@ -1202,12 +1880,13 @@ const Node *ASTDiff::Impl::findCandidateFromChildren(NodeRef N1,
                                                      NodeRef P2) const {
   const Node *Candidate = nullptr;
   double HighestSimilarity = 0.0;
+  std::vector<NodeId> MappedDescendants = getMappedDescendants(N1);
   for (NodeRef N2 : P2) {
     if (!isMatchingPossible(N1, N2))
       continue;
     if (getSrc(N2))
       continue;
-    double Similarity = getJaccardSimilarity(N1, N2);
+    double Similarity = getJaccardSimilarity(N1, N2, MappedDescendants);
     Similarity += getNodeSimilarity(N1, N2);
     if (Similarity >= Options.MinSimilarity && Similarity > HighestSimilarity) {
       HighestSimilarity = Similarity;
@@ -1264,7 +1943,11 @@ void ASTDiff::Impl::matchChildren() {
   }
 }
 
-void ASTDiff::Impl::matchTopDown() {
+void ASTDiff::Impl::matchTopDown(bool IgnoreNames) {
+  if (IgnoreNames) {
+    T1.computeStructuralHashes();
+    T2.computeStructuralHashes();
+  }
   PriorityList L1(T1);
   PriorityList L2(T2);
 
@@ -1286,11 +1969,15 @@ void ASTDiff::Impl::matchTopDown() {
     }
     NodeList H1 = L1.pop();
     NodeList H2 = L2.pop();
-    for (NodeRef N1 : H1) {
-      for (NodeRef N2 : H2) {
-        if (identical(N1, N2) && !getDst(N1) && !getSrc(N2)) {
-          for (int I = 0, E = getNumberOfDescendants(N1); I < E; ++I) {
-            link(T1.getNode(N1.getId() + I), T2.getNode(N2.getId() + I));
+    if (IgnoreNames)
+      matchRenamedSubtrees(H1.Ids, H2.Ids);
+    else {
+      for (NodeRef N1 : H1) {
+        for (NodeRef N2 : H2) {
+          if (identical(N1, N2) && !getDst(N1) && !getSrc(N2)) {
+            for (int I = 0, E = getNumberOfDescendants(N1); I < E; ++I) {
+              link(T1.getNode(N1.getId() + I), T2.getNode(N2.getId() + I));
+            }
           }
         }
       }
@@ -1306,18 +1993,55 @@ void ASTDiff::Impl::matchTopDown() {
   }
 }
 
+void ASTDiff::Impl::matchRenamedSubtrees(ArrayRef<NodeId> H1,
+                                         ArrayRef<NodeId> H2) {
+  auto HaveSameStructure = [&](NodeRef N1, NodeRef N2) {
+    return !getDst(N1) && !getSrc(N2) &&
+           T1.StructuralHashes[N1.getId()] == T2.StructuralHashes[N2.getId()];
+  };
+  // Names carry much of what tells subtrees apart, so ambiguous pairs are
+  // left to the later phases.
+  for (NodeId Id1 : H1) {
+    NodeRef N1 = T1.getNode(Id1);
+    const Node *Candidate = nullptr;
+    int NumCandidates = 0;
+    for (NodeId Id2 : H2) {
+      if (HaveSameStructure(N1, T2.getNode(Id2))) {
+        Candidate = &T2.getNode(Id2);
+        ++NumCandidates;
+      }
+    }
+    if (NumCandidates != 1)
+      continue;
+    int NumRivals = 0;
+    for (NodeId Other : H1)
+      NumRivals += HaveSameStructure(T1.getNode(Other), *Candidate);
+    if (NumRivals != 1 || !isRenaming(N1, *Candidate))
+      continue;
+    for (int I = 0, E = getNumberOfDescendants(N1); I < E; ++I) {
+      NodeRef D1 = T1.getNode(Id1 + I);
+      if (!getDst(D1))
+        link(D1, T2.getNode(Candidate->getId() + I));
+    }
+  }
+}
+
 ASTDiff::Impl::Impl(SyntaxTree::Impl &T1, SyntaxTree::Impl &T2,
                     const ComparisonOptions &Options)
     : T1(T1), T2(T2), Options(Options) {
   int Size = T1.getSize() + T2.getSize();
   SrcToDst = llvm::make_unique<NodeId[]>(Size);
   DstToSrc = llvm::make_unique<NodeId[]>(Size);
+  T1.computeHashes(Options.Hash);
+  T2.computeHashes(Options.Hash);
   computeMapping();
   computeChangeKinds();
 }
 
 void ASTDiff::Impl::computeMapping() {
   matchTopDown();
+  if (Options.MatchRenamedSubtrees)
+    matchTopDown(/*IgnoreNames=*/true);
   if (Options.StopAfterTopDown)
     return;
   matchBottomUp();
@@ -1327,13 +2051,15 @@ void ASTDiff::Impl::computeMapping() {
 }
 
 void ASTDiff::Impl::computeChangeKinds() {
+  ChangesT1.assign(T1.getSize(), NodeChange());
+  ChangesT2.assign(T2.getSize(), NodeChange());
   for (NodeRef N1 : T1) {
     if (!getDst(N1))
-      ChangesT1.emplace(N1.getId(), NodeChange(Delete, -1));
+      ChangesT1[N1.getId()] = NodeChange(Delete, -1);
   }
   for (NodeRef N2 : T2) {
     if (!getSrc(N2))
-      ChangesT2.emplace(N2.getId(), NodeChange(Insert, -1));
+      ChangesT2[N2.getId()] = NodeChange(Insert, -1);
   }
   for (NodeRef N1 : T1.NodesBfs) {
     if (!getDst(N1))
@@ -1384,7 +2110,7 @@ const Node *ASTDiff::Impl::getSrc(NodeRef N2) const {
 }
 
 int ASTDiff::Impl::findNewPosition(NodeRef N) const {
-  const std::map<NodeId, NodeChange> *Changes;
+  const std::vector<NodeChange> *Changes;
   if (&N.Tree == &T1)
     Changes = &ChangesT1;
   else
@@ -1394,8 +2120,7 @@ int ASTDiff::Impl::findNewPosition(NodeRef N) const {
     return 0;
   int Position = N.findPositionInParent();
   for (NodeRef Sibling : *N.getParent()) {
-    if (Changes->count(Sibling.getId()))
-      Position += Changes->at(Sibling.getId()).Shift;
+    Position += (*Changes)[Sibling.getId()].Shift;
     if (&Sibling == &N)
       return Position;
   }
@@ -1403,16 +2128,20 @@ int ASTDiff::Impl::findNewPosition(NodeRef N) const {
 }
 
 ChangeKind ASTDiff::Impl::getNodeChange(NodeRef N) const {
-  const std::map<NodeId, NodeChange> *Changes;
+  const std::vector<NodeChange> *Changes;
   if (&N.Tree == &T1) {
     Changes = &ChangesT1;
   } else {
     assert(&N.Tree == &T2 && "Invalid tree.");
     Changes = &ChangesT2;
   }
-  if (Changes->count(N.getId()))
-    return Changes->at(N.getId()).Change;
-  return NoChange;
+  return (*Changes)[N.getId()].Change;
+}
+
+size_t ASTDiff::Impl::getMemoryUsage() const {
+  // SrcToDst and DstToSrc have room for the nodes of both trees.
+  return 2 * (T1.getSize() + T2.getSize()) * sizeof(NodeId) +
+         getCapacityInBytes(ChangesT1) + getCapacityInBytes(ChangesT2);
 }
 
 ASTDiff::ASTDiff(SyntaxTree &T1, SyntaxTree &T2,
@@ -1429,6 +2158,8 @@ ChangeKind ASTDiff::getNodeChange(NodeRef N) const {
   return DiffImpl->getNodeChange(N);
 }
 
+size_t ASTDiff::getMemoryUsage() const { return DiffImpl->getMemoryUsage(); }
+
 static void dumpDstChange(raw_ostream &OS, const ASTDiff::Impl &Diff,
                           SyntaxTree::Impl &SrcTree, SyntaxTree::Impl &DstTree,
                           NodeRef Dst) {
@@ -1487,9 +2218,9 @@ void ASTDiff::dumpChanges(raw_ostream &OS, bool DumpMatches) const {
   DiffImpl->dumpChanges(OS, DumpMatches);
 }
 
-SyntaxTree::SyntaxTree(ASTUnit &AST)
+SyntaxTree::SyntaxTree(ASTUnit &AST, const TreeFilter &Filter)
     : TreeImpl(llvm::make_unique<SyntaxTree::Impl>(
-          this, AST.getASTContext().getTranslationUnitDecl(), AST)) {}
+          this, AST.getASTContext().getTranslationUnitDecl(), AST, &Filter)) {}
 
 SyntaxTree::~SyntaxTree() = default;
 
@@ -1503,6 +2234,15 @@ const LangOptions &SyntaxTree::getLangOpts() const {
   return TreeImpl->AST.getLangOpts();
 }
 
+std::pair<unsigned, unsigned>
+SyntaxTree::getLineAndColumn(SourceLocation Loc) const {
+  return TreeImpl->getLineAndColumn(Loc);
+}
+
+SourceLocation SyntaxTree::getNextTokenLocation(SourceLocation Loc) const {
+  return TreeImpl->getNextTokenLocation(Loc);
+}
+
 const ASTContext &SyntaxTree::getASTContext() const {
   return TreeImpl->AST.getASTContext();
 }
@@ -1510,6 +2250,9 @@ const ASTContext &SyntaxTree::getASTContext() const {
 NodeRef SyntaxTree::getNode(NodeId Id) const { return TreeImpl->getNode(Id); }
 
 int SyntaxTree::getSize() const { return TreeImpl->getSize(); }
+size_t SyntaxTree::getMemoryUsage() const {
+  return TreeImpl->getMemoryUsage();
+}
 NodeRef SyntaxTree::getRoot() const { return TreeImpl->getRoot(); }
 NodeId SyntaxTree::getRootId() const { return TreeImpl->getRootId(); }
 SyntaxTree::PreorderIterator SyntaxTree::begin() const {
@@ -707,8 +707,8 @@ namespace clang {
 
         std::string Patcher::getNodeValue(NodeRef node) {
             std::string value;
-            if (node.getTypeLabel() == "MemberExpr") {
-                auto memNode = node.ASTNode.get<MemberExpr>();
+            if (node.getKind() == NodeKind::MemberExpr) {
+                auto memNode = node.getASTNode().get<MemberExpr>();
 
                 auto decNode = memNode->getMemberDecl();
                 SourceLocation loc = decNode->getLocation();
@@ -732,7 +732,7 @@ namespace clang {
                 }
 
 
-            } else if (node.getTypeLabel() == "ArraySubscriptExpr") {
+            } else if (node.getKind() == NodeKind::ArraySubscriptExpr) {
 
                 unsigned numChildren = node.getNumChildren();
                 if (numChildren > 0){
@@ -749,7 +749,7 @@ namespace clang {
 
 
 
-            } else if (node.getTypeLabel() == "DeclRefExpr") {
+            } else if (node.getKind() == NodeKind::DeclRefExpr) {
                 value = node.getValue();
 //                llvm::errs() << value;
             }
@@ -759,8 +759,8 @@ namespace clang {
         std::string Patcher::filterStatements(NodeRef node, std::string statement, SyntaxTree &SourceTree) {
             unsigned childNodesInUpdateRange = node.getNumChildren();
 
-            if (node.getTypeLabel() == "CallExpr") {
-                auto callNode = node.ASTNode.get<CallExpr>();
+            if (node.getKind() == NodeKind::CallExpr) {
+                auto callNode = node.getASTNode().get<CallExpr>();
                 SourceLocation beingLoc = callNode->getBeginLoc();
                 SourceLocation endLoc = callNode->getEndLoc();
                 std::string locId = beingLoc.printToString(Src.getSourceManager());
@@ -792,9 +792,9 @@ namespace clang {
         std::string Patcher::translateVariables(NodeRef node, std::string statement) {
             unsigned childNodesInUpdateRange = node.getNumChildren();
 //             llvm::errs() << "child count " << childNodesInUpdateRange << "\n";
-            if (node.getTypeLabel() == "VarDecl") {
+            if (node.getKind() == NodeKind::VarDecl) {
 //                llvm::outs() << "translating variable definition \n";
-                auto decNode = node.ASTNode.get<VarDecl>();
+                auto decNode = node.getASTNode().get<VarDecl>();
                 SourceLocation loc = decNode->getLocation();
                 std::string locId = loc.printToString(Src.getSourceManager());
 //                 llvm::errs() << locId << "\n";
@@ -819,7 +819,7 @@ namespace clang {
                 return statement;
 
 
-            } else if (node.getTypeLabel() == "MemberExpr") {
+            } else if (node.getKind() == NodeKind::MemberExpr) {
 //                llvm::outs() << "translating variable definition \n";
                 std::string variableNameInSource = getNodeValue(node);
 //                llvm::outs() << "var: " << variableNameInSource << "\n";
@@ -833,7 +833,7 @@ namespace clang {
 
                 return statement;
 
-            } else if (node.getTypeLabel() == "DeclRefExpr") {
+            } else if (node.getKind() == NodeKind::DeclRefExpr) {
 //                llvm::outs() << "translating variable definition \n";
 //                auto decRefNode = node.ASTNode.get<DeclRefExpr>();
 //                auto decNode = decRefNode->getDecl();
@@ -900,7 +900,7 @@ namespace clang {
 //                 llvm::errs() << "child " << childIndex << "\n";
                 NodeRef childNode = node.getChild(childIndex);
 //                 llvm::outs() << "child " << childIndex << " type " << childNode.getTypeLabel() << "\n";
-                if (childNode.getTypeLabel() == "DeclRefExpr") {
+                if (childNode.getKind() == NodeKind::DeclRefExpr) {
 
 //                    llvm::outs() << "translating declref variable definition \n";
 //                auto decRefNode = node.ASTNode.get<DeclRefExpr>();
@@ -916,7 +916,7 @@ namespace clang {
 //                    llvm::outs() << "after translation: " << variableNameInTarget << "\n";
 //                    llvm::outs() << "statement: " << statement << "\n";
 
-                    if (auto *VD = childNode.ASTNode.get<VarDecl>())
+                    if (auto *VD = childNode.getASTNode().get<VarDecl>())
                         return statement;
 //
 //
@@ -997,22 +997,22 @@ namespace clang {
                 range.setBegin(startLoc);
             }
 
-            if (deleteNode.getTypeLabel() == "BinaryOperator" && !isMove) {
-                auto binOpNode = deleteNode.ASTNode.get<BinaryOperator>();
+            if (deleteNode.getKind() == NodeKind::BinaryOperator && !isMove) {
+                auto binOpNode = deleteNode.getASTNode().get<BinaryOperator>();
                 range.setBegin(binOpNode->getOperatorLoc());
                 std::string binOp = binOpNode->getOpcodeStr();
                 Rewrite.RemoveText(binOpNode->getOperatorLoc(), binOp.length());
 
-            } else if (deleteNode.getTypeLabel() == "DeclStmt" || deleteNode.getTypeLabel() == "Macro" ||
-                       deleteNode.getTypeLabel() == "MemberExpr") {
+            } else if (deleteNode.getKind() == NodeKind::DeclStmt || deleteNode.getKind() == NodeKind::Macro ||
+                       deleteNode.getKind() == NodeKind::MemberExpr) {
                 range = expandRange(range, Target);
                 Rewriter::RewriteOptions delRangeOpts;
                 delRangeOpts.RemoveLineIfEmpty = true;
                 Rewrite.RemoveText(range, delRangeOpts);
-            } else if (deleteNode.getTypeLabel() == "DeclRefExpr") {
+            } else if (deleteNode.getKind() == NodeKind::DeclRefExpr) {
                 const Node *parentNode = deleteNode.getParent();
                 range = expandRange(range, Target);
-                if (parentNode->getTypeLabel() == "CallExpr"){
+                if (parentNode->getKind() == NodeKind::CallExpr){
                     int numChildren = parentNode->getNumChildren();
                     int position = deleteNode.findPositionInParent();
                     if (position == numChildren -1){
@@ -1075,243 +1075,239 @@ namespace clang {
             if (!insertStatement.empty()) {
 
                 int NumChildren = targetNode.getNumChildren();
-                if (targetNode.getTypeLabel() == "CompoundStmt") {
+                switch (targetNode.getKind()) {
+                    case NodeKind::CompoundStmt:
+                        insertStatement = "\n" + insertStatement + "\n";
 
-                    insertStatement = "\n" + insertStatement + "\n";
+                        if (Offset == 0) {
+                            if (NumChildren > 0) {
+                                Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
+                                modified = true;
 
-                    if (Offset == 0) {
-                        if (NumChildren > 0) {
-                            Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
-                            modified = true;
+                            } else {
+                                Rewrite.InsertTextAfter(insertLoc, insertStatement);
+                                modified = true;
+                            }
 
                         } else {
-                            Rewrite.InsertTextAfter(insertLoc, insertStatement);
-                            modified = true;
-                        }
 
-                    } else {
+                            NodeRef nearestChildNode = targetNode.getChild(Offset);
+    //                        insertLoc = nearestChildNode.getSourceRange().getEnd();
 
-                        NodeRef nearestChildNode = targetNode.getChild(Offset);
-//                        insertLoc = nearestChildNode.getSourceRange().getEnd();
-
-                        CharSourceRange range = nearestChildNode.getSourceRange();
-                        range = expandRange(range, Target);
-                        insertLoc = range.getEnd();
-//                        llvm::outs() << nearestChildNode.getTypeLabel() << "\n";
-                        if (nearestChildNode.getTypeLabel() == "CStyleCastExpr"){
-                            NodeRef grandChildNode = nearestChildNode.getChild(1);
-                            //auto nextNode = nextChildNode.ASTNode.get<BinaryOperator>();
-                            range =  grandChildNode.getSourceRange();
+                            CharSourceRange range = nearestChildNode.getSourceRange();
                             range = expandRange(range, Target);
-//                            llvm::outs() << grandChildNode.getTypeLabel() << "\n";
-                             insertLoc = range.getEnd();
-                         }
-
-
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
-                        modified = true;
+                            insertLoc = range.getEnd();
+    //                        llvm::outs() << nearestChildNode.getTypeLabel() << "\n";
+                            if (nearestChildNode.getKind() == NodeKind::CStyleCastExpr){
+                                NodeRef grandChildNode = nearestChildNode.getChild(1);
+                                //auto nextNode = nextChildNode.ASTNode.get<BinaryOperator>();
+                                range =  grandChildNode.getSourceRange();
+                                range = expandRange(range, Target);
+    //                            llvm::outs() << grandChildNode.getTypeLabel() << "\n";
+                                 insertLoc = range.getEnd();
+                             }
+
+
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                            modified = true;
 
 
-                    }
+                        }
+                        break;
+                    case NodeKind::CaseStmt:
+                        if (Offset == 0) {
+                            auto ifNode = targetNode.getASTNode().get<IfStmt>();
+                            auto condNode = ifNode->getCond();
+                            insertLoc = condNode->getExprLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                            modified = true;
 
-                } else if (targetNode.getTypeLabel() == "CaseStmt") {
+                        } else {
 
-                    if (Offset == 0) {
-                        auto ifNode = targetNode.ASTNode.get<IfStmt>();
-                        auto condNode = ifNode->getCond();
-                        insertLoc = condNode->getExprLoc();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
+                            NodeRef nearestChildNode = targetNode.getChild(Offset);
+                            insertLoc = nearestChildNode.getSourceRange().getBegin();
 
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
-                        modified = true;
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                            modified = true;
 
-                    } else {
 
-                        NodeRef nearestChildNode = targetNode.getChild(Offset);
-                        insertLoc = nearestChildNode.getSourceRange().getBegin();
+                        }
+                        break;
+                    case NodeKind::IfStmt:
+                        if (Offset == 0) {
+                            auto ifNode = targetNode.getASTNode().get<IfStmt>();
+                            auto condNode = ifNode->getCond();
+                            insertLoc = condNode->getExprLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                            modified = true;
 
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
-                        modified = true;
+                        } else {
 
+                            NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
+                            insertLoc = nearestChildNode.getSourceRange().getEnd();
 
-                    }
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                            modified = true;
 
-                } else if (targetNode.getTypeLabel() == "IfStmt") {
 
-                    if (Offset == 0) {
-                        auto ifNode = targetNode.ASTNode.get<IfStmt>();
-                        auto condNode = ifNode->getCond();
-                        insertLoc = condNode->getExprLoc();
+                        }
+                        break;
+                    case NodeKind::BinaryOperator: {
+                        // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
+                        auto binaryNode = targetNode.getASTNode().get<BinaryOperator>();
+                        insertLoc = binaryNode->getOperatorLoc();
+                        if (insertNode.getKind() == NodeKind::CStyleCastExpr) {
+                            insertLoc = binaryNode->getBeginLoc();
+                        }
                         //std::string locId = insertLoc.printToString(Target.getSourceManager());
                         // llvm::outs() << locId << "\n";
 
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
-                        modified = true;
+                        if (Offset == 0) {
+                            if (insertNode.getKind() == NodeKind::BinaryOperator)
+                                deleteCode(targetNode.getChild(0), false);
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                    } else {
 
-                        NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
-                        insertLoc = nearestChildNode.getSourceRange().getEnd();
+                        } else {
+                            if (insertNode.getKind() == NodeKind::BinaryOperator)
+                                deleteCode(targetNode.getChild(1), false);
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                        }
 
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
                         modified = true;
-
-
-                    }
-
-                } else if (targetNode.getTypeLabel() == "BinaryOperator") {
-
-                    // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
-                    auto binaryNode = targetNode.ASTNode.get<BinaryOperator>();
-                    insertLoc = binaryNode->getOperatorLoc();
-                    if (insertNode.getTypeLabel() == "CStyleCastExpr") {
-                        insertLoc = binaryNode->getBeginLoc();
+                        break;
                     }
-                    //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                    // llvm::outs() << locId << "\n";
+                    case NodeKind::CallExpr: {
+                        // llvm::outs() << insertStatement << "\n";
+                        // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
+                        auto callerNode = targetNode.getASTNode().get<CallExpr>();
+                        int numArgs = callerNode->getNumArgs();
 
-                    if (Offset == 0) {
-                        if (insertNode.getTypeLabel() == "BinaryOperator")
-                            deleteCode(targetNode.getChild(0), false);
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        if (numArgs == 0) {
+                            insertStatement = insertStatement + ", ";
 
+                        } else {
+                            insertStatement = ", " + insertStatement;
+                        }
 
-                    } else {
-                        if (insertNode.getTypeLabel() == "BinaryOperator")
-                            deleteCode(targetNode.getChild(1), false);
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
-                    }
-
-                    modified = true;
-
-                } else if (targetNode.getTypeLabel() == "CallExpr") {
-
-
-                    // llvm::outs() << insertStatement << "\n";
-                    // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
-                    auto callerNode = targetNode.ASTNode.get<CallExpr>();
-                    int numArgs = callerNode->getNumArgs();
-
-                    if (numArgs == 0) {
-                        insertStatement = insertStatement + ", ";
-
-                    } else {
-                        insertStatement = ", " + insertStatement;
-                    }
+                        // llvm::outs() << insertStatement << "\n";
 
-                    // llvm::outs() << insertStatement << "\n";
 
+                        if (Offset >= numArgs) {
+                            insertLoc = callerNode->getRParenLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
 
-                    if (Offset >= numArgs) {
-                        insertLoc = callerNode->getRParenLoc();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        } else {
+                            insertLoc = callerNode->getArg(Offset)->getExprLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
 
-                    } else {
-                        insertLoc = callerNode->getArg(Offset)->getExprLoc();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                        }
 
-                        if (Rewrite.InsertTextAfterToken(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        modified = true;
+                        break;
                     }
+                    case NodeKind::MemberExpr: {
+                        extractRange = insertNode.getSourceRange();
+                        insertStatement = Lexer::getSourceText(extractRange, SourceTree.getSourceManager(),
+                                                               SourceTree.getLangOpts());
+    //                    insertStatement = translateVariables(insertNode, insertStatement);
+                        // llvm::outs() << insertStatement << "\n";
+                        // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
+                        auto memberNode = targetNode.getASTNode().get<MemberExpr>();
+
+                        if (Offset == 0) {
+                            // insertStatement = insertStatement + "->";
+                            insertLoc = memberNode->getLocStart();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
+
+                            if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
 
-                    modified = true;
-
-                } else if (targetNode.getTypeLabel() == "MemberExpr") {
-
-                    extractRange = insertNode.getSourceRange();
-                    insertStatement = Lexer::getSourceText(extractRange, SourceTree.getSourceManager(),
-                                                           SourceTree.getLangOpts());
-//                    insertStatement = translateVariables(insertNode, insertStatement);
-                    // llvm::outs() << insertStatement << "\n";
-                    // llvm::outs() << insertLoc.printToString(Target.getSourceManager()) << "\n";
-                    auto memberNode = targetNode.ASTNode.get<MemberExpr>();
-
-                    if (Offset == 0) {
-                        // insertStatement = insertStatement + "->";
-                        insertLoc = memberNode->getLocStart();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
-
-                        if (Rewrite.InsertTextBefore(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        } else {
+                            insertLoc = memberNode->getMemberLoc();
+                            //std::string locId = insertLoc.printToString(Target.getSourceManager());
+                            // llvm::outs() << locId << "\n";
 
-                    } else {
-                        insertLoc = memberNode->getMemberLoc();
-                        //std::string locId = insertLoc.printToString(Target.getSourceManager());
-                        // llvm::outs() << locId << "\n";
+                            if (Rewrite.InsertText(insertLoc, insertStatement))
+                                llvm::errs() << "error inserting\n";
+                        }
 
-                        if (Rewrite.InsertText(insertLoc, insertStatement))
-                            llvm::errs() << "error inserting\n";
+                        modified = true;
+                        break;
                     }
+                    default:
+                        if (Offset == 0) {
+                            if (NumChildren > 0) {
+                                // NodeRef firstChild = targetNode.getChild(Offset);
+                                // startLoc = firstChild.getSourceRange().getBegin();
+                                // crochetPatcher.Rewrite.InsertTextBefore(startLoc, insertStatement);
 
-                    modified = true;
-
-                } else {
+                                Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
+                                modified = true;
 
-                    if (Offset == 0) {
-                        if (NumChildren > 0) {
-                            // NodeRef firstChild = targetNode.getChild(Offset);
-                            // startLoc = firstChild.getSourceRange().getBegin();
-                            // crochetPatcher.Rewrite.InsertTextBefore(startLoc, insertStatement);
 
-                            Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
-                            modified = true;
+                            } else {
 
+                                Rewrite.InsertTextAfter(insertLoc, insertStatement);
+                                modified = true;
+                                // Rewrite.InsertTextAfter(r.getBegin(), insert_value);
+                                // PresumedLoc InsertLoc = SM.getPresumedLoc(r.getBegin());
+                                // llvm::outs() << "InsertLoc: " << InsertLoc.getLine() << ":" << InsertLoc.getColumn() << "\n";
+                            }
 
                         } else {
 
-                            Rewrite.InsertTextAfter(insertLoc, insertStatement);
-                            modified = true;
-                            // Rewrite.InsertTextAfter(r.getBegin(), insert_value);
-                            // PresumedLoc InsertLoc = SM.getPresumedLoc(r.getBegin());
-                            // llvm::outs() << "InsertLoc: " << InsertLoc.getLine() << ":" << InsertLoc.getColumn() << "\n";
-                        }
+                            // llvm::outs() << Offset << "\n";
+                            // llvm::outs() << NumChildren << "\n";
+
+                            if (Offset <= NumChildren - 1) {
+                                // llvm::outs() <<"if leg\n";
+                                NodeRef nearestChildNode = targetNode.getChild(Offset);
+                                // llvm::outs() <<"got child\n";
+                                insertLoc = nearestChildNode.getSourceRange().getEnd();
+                                // llvm::outs() <<"got loc\n";
+                                // if (insertLoc.isValid())
+                                //  llvm::outs() <<"valid\n";
+                                if (Rewrite.InsertText(insertLoc, insertStatement))
+                                    llvm::errs() << "error inserting\n";
+                                // llvm::outs() <<"inserted\n";
+                                modified = true;
+
+                            } else {
+                                // llvm::outs() <<"else leg\n";
+                                NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
+                                // llvm::outs() <<"got child\n";
+                                insertLoc = nearestChildNode.getSourceRange().getEnd();
+                                // llvm::outs() <<"got loc\n";
+                                Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
+                                // llvm::outs() <<"inserted\n";
+                                modified = true;
+                            }
 
-                    } else {
-
-                        // llvm::outs() << Offset << "\n";
-                        // llvm::outs() << NumChildren << "\n";
-
-                        if (Offset <= NumChildren - 1) {
-                            // llvm::outs() <<"if leg\n";
-                            NodeRef nearestChildNode = targetNode.getChild(Offset);
-                            // llvm::outs() <<"got child\n";
-                            insertLoc = nearestChildNode.getSourceRange().getEnd();
-                            // llvm::outs() <<"got loc\n";
-                            // if (insertLoc.isValid())
-                            //  llvm::outs() <<"valid\n";
-                            if (Rewrite.InsertText(insertLoc, insertStatement))
-                                llvm::errs() << "error inserting\n";
-                            // llvm::outs() <<"inserted\n";
-                            modified = true;
 
-                        } else {
-                            // llvm::outs() <<"else leg\n";
-                            NodeRef nearestChildNode = targetNode.getChild(Offset - 1);
-                            // llvm::outs() <<"got child\n";
-                            insertLoc = nearestChildNode.getSourceRange().getEnd();
-                            // llvm::outs() <<"got loc\n";
-                            Rewrite.InsertTextAfterToken(insertLoc, insertStatement);
-                            // llvm::outs() <<"inserted\n";
-                            modified = true;
                         }
-
-
-                    }
-
+                        break;
                 }
 
 
@@ -1351,9 +1347,9 @@ namespace clang {
             // llvm::outs() << "nodes matched\n";
             CharSourceRange range;
 
-            if (targetNode.getTypeLabel() == "BinaryOperator") {
+            if (targetNode.getKind() == NodeKind::BinaryOperator) {
 
-                SourceRange r = targetNode.ASTNode.getSourceRange();
+                SourceRange r = targetNode.getASTNode().getSourceRange();
                 range.setBegin(r.getBegin());
                 range.setEnd(r.getEnd());
 
@@ -1378,7 +1374,7 @@ namespace clang {
             std::string oldValue = targetNode.getValue();
 
 
-            if (targetNode.getTypeLabel() == "MemberExpr") {
+            if (targetNode.getKind() == NodeKind::MemberExpr) {
 
                 updateValue = updateValue.substr(1);
                 oldValue = oldValue.substr(1);
@@ -1464,6 +1460,12 @@ namespace clang {
                 return error(patching_error::failed_to_build_AST);
             SyntaxTree Target(*TargetASTs[0]);
 
+            return patch(TargetTool, Src, Target, MapFilePath, SkipList, ScriptFilePath, Options, Debug);
+        }
+
+        Error patch(RefactoringTool &TargetTool, SyntaxTree &Src, SyntaxTree &Target, std::string MapFilePath, std::string SkipList, std::string ScriptFilePath,
+                    const ComparisonOptions &Options, bool Debug) {
+
             Patcher crochetPatcher(Src, Target, Options, TargetTool, Debug);
             crochetPatcher.loadVariableMapping(MapFilePath);
             crochetPatcher.loadSkipList(SkipList);
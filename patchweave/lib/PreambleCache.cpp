@@ -0,0 +1,192 @@
+//===- PreambleCache.cpp - Preambles shared between versions --*- C++ -*- -===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "patchweave/PreambleCache.h"
+
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+
+using namespace llvm;
+using namespace clang;
+using namespace tooling;
+
+namespace clang {
+namespace diff {
+
+// Returns true if Preamble may include a file relative to the directory of the
+// main file. Includes that are not bracketed are treated as quoted.
+static bool hasQuotedInclude(StringRef Preamble) {
+  SmallVector<StringRef, 32> Lines;
+  Preamble.split(Lines, '\n');
+  for (StringRef Line : Lines) {
+    Line = Line.ltrim();
+    if (!Line.consume_front("#"))
+      continue;
+    Line = Line.ltrim();
+    if (!Line.consume_front("include") && !Line.consume_front("import"))
+      continue;
+    Line.consume_front("_next");
+    if (!Line.ltrim().startswith("<"))
+      return true;
+  }
+  return false;
+}
+
+namespace {
+
+// Does what ASTBuilderAction in Tooling.cpp does, with a preamble added to the
+// invocation when one can be shared.
+class PreambleASTBuilder : public ToolAction {
+public:
+  PreambleASTBuilder(PreambleCache &Cache, std::string CommandKey,
+                     std::vector<std::unique_ptr<ASTUnit>> &ASTs)
+      : Cache(Cache), CommandKey(std::move(CommandKey)), ASTs(ASTs) {}
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    addPreamble(*Invocation, Files, PCHContainerOps);
+    std::unique_ptr<ASTUnit> AST = ASTUnit::LoadFromCompilerInvocation(
+        Invocation, std::move(PCHContainerOps),
+        CompilerInstance::createDiagnostics(&Invocation->getDiagnosticOpts(),
+                                            DiagConsumer,
+                                            /*ShouldOwnClient=*/false),
+        Files);
+    if (!AST)
+      return false;
+    ASTs.push_back(std::move(AST));
+    return true;
+  }
+
+private:
+  void addPreamble(CompilerInvocation &Invocation, FileManager *Files,
+                   std::shared_ptr<PCHContainerOperations> PCHContainerOps) {
+    if (CommandKey.empty() || Invocation.getFrontendOpts().Inputs.size() != 1)
+      return;
+    StringRef MainFile = Invocation.getFrontendOpts().Inputs[0].getFile();
+    auto Buffer = Files->getBufferForFile(MainFile);
+    if (!Buffer)
+      return;
+    PreambleBounds Bounds = ComputePreambleBounds(
+        *Invocation.getLangOpts(), Buffer.get().get(), /*MaxLines=*/0);
+    if (Bounds.Size == 0)
+      return;
+    StringRef PreambleText = Buffer.get()->getBuffer().take_front(Bounds.Size);
+
+    std::string Key = CommandKey;
+    if (hasQuotedInclude(PreambleText))
+      Key += llvm::sys::path::parent_path(MainFile);
+    Key += '\0';
+    Key += Bounds.PreambleEndsAtStartOfLine ? '1' : '0';
+    Key += PreambleText;
+
+    IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS =
+        Files->getVirtualFileSystem();
+    auto Build = [&]() -> std::shared_ptr<PrecompiledPreamble> {
+      // Errors in the headers make the build fail, they are reported by
+      // the plain parse that follows.
+      IntrusiveRefCntPtr<DiagnosticsEngine> Diags =
+          CompilerInstance::createDiagnostics(
+              &Invocation.getDiagnosticOpts(), new IgnoringDiagConsumer());
+      PreambleCallbacks Callbacks;
+      llvm::ErrorOr<PrecompiledPreamble> Built = PrecompiledPreamble::Build(
+          Invocation, Buffer.get().get(), Bounds, *Diags, VFS,
+          PCHContainerOps, /*StoreInMemory=*/false, Callbacks);
+      if (!Built)
+        return nullptr;
+      return std::make_shared<PrecompiledPreamble>(std::move(*Built));
+    };
+    auto CanReuse = [&](const std::shared_ptr<PrecompiledPreamble> &Preamble) {
+      return Preamble && Preamble->CanReuse(Invocation, Buffer.get().get(),
+                                            Bounds, VFS.get());
+    };
+    std::shared_ptr<PrecompiledPreamble> Preamble =
+        Cache.getPreamble(Key, Build);
+    // A header changed since the preamble was built, build it again. If that
+    // one is out of date as well, the file is parsed without a preamble.
+    if (Preamble && !CanReuse(Preamble)) {
+      Cache.remove(Key, Preamble);
+      Preamble = Cache.getPreamble(Key, Build);
+    }
+    if (!CanReuse(Preamble))
+      return;
+    Preamble->AddImplicitPreamble(Invocation, VFS, Buffer.get().get());
+  }
+
+  PreambleCache &Cache;
+  std::string CommandKey;
+  std::vector<std::unique_ptr<ASTUnit>> &ASTs;
+};
+
+} // end anonymous namespace
+
+std::unique_ptr<ToolAction>
+PreambleCache::newASTBuilder(const CompilationDatabase &Compilations,
+                             StringRef Filename,
+                             std::vector<std::unique_ptr<ASTUnit>> &ASTs) {
+  std::vector<CompileCommand> Commands =
+      Compilations.getCompileCommands(Filename);
+  std::string CommandKey;
+  if (!Commands.empty()) {
+    CommandKey = Commands[0].Directory;
+    CommandKey += '\0';
+    for (const std::string &Arg : Commands[0].CommandLine) {
+      if (Arg == Commands[0].Filename)
+        continue;
+      CommandKey += Arg;
+      CommandKey += '\0';
+    }
+  }
+  return llvm::make_unique<PreambleASTBuilder>(*this, std::move(CommandKey),
+                                               ASTs);
+}
+
+std::shared_ptr<PrecompiledPreamble> PreambleCache::getPreamble(
+    const std::string &Key,
+    llvm::function_ref<std::shared_ptr<PrecompiledPreamble>()> Build) {
+  std::promise<std::shared_ptr<PrecompiledPreamble>> Promise;
+  PendingPreamble Pending;
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto It = llvm::find_if(
+        Entries, [&](const Entry &E) { return E.Key == Key; });
+    if (It != Entries.end()) {
+      Entries.splice(Entries.begin(), Entries, It);
+      Pending = It->Value;
+    } else {
+      if (!Entries.empty() && Entries.size() >= Capacity)
+        Entries.pop_back();
+      Entries.push_front({Key, Promise.get_future().share()});
+    }
+  }
+  if (Pending.valid())
+    return Pending.get();
+  std::shared_ptr<PrecompiledPreamble> Preamble = Build();
+  Promise.set_value(Preamble);
+  return Preamble;
+}
+
+void PreambleCache::remove(const std::string &Key,
+                           const std::shared_ptr<PrecompiledPreamble> &Stale) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto It = llvm::find_if(Entries, [&](const Entry &E) {
+    return E.Key == Key &&
+           E.Value.wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready &&
+           E.Value.get() == Stale;
+  });
+  if (It != Entries.end())
+    Entries.erase(It);
+}
+
+} // end namespace diff
+} // end namespace clang
@@ -12,11 +12,18 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "patchweave/ASTCache.h"
 #include "patchweave/ASTDiff.h"
+#include "patchweave/CompilationDatabaseCache.h"
 #include "patchweave/ASTPatch.h"
+#include "patchweave/PreambleCache.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ThreadPool.h"
 
 
 using namespace llvm;
@@ -35,7 +42,14 @@ static cl::opt<std::string> SkipList("skip-list", cl::desc("<lines to skip in tr
 static cl::opt<std::string> StopAfter("stop-diff-after", cl::desc("<topdown|bottomup>"), cl::Optional, cl::init(""), cl::cat(PatchWeaveCategory));
 static cl::opt<int> MaxSize("s", cl::desc("<maxsize>"), cl::Optional, cl::init(-1), cl::cat(PatchWeaveCategory));
 static cl::opt<float> MinSimilarity("min-sim", cl::desc("<minsimilarity>"), cl::Optional, cl::init(-1), cl::cat(PatchWeaveCategory));
+static cl::opt<std::string> NodeHash("node-hash", cl::desc("Hash function for comparing nodes, xxhash (the default) or md5"), cl::Optional, cl::init(""), cl::cat(PatchWeaveCategory));
+static cl::opt<bool> MatchRenamed("match-renamed", cl::desc("Also match subtrees that only differ in the names in them"), cl::init(false), cl::Optional, cl::cat(PatchWeaveCategory));
 static cl::opt<std::string> BuildPath("p", cl::desc("Build path"), cl::init(""), cl::Optional, cl::cat(PatchWeaveCategory));
+static cl::opt<std::string> ASTCacheDir("ast-cache-dir", cl::desc("Directory for caching serialized ASTs across invocations"), cl::init(""), cl::Optional, cl::cat(PatchWeaveCategory));
+static cl::opt<bool> SharePreamble("share-preamble", cl::desc("Compile the headers shared by the input files into one preamble"), cl::init(false), cl::Optional, cl::cat(PatchWeaveCategory));
+static cl::opt<bool> MainFileOnly("main-file-only", cl::desc("Build syntax trees only from the declarations in the main file and in the files given to -tree-files"), cl::init(false), cl::Optional, cl::cat(PatchWeaveCategory));
+static cl::list<std::string> TreeFiles("tree-files", cl::desc("Build syntax trees only from the declarations in files that match one of these globs, and in the main file with -main-file-only"), cl::CommaSeparated, cl::cat(PatchWeaveCategory));
+static cl::list<std::string> TreeDecls("tree-decls", cl::desc("Build syntax trees only from the top-level declarations with these names"), cl::CommaSeparated, cl::cat(PatchWeaveCategory));
 static cl::list<std::string> ArgsAfter("extra-arg", cl::desc("Additional argument to append to the compiler command line"), cl::cat(PatchWeaveCategory));
 static cl::list<std::string> ArgsBefore("extra-arg-before", cl::desc("Additional argument to prepend to the compiler command line"), cl::cat(PatchWeaveCategory));
 
@@ -53,11 +67,14 @@ static void addExtraArgs(std::unique_ptr<CompilationDatabase> &Compilations) {
 }
 
 
+// Compilation databases found so far, shared by all inputs of this process.
+static diff::CompilationDatabaseCache CompilationDatabases;
+
 static std::unique_ptr<CompilationDatabase>
 getCompilationDatabase(StringRef Filename) {
   std::string ErrorMessage;
   std::unique_ptr<CompilationDatabase> Compilations =
-      CompilationDatabase::autoDetectFromSource(
+      CompilationDatabases.autoDetectFromSource(
           BuildPath.empty() ? Filename : BuildPath, ErrorMessage);
   if (!Compilations) {
     llvm::errs()
@@ -79,28 +96,137 @@ bool in_array(const std::string &value, const std::vector<std::string> &array)
 
 
 
+// Preambles shared by all ASTs built with -share-preamble.
+static diff::PreambleCache Preambles;
+
+namespace {
+// Does what ASTBuilderAction in Tooling.cpp does.
+class ASTBuilder : public ToolAction {
+public:
+  ASTBuilder(std::vector<std::unique_ptr<ASTUnit>> &ASTs) : ASTs(ASTs) {}
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    std::unique_ptr<ASTUnit> AST = ASTUnit::LoadFromCompilerInvocation(
+        Invocation, std::move(PCHContainerOps),
+        CompilerInstance::createDiagnostics(&Invocation->getDiagnosticOpts(),
+                                            DiagConsumer,
+                                            /*ShouldOwnClient=*/false),
+        Files);
+    if (!AST)
+      return false;
+    ASTs.push_back(std::move(AST));
+    return true;
+  }
+
+private:
+  std::vector<std::unique_ptr<ASTUnit>> &ASTs;
+};
+} // end anonymous namespace
+
+// Runs Action on Filename the way ClangTool::run() does, except that relative
+// paths are resolved by a file system with its own working directory. ClangTool
+// changes the working directory of the process, which breaks parses running
+// on other threads.
+static bool runOnFile(const CompilationDatabase &Compilations,
+                      StringRef Filename, ToolAction &Action,
+                      DiagnosticConsumer &DiagConsumer) {
+  std::vector<CompileCommand> Commands =
+      Compilations.getCompileCommands(Filename);
+  if (Commands.empty())
+    return false;
+  const CompileCommand &Command = Commands[0];
+  IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> FS(
+      new llvm::vfs::OverlayFileSystem(llvm::vfs::createPhysicalFileSystem()));
+  if (FS->setCurrentWorkingDirectory(Command.Directory))
+    return false;
+  IntrusiveRefCntPtr<FileManager> Files(
+      new FileManager(FileSystemOptions(), FS));
+
+  ArgumentsAdjuster Adjuster = combineAdjusters(
+      combineAdjusters(getClangStripOutputAdjuster(),
+                       getClangSyntaxOnlyAdjuster()),
+      getClangStripDependencyFileAdjuster());
+  std::vector<std::string> CommandLine =
+      Adjuster(Command.CommandLine, Command.Filename);
+  if (llvm::none_of(CommandLine, [](StringRef Arg) {
+        return Arg.startswith("-resource-dir");
+      })) {
+    static int StaticSymbol;
+    CommandLine.push_back(
+        "-resource-dir=" +
+        CompilerInvocation::GetResourcesPath("clang_tool", &StaticSymbol));
+  }
+
+  ToolInvocation Invocation(std::move(CommandLine), &Action, Files.get());
+  Invocation.setDiagnosticConsumer(&DiagConsumer);
+  return Invocation.run();
+}
+
 static std::unique_ptr<ASTUnit>
-getAST(const std::unique_ptr<CompilationDatabase> &CommonCompilations,
-       const StringRef Filename) {
-  std::array<std::string, 1> Files = {{Filename}};
-  std::unique_ptr<CompilationDatabase> FileCompilations;
-  if (!CommonCompilations)
-    FileCompilations = getCompilationDatabase(Filename);
-  ClangTool Tool(CommonCompilations ? *CommonCompilations : *FileCompilations,
-                 Files);
+getAST(const CompilationDatabase &Compilations, const StringRef Filename,
+       raw_ostream &ErrOS) {
+  diff::ASTCache Cache(ASTCacheDir);
+  if (!ASTCacheDir.empty())
+    if (std::unique_ptr<ASTUnit> AST = Cache.load(Compilations, Filename))
+      return AST;
   std::vector<std::unique_ptr<ASTUnit>> ASTs;
-  Tool.buildASTs(ASTs);
+  std::unique_ptr<ToolAction> Action =
+      SharePreamble ? Preambles.newASTBuilder(Compilations, Filename, ASTs)
+                    : llvm::make_unique<ASTBuilder>(ASTs);
+  TextDiagnosticPrinter DiagPrinter(ErrOS, new DiagnosticOptions());
+  if (!runOnFile(Compilations, Filename, *Action, DiagPrinter))
+    ErrOS << "Error while processing " << Filename << ".\n";
   if (ASTs.size() == 0){
-    llvm::errs() << "Error: no AST built\n";
+    ErrOS << "Error: no AST built\n";
     return NULL;
   }
-  if (ASTs.size() != Files.size()){    
-    llvm::errs() << "more than one tree was built\n";
-  }
+  // Units built on a shared preamble depend on its temporary file.
+  if (!ASTCacheDir.empty() && !SharePreamble)
+    Cache.store(Compilations, Filename, *ASTs[0]);
   
   return std::move(ASTs[0]);
 }
 
+// Builds the ASTs for all Files, one thread per file, whatever directories
+// they are compiled in. Diagnostics are buffered per file and printed in the
+// order of Files once all of them are done.
+static std::vector<std::unique_ptr<ASTUnit>>
+getASTs(const std::unique_ptr<CompilationDatabase> &CommonCompilations,
+        std::vector<std::string> Files) {
+  std::vector<std::unique_ptr<CompilationDatabase>> FileCompilations(Files.size());
+  std::vector<const CompilationDatabase *> Compilations;
+  for (size_t I = 0, E = Files.size(); I < E; ++I) {
+    if (!CommonCompilations)
+      FileCompilations[I] = getCompilationDatabase(Files[I]);
+    Compilations.push_back(CommonCompilations ? CommonCompilations.get()
+                                              : FileCompilations[I].get());
+    SmallString<256> AbsolutePath(Files[I]);
+    if (!llvm::sys::fs::make_absolute(AbsolutePath))
+      Files[I] = AbsolutePath.str();
+  }
+
+  std::vector<std::unique_ptr<ASTUnit>> ASTs(Files.size());
+  std::vector<std::string> Errors(Files.size());
+  auto Build = [&](size_t I) {
+    llvm::raw_string_ostream ErrOS(Errors[I]);
+    ASTs[I] = getAST(*Compilations[I], Files[I], ErrOS);
+  };
+
+  // Every parse resolves relative paths against its own compile directory, so
+  // files from different directories can be parsed at the same time.
+  llvm::ThreadPool Pool(Files.size());
+  for (size_t I = 0, E = Files.size(); I < E; ++I)
+    Pool.async(Build, I);
+  Pool.wait();
+
+  for (const std::string &Error : Errors)
+    llvm::errs() << Error;
+  return ASTs;
+}
+
 
 
 int main(int argc, const char **argv) {
@@ -117,11 +243,29 @@ int main(int argc, const char **argv) {
   }
   
   addExtraArgs(CommonCompilations);
-  std::unique_ptr<ASTUnit> Src = getAST(CommonCompilations, SourcePath);
+  diff::TreeFilter Filter;
+  Filter.MainFileOnly = MainFileOnly;
+  Filter.DeclNames.assign(TreeDecls.begin(), TreeDecls.end());
+  for (const std::string &Glob : TreeFiles) {
+    if (auto Err = Filter.addFileGlob(Glob)) {
+      llvm::errs() << "Error: Invalid glob '" << Glob
+                   << "': " << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+  }
+
+  // The source and the target are independent, so they are parsed
+  // concurrently.
+  std::vector<std::unique_ptr<ASTUnit>> ASTs =
+      getASTs(CommonCompilations, {SourcePath, TargetPath});
+  std::unique_ptr<ASTUnit> Src = std::move(ASTs[0]);
+  std::unique_ptr<ASTUnit> Tgt = std::move(ASTs[1]);
  
-  if (!Src){
+  if (!Src || !Tgt){
     if (!Src)
       llvm::errs() << "Error: Could not build AST for source\n";
+    if (!Tgt)
+      llvm::errs() << "Error: Could not build AST for target\n";
     return 1;
   }
 
@@ -138,33 +282,30 @@ int main(int argc, const char **argv) {
       return 1;
     }
   }
+  if (NodeHash == "md5")
+    Options.Hash = diff::HashKind::MD5;
+  else if (!NodeHash.empty() && NodeHash != "xxhash") {
+    llvm::errs() << "Error: Invalid argument for -node-hash\n";
+    return 1;
+  }
+  Options.MatchRenamedSubtrees = MatchRenamed;
 
-  // llvm::outs() << "Building AST for target\n";
-
- 
   std::unique_ptr<CompilationDatabase> FileCompilations;
   if (!CommonCompilations)
     FileCompilations = getCompilationDatabase(TargetPath);
 
   std::array<std::string, 1> Files = {{TargetPath}};
   RefactoringTool TargetTool(CommonCompilations ? *CommonCompilations : *FileCompilations, Files);
-  std::vector<std::unique_ptr<ASTUnit>> TargetASTs;
-  TargetTool.buildASTs(TargetASTs);
-
-  if (TargetASTs.size() == 0){
-    llvm::errs() << "Error: Could not build AST for target\n";
-    return 1;
-  }
 
 
 
   // llvm::outs() << "Creating synax trees\n";
 
-  diff::SyntaxTree SrcTree(*Src);
-//  diff::SyntaxTree TgtTree(*Tgt);
+  diff::SyntaxTree SrcTree(*Src, Filter);
+  diff::SyntaxTree TgtTree(*Tgt, Filter);
 
   
-  if (auto Err = diff::patch(TargetTool, SrcTree, MapPath, SkipList, ScriptPath, Options)) {
+  if (auto Err = diff::patch(TargetTool, SrcTree, TgtTree, MapPath, SkipList, ScriptPath, Options)) {
       llvm::handleAllErrors(
           std::move(Err),
           [](const diff::PatchingError &PE) { PE.log(llvm::errs()); },